@@ -1,10 +1,12 @@
 #ifndef	LWMQTT_H
 #define	LWMQTT_H
 // Light weight MQTT client
-// QoS 0 only, no queuing or resending (using TCP to do that for us)
+// QoS 0, no queuing or resending (using TCP to do that for us)
+// Optional QoS 1 for chosen messages, held in a small in flight window until PUBACK, and resent (DUP) on reconnect
 // Live sending to TCP for outgoing messages
 // Simple callback for incoming messages
-// Automatic reconnect
+// Automatic reconnect, with optional failover list of hosts (fastest to connect favouring earlier in list, or in order for TLS, with failback)
+// Optional (CONFIG_REVK_MQTT_SERVER) light weight broker, QoS 0, with + and # wildcards and retained messages
 
 // Callback function for a connection (client or server)
 // For client, the arg passed is as specified in the client config
@@ -18,11 +20,34 @@
 // Called for disconnect
 // - Topic is NULL
 // - Payload is NULL
-// Called as server for subscribe
+// Called as server for subscribe (after any retained messages have been sent)
 // - Topic is subscribe pattern
 // - Payload is NULL
+// Note that as server all incoming messages are also routed to matching subscribers by the broker
 typedef void lwmqtt_callback_t(void *arg, char *topic, unsigned short len, unsigned char *payload);
 
+// Completion callback for QoS 1 send
+// - err is NULL when PUBACK received, else reason message was dropped
+typedef void lwmqtt_done_t(void *arg, const char *err);
+
+// Connection stats, counts are since the client was created so cover reconnects
+#define	LWMQTT_RTT_BUCKETS	8       // Ping RTT histogram <10ms, <20ms, <50ms, <100ms, <200ms, <500ms, <1s, more
+typedef struct lwmqtt_stats_s lwmqtt_stats_t;
+struct lwmqtt_stats_s {
+   uint32_t tx_bytes;           // Bytes sent (before TLS)
+   uint32_t rx_bytes;           // Bytes received (after TLS)
+   uint32_t tx_msgs;            // Packets sent
+   uint32_t rx_msgs;            // Packets received
+   uint32_t blocked;            // Time (ms) spent in writes
+   uint32_t rtt;                // Last ping round trip (ms)
+   uint32_t rtt_hist[LWMQTT_RTT_BUCKETS];       // Ping round trip histogram
+   uint32_t connects;           // Connections made (CONNACK received)
+   uint32_t fails;              // Connections attempts that failed
+   uint32_t handshake;          // Last TLS handshake (ms)
+   const char *host;            // Host from failover list last connected to
+   const char *reason;          // Why last connection closed or failed (static string)
+};
+
 typedef struct lwmqtt_client_config_s lwmqtt_client_config_t;
 
 // Config for connection
@@ -30,12 +55,13 @@ struct lwmqtt_client_config_s {
    lwmqtt_callback_t *callback;
    void *arg;
    const char *client;
-   const char *hostname;        // Name or IP
+   const char *hostname;        // Name or IP, or space/comma separated failover list, preferred first
    const char *username;
    const char *password;
    const char *tlsname;         // Name of cert if not host name
    unsigned short port;         // Port 0=auto
    unsigned short keepalive;    // 0=default
+   uint8_t inflight;            // QoS 1 in flight window size, 0=default
    // Will
    const char *topic;           // Will topic
    int plen;                    // Will payload len (-1 does strlen)
@@ -63,6 +89,8 @@ typedef struct lwmqtt_server_config_s lwmqtt_server_config_t;
 struct lwmqtt_server_config_s {
    lwmqtt_callback_t *callback;
    unsigned short port;         // Port 0=auto
+   const char *username;        // Login required from clients, NULL for none (no login check)
+   const char *password;        // NULL for none
    // TLS
    void *ca_cert_buf;           // For checking server
    int ca_cert_bytes;
@@ -85,7 +113,7 @@ uint32_t uptime(void);          // Seconds uptime
 lwmqtt_t lwmqtt_client(lwmqtt_client_config_t *);
 
 #ifdef	CONFIG_REVK_MQTT_SERVER
-// Start a server (the return value is only usable in lwmqtt_end)
+// Start a server (the return value is only usable in lwmqtt_end, and lwmqtt_send_full to publish locally in to the broker)
 lwmqtt_t lwmqtt_server(lwmqtt_server_config_t *);
 #endif
 
@@ -98,11 +126,38 @@ const char *lwmqtt_subscribeub(lwmqtt_t, const char *topic, char unsubscribe);
 #define lwmqtt_subscribe(h,t) lwmqtt_subscribeub(h,t,0);
 #define lwmqtt_unsubscribe(h,t) lwmqtt_subscribeub(h,t,1);
 
+// Subscribe multiple topics, packed in to as few SUBSCRIBE packets as possible (return is non null error message if failed)
+const char *lwmqtt_subscribeub_multi(lwmqtt_t, int count, const char *const *topics, char unsubscribe);
+#define lwmqtt_subscribe_multi(h,n,t) lwmqtt_subscribeub_multi(h,n,t,0);
+#define lwmqtt_unsubscribe_multi(h,n,t) lwmqtt_subscribeub_multi(h,n,t,1);
+
 // Send (return is non null error message if failed) (-1 tlen or plen do strlen)
 const char *lwmqtt_send_full(lwmqtt_t, int tlen, const char *topic, int plen, const unsigned char *payload, char retain);
 // Simpler
-#define lwmqtt_send(h,t,l,p) lwmqtt_send_full(h,-1,t,l,p,0,0);
+#define lwmqtt_send(h,t,l,p) lwmqtt_send_full(h,-1,t,l,p,0);
+
+// Send QoS 1 (return is non null error message if not accepted, e.g. window full)
+// Accepted even if not connected, sent on connect. The done callback (if not NULL) is called on PUBACK, or with error if dropped.
+const char *lwmqtt_send_qos1(lwmqtt_t, int tlen, const char *topic, int plen, const unsigned char *payload, char retain, lwmqtt_done_t * done, void *arg);
+
+// Shared message, encoded once and sent to several connections without copying, reference counted
+typedef struct lwmqtt_msg_s lwmqtt_msg_t;
+lwmqtt_msg_t *lwmqtt_msg(int tlen, const char *topic, int plen, const unsigned char *payload, char retain);     // NULL if failed
+lwmqtt_msg_t *lwmqtt_msg_hold(lwmqtt_msg_t *);  // Add a reference
+void lwmqtt_msg_release(lwmqtt_msg_t **);       // Drop a reference, NULLs the passed pointer
+int lwmqtt_msg_topic(lwmqtt_msg_t *, const char **topic);       // Topic (not null terminated), returns length
+int lwmqtt_msg_payload(lwmqtt_msg_t *, const unsigned char **payload);  // Payload, returns length
+// Send shared message (return is non null error message if failed), qos set for QoS 1 as lwmqtt_send_msg_qos1 with no callback
+const char *lwmqtt_send_msg(lwmqtt_t, lwmqtt_msg_t *, char retain, char qos);
+// Send shared message QoS 1, as lwmqtt_send_qos1, but the in flight window holds a reference rather than a copy
+const char *lwmqtt_send_msg_qos1(lwmqtt_t, lwmqtt_msg_t *, char retain, lwmqtt_done_t * done, void *arg);
 
 // Simple send - non retained no wait topic ends on space then payload
 const char *lwmqtt_send_str(lwmqtt_t, const char *msg);
+
+// Last TLS handshake time (ms), 0 if not TLS, sets resumed if it took under half the last full handshake, i.e. the server accepted the saved session
+uint32_t lwmqtt_handshake(lwmqtt_t, uint8_t * resumed);
+
+// Get connection stats (return is non null error message if failed)
+const char *lwmqtt_stats(lwmqtt_t, lwmqtt_stats_t *);
 #endif
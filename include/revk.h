@@ -38,7 +38,22 @@
         // Target can be something not for us if extra subscribes done, but if it is for us, or internal, it is passes as NULL
         // Suffix can be NULL
 typedef const char *app_callback_t(int client, const char *prefix, const char *target, const char *suffix, jo_t);
+        // Command handler: tag is command name, jo_t is payload or NULL. Return as app_callback_t, NULL means not handled.
+typedef const char *revk_command_t(const char *tag, jo_t);
+        // Setting change handler: tag is setting (with any number suffix), called after settings committed, for LIVE settings only
+        // For strings and dynamic binary old/new are the value (char* / revk_bindata_t*), else they point to the value. old is freed after the call
+typedef void revk_setting_changed_t(const char *tag, const void *old, const void *new);
 typedef uint8_t mac_t[6];
+typedef union
+{                               // GPIO setting (SETTING_SET|SETTING_BITFIELD with "-" prefix), decoded as stored
+   uint8_t value;               // Raw value
+   struct
+   {
+      uint8_t num:6;            // GPIO number
+      uint8_t invert:1;         // Active low ('-' prefix)
+      uint8_t set:1;            // GPIO is set
+   };
+} revk_gpio_t;
 
 // Data
 extern const char *revk_app;    // App name
@@ -84,6 +99,37 @@ void revk_register(const char *name,    // Setting name (note max 15 characters
 #define	SETTING_HEX		32      // Source string is hex coded
 #define	SETTING_SET		64      // Set top bit of numeric if a value is present at all
 #define	SETTING_SECRET		128     // Don't dump setting
+// Register a table of settings, e.g. a static const table made from X-macros using REVK_SETTING, call from init, parents before children. Table must remain (not copied)
+// REVK_SETTING takes the same arguments as revk_register (name, array, size, data, defval, flags), name must be a string literal, e.g.
+//   #define settings u8(level,3) s(name,"x") b(debug,0)
+//   #define u8(n,d) uint8_t n;
+//   #define s(n,d) char *n;
+//   #define b(n,d) uint8_t n;
+//   settings                                   // The variables
+//   #undef u8 ... then in app_main after revk_boot
+//   #define u8(n,d) REVK_SETTING(#n,0,1,&n,#d,0),
+//   #define s(n,d) REVK_SETTING(#n,0,0,&n,d,0),
+//   #define b(n,d) REVK_SETTING(#n,0,1,&n,#d,SETTING_BOOLEAN),
+//   static const revk_setting_def_t app_settings[] = { settings };  // In flash
+//   revk_register_table(app_settings, sizeof(app_settings) / sizeof(*app_settings));
+// A parent entry (SETTING_SECRET, name is a prefix of the children) must come before its children
+typedef struct {                // Setting descriptor
+   const char *name;            // Setting name
+   const char *defval;          // Default value
+   void *data;                  // The setting itself
+   uint16_t size;               // Base setting size
+   uint8_t array;               // Array size, or 0
+   uint8_t flags;               // Setting flags
+   uint8_t namelen;             // Length of name
+} revk_setting_def_t;
+#define	REVK_SETTING(name,array,size,data,defval,flags)	{name,defval,data,size,array,flags,sizeof(name)-1}    // name must be literal
+void revk_register_table(const revk_setting_def_t *, int count);
+// Dynamic (string / binary) settings are replaced, not changed in place, and the old value is freed only once readers are done
+// Readers in other tasks that hold a setting pointer for more than a moment should wrap use in these, no locking involved
+int revk_setting_read_begin(void);      // Returns value to pass to revk_setting_read_end
+void revk_setting_read_end(int);
+// Call handler when a setting changes, call from init after revk_register. Name can be a parent to watch all of its children. Returns error or NULL
+const char *revk_setting_watch(const char *name, revk_setting_changed_t * handler);
 
 #if CONFIG_LOG_DEFAULT_LEVEL > 2
 esp_err_t revk_err_check(esp_err_t, const char *file, int line, const char *func, const char *cmd);     // Log if error
@@ -115,10 +161,24 @@ void revk_mqtt_send_clients(const char *prefix, int retain, const char *suffix,
 
 const char *revk_setting(jo_t); // Store settings
 const char *revk_command(const char *tag, jo_t);        // Do an internal command
+// Register a command, call from init after revk_boot. Commands for us from the main MQTT server, or revk_command, go to the handler. Listed by command "commands".
+void revk_register_command(const char *name,    // Command name (not copied)
+                           revk_command_t * handler,    // Handler
+                           uint8_t flags,       // Command flags
+                           const char *schema); // Hint for payload (JSON), or NULL
+#define	REVK_COMMAND_ARG	1       // Needs a payload
+#define	REVK_COMMAND_HIDE	2       // Not listed by command "commands"
 const char *revk_restart(const char *reason, int delay);        // Restart cleanly
 const char *revk_ota(const char *host, const char *target);     // OTA and restart cleanly (target NULL for self as root node)
 
 #ifdef	CONFIG_REVK_MQTT
+// Route incoming MQTT to a handler, call from init after revk_boot and before revk_start. Prefix is a prefix setting, e.g. &prefixcommand, or NULL for any.
+// Target is exact match, ending * for any starting with the rest, or NULL for any. Suffix is exact match or NULL for any.
+// Specific suffix routes are checked first, first match is used. app_callback is still called after unless REVK_ROUTE_ONLY.
+const char *revk_route(char **prefix, const char *target, const char *suffix, uint8_t flags, app_callback_t * handler);
+#define	REVK_ROUTE_US		1       // Only if target is us (target passed as NULL)
+#define	REVK_ROUTE_MAIN		2       // Only from main MQTT server (client 0)
+#define	REVK_ROUTE_ONLY		4       // Do not also pass to app_callback
 void revk_mqtt_init(void);
 lwmqtt_t revk_mqtt(int);
 void revk_mqtt_close(const char *reason);       // Clean close MQTT
@@ -135,6 +195,8 @@ int revk_wait_wifi(int seconds);
 extern uint16_t meshmax;
 void revk_send_sub(int client, const mac_t);
 void revk_send_unsub(int client, const mac_t);
+void revk_send_sub_multi(int client, int count, const mac_t *);      // Batched, for many leaf nodes, fewer SUBSCRIBE packets
+void revk_send_unsub_multi(int client, int count, const mac_t *);
 void revk_mesh_send_json(const mac_t mac, jo_t * jp);
 #endif
 void revk_blink(uint8_t on, uint8_t off, const char *colours);  // Set LED blink rate and colour sequence for on state (for RGB LED)
@@ -1,15 +1,11 @@
 // Light weight MQTT client
-// QoS 0 only, no queuing or resending (using TCP to do that for us)
+// QoS 0, and QoS 1 sends held in a small window until PUBACK and resent on reconnect, no QoS 2
 // Live sending to TCP for outgoing messages
 // Simple callback for incoming messages
-// Automatic reconnect
+// Automatic reconnect, with failover between server addresses
 static const char
     __attribute__((unused)) * TAG = "LWMQTT";
 
-#ifdef	CONFIG_REVK_MQTT_SERVER
-#warning MQTT server code is not complete
-#endif
-
 #include "config.h"
 #include <stdio.h>
 #include <stdint.h>
@@ -17,6 +13,7 @@ static const char
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
 #include "esp_wifi.h"
 #include "esp_system.h"
 #include "nvs_flash.h"
@@ -39,14 +36,67 @@ static const char
 #else
 #include "lecert.h"
 #endif
+#ifdef  CONFIG_ESP_TLS_SERVER
+#include "mbedtls/oid.h"
+#endif
 
 #include "lwmqtt.h"
 
+#ifndef	LWMQTT_INFLIGHT
+#define	LWMQTT_INFLIGHT	8       // Default QoS 1 in flight window
+#endif
+
+#ifndef	LWMQTT_PINGWAIT
+#define	LWMQTT_PINGWAIT	10      // Seconds to wait for PINGRESP before treating the link as dead
+#endif
+
+#ifndef	LWMQTT_ADDRS
+#define	LWMQTT_ADDRS	8       // Addresses cached from DNS, and raced on connect
+#endif
+
+#ifndef	LWMQTT_HOSTS
+#define	LWMQTT_HOSTS	4       // Hosts in failover list
+#endif
+
+#ifndef	LWMQTT_FAILBACK
+#define	LWMQTT_FAILBACK	300     // Seconds between checking if a preferred host is back
+#endif
+
+#ifndef	LWMQTT_FAILBACKMAX
+#define	LWMQTT_FAILBACKMAX	3600    // Most seconds between checks, backing off while preferred hosts stay down
+#endif
+
+#ifndef	LWMQTT_DNSTTL
+#define	LWMQTT_DNSTTL	300     // Seconds to keep DNS result (getaddrinfo does not give us the TTL)
+#endif
+
+#ifndef	LWMQTT_STAGGER
+#define	LWMQTT_STAGGER	250     // ms between starting connects to each address
+#endif
+
+#ifndef	LWMQTT_CONNECT
+#define	LWMQTT_CONNECT	10      // Seconds to wait for a connect
+#endif
+
+#ifndef	LWMQTT_SUBMAX
+#define	LWMQTT_SUBMAX	1024    // Max SUBSCRIBE/UNSUBSCRIBE packet size when packing multiple topics
+#endif
+
 uint32_t uptime(void)
 {
    return esp_timer_get_time() / 1000000LL ? : 1;
 }
 
+typedef struct lwmqtt_inflight_s lwmqtt_inflight_t;
+struct lwmqtt_inflight_s {      // QoS 1 message waiting PUBACK
+   lwmqtt_msg_t *msg;           // Held shared message, packet ID added when written
+   unsigned short id;           // Packet ID
+   lwmqtt_done_t *done;         // Completion callback
+   void *arg;
+   uint8_t retain:1;
+   uint8_t sent:1;              // Has been sent, so DUP on resend
+};
+
 struct lwmqtt_s {               // mallocd copies
    lwmqtt_callback_t *callback;
    void *arg;
@@ -61,6 +111,25 @@ struct lwmqtt_s {               // mallocd copies
    unsigned short keepalive;
    unsigned short seq;
    uint32_t ka;                 // Keep alive next ping
+   int64_t ping;                // When PINGREQ sent, 0 if not waiting PINGRESP
+   lwmqtt_stats_t stats;
+   char *hosts;                 // Copy of hostname, split in to failover list, preferred first
+   char *host[LWMQTT_HOSTS];
+   uint8_t hostn;               // Number of hosts
+   uint8_t hostnow;             // Host we are connected to
+   uint8_t hostbad;             // Bit per host that failed connect, TLS or CONNACK, skipped until all have
+   uint32_t failback;           // When next to check for a preferred host
+   uint32_t probewait;          // Seconds between checks, doubles each time preferred hosts are still down
+   int probe;                   // Non blocking connect checking a preferred host is back, -1 if none
+   uint32_t probed;             // When probe started
+   uint8_t probeaddr;           // Next preferred address to probe
+   struct sockaddr_storage addr[LWMQTT_ADDRS];  // Cached DNS result, in host order, families interleaved
+   uint8_t addrhost[LWMQTT_ADDRS];      // Which host each address is for
+   uint32_t resolved;           // When DNS cached
+   uint8_t addrs;               // Number of addresses cached
+   lwmqtt_inflight_t *inflight; // QoS 1 in flight window, oldest first (malloc'd on first use)
+   uint8_t inflights;           // Size of in flight window
+   uint8_t inflightn;           // Number in flight
    uint8_t backoff;             // Reconnect backoff
    uint8_t running:1;           // Should still run
    uint8_t server:1;            // This is a server
@@ -77,21 +146,47 @@ struct lwmqtt_s {               // mallocd copies
    void *our_key_buf;           // For auth
    int our_key_bytes;
     esp_err_t(*crt_bundle_attach) (void *conf);
+#ifdef	CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+   esp_tls_client_session_t *session;   // Saved TLS session to resume on reconnect
+   uint32_t full;               // Last full TLS handshake (ms), a resumed one is much quicker
+#endif
+   uint8_t resumed:1;           // Last TLS handshake was a resumed session
+#ifdef	CONFIG_REVK_MQTT_SERVER
+   uint8_t listener:1;          // This is the listening server, sending goes to the broker
+   uint16_t refs;               // Session references, task and any broker sends in progress
+   char *client;                // Incoming client ID (server)
+   char *willtopic;             // Incoming will topic (server)
+   unsigned char *willpayload;  // Incoming will payload (server)
+   unsigned short willplen;
+   uint8_t willretain:1;
+   char *username;              // Required login, NULL if not checked (server)
+   char *password;
+   char *certname;              // Client certificate common name, client ID must match (server, TLS)
+#endif
 };
 
 #define	hread(handle,buf,len)	(handle->tls?esp_tls_conn_read(handle->tls,buf,len):read(handle->sock,buf,len))
 
-static int hwrite(lwmqtt_t handle, uint8_t * buf, int len)
-{                               // Send (all of) a block
+static int hwrite_cont(lwmqtt_t handle, uint8_t * buf, int len)
+{                               // Send (all of) a block, continuing a packet
    int pos = 0;
+   int64_t start = esp_timer_get_time();
    while (pos < len)
    {
       int sent = (handle->tls ? esp_tls_conn_write(handle->tls, buf + pos, len - pos) : write(handle->sock, buf + pos, len - pos));
       if (sent <= 0)
-         return sent;
+         break;
       pos += sent;
    }
-   return pos;
+   handle->stats.blocked += (esp_timer_get_time() - start) / 1000;
+   handle->stats.tx_bytes += pos;
+   return pos < len ? -1 : pos;
+}
+
+static int hwrite(lwmqtt_t handle, uint8_t * buf, int len)
+{                               // Send (all of) a block, starting a packet
+   handle->stats.tx_msgs++;
+   return hwrite_cont(handle, buf, len);
 }
 
 #define freez(x) do{if(x){free(x);x=NULL;}}while(0)
@@ -99,9 +194,23 @@ static void *handle_free(lwmqtt_t handle)
 {
    if (handle)
    {
+      for (int i = 0; i < handle->inflightn; i++)
+      {                         // Not acknowledged, so report as dropped, oldest first
+         lwmqtt_inflight_t *f = &handle->inflight[i];
+         lwmqtt_msg_release(&f->msg);
+         if (f->done)
+            f->done(f->arg, "Closed");
+      }
+      handle->inflightn = 0;
+      freez(handle->inflight);
       freez(handle->connect);
+#ifdef	CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+      if (handle->session)
+         esp_tls_free_client_session(handle->session);
+#endif
       if (!handle->hostname_ref)
          freez(handle->hostname);
+      freez(handle->hosts);
       if (!handle->tlsname_ref)
          freez(handle->tlsname);
       if (!handle->ca_cert_ref)
@@ -110,6 +219,14 @@ static void *handle_free(lwmqtt_t handle)
          freez(handle->our_cert_buf);
       if (!handle->our_key_ref)
          freez(handle->our_key_buf);
+#ifdef	CONFIG_REVK_MQTT_SERVER
+      freez(handle->client);
+      freez(handle->willtopic);
+      freez(handle->willpayload);
+      freez(handle->username);
+      freez(handle->password);
+      freez(handle->certname);
+#endif
       if (handle->mutex)
          vSemaphoreDelete(handle->mutex);
       freez(handle);
@@ -173,7 +290,411 @@ static int handle_certs(lwmqtt_t h, uint8_t ca_cert_ref, int ca_cert_bytes, void
    return fail;
 }
 
+// Shared encoded PUBLISH packet, made once and written to any number of connections
+struct lwmqtt_msg_s {
+   int refs;                    // Reference count
+   int len;                     // Packet length
+   uint16_t tlen;               // Topic length
+   uint8_t hlen;                // Header and length bytes before topic length
+   unsigned char data[];        // Packet
+};
+
+lwmqtt_msg_t *lwmqtt_msg(int tlen, const char *topic, int plen, const unsigned char *payload, char retain)
+{                               // Make a shared PUBLISH packet, NULL if failed
+   if (tlen < 0)
+      tlen = strlen(topic ? : "");
+   if (plen < 0)
+      plen = strlen((char *) payload ? : "");
+   int mlen = 2 + tlen + plen;
+   if (mlen >= 128 * 128)
+      return NULL;
+   if (mlen >= 128)
+      mlen++;                   // two byte len
+   mlen += 2;                   // header and one byte len
+   lwmqtt_msg_t *m = malloc(sizeof(*m) + mlen);
+   if (!m)
+      return m;
+   m->refs = 1;
+   m->len = mlen;
+   m->tlen = tlen;
+   unsigned char *p = m->data;
+   *p++ = 0x30 + (retain ? 1 : 0);      // message
+   if (mlen > 129)
+   {                            // Two byte len
+      *p++ = (((mlen - 3) & 0x7F) | 0x80);
+      *p++ = ((mlen - 3) >> 7);
+   } else
+      *p++ = mlen - 2;          // 1 byte len
+   m->hlen = p - m->data;
+   *p++ = tlen >> 8;
+   *p++ = tlen;
+   if (tlen)
+      memcpy(p, topic, tlen);
+   p += tlen;
+   if (plen && payload)
+      memcpy(p, payload, plen);
+   p += plen;
+   assert((p - m->data) == mlen);
+   return m;
+}
+
+lwmqtt_msg_t *lwmqtt_msg_hold(lwmqtt_msg_t * m)
+{
+   if (m)
+      __atomic_add_fetch(&m->refs, 1, __ATOMIC_SEQ_CST);
+   return m;
+}
+
+void lwmqtt_msg_release(lwmqtt_msg_t ** mp)
+{
+   lwmqtt_msg_t *m = *mp;
+   *mp = NULL;
+   if (m && !__atomic_sub_fetch(&m->refs, 1, __ATOMIC_SEQ_CST))
+      free(m);
+}
+
+int lwmqtt_msg_topic(lwmqtt_msg_t * m, const char **topic)
+{                               // Topic (not null terminated), returns length
+   *topic = (char *) m->data + m->hlen + 2;
+   return m->tlen;
+}
+
+int lwmqtt_msg_payload(lwmqtt_msg_t * m, const unsigned char **payload)
+{                               // Payload, returns length
+   *payload = m->data + m->hlen + 2 + m->tlen;
+   return m->len - m->hlen - 2 - m->tlen;
+}
+
+#ifdef	CONFIG_REVK_MQTT_SERVER
+// Broker - shared by all incoming connections
+// Subscriptions and retained messages are held in one trie, one node per topic level, so matching is by topic level and not by subscription
+// A PUBLISH is encoded once, as a shared lwmqtt_msg_t, which is then written to all matching sessions and held for retained
+
+typedef struct broker_sub_s broker_sub_t;
+struct broker_sub_s {           // Subscribed session
+   broker_sub_t *next;
+   lwmqtt_t handle;
+};
+
+typedef struct broker_node_s broker_node_t;
+struct broker_node_s {          // Topic level
+   broker_node_t *parent;
+   broker_node_t *next;         // Sibling
+   broker_node_t *child;        // First child
+   broker_sub_t *subs;          // Subscriptions for filter ending here
+   lwmqtt_msg_t *retain;        // Retained message for topic ending here
+   unsigned short len;          // Level name len
+   char level[];                // Level name (not null terminated)
+};
+
+typedef struct {                // Send to do once broker_mutex released
+   lwmqtt_t handle;             // Held session
+   lwmqtt_msg_t *msg;           // Held message
+} broker_send_t;
+
+typedef struct {                // Sends collected under broker_mutex
+   broker_send_t *send;
+   int count;
+   int max;
+   char retain;                 // Send as retained
+} broker_out_t;
+
+static SemaphoreHandle_t broker_mutex = NULL;
+static broker_node_t broker_root = { };
+
+static void session_release(lwmqtt_t h)
+{                               // Release session, freed on last reference
+   if (!__atomic_sub_fetch(&h->refs, 1, __ATOMIC_SEQ_CST))
+      handle_free(h);
+}
+
+static void session_send(lwmqtt_t h, lwmqtt_msg_t * m, char retain)
+{                               // Send shared message to a session, the buffer itself is not copied, just the first byte if retained
+   xSemaphoreTake(h->mutex, portMAX_DELAY);
+   if (h->sock >= 0)
+   {
+      uint8_t b = m->data[0] | (retain ? 1 : 0);
+      if (hwrite(h, &b, 1) != 1 || hwrite_cont(h, m->data + 1, m->len - 1) != m->len - 1)
+         ESP_LOGI(TAG, "Send to %s failed", h->client ? : "?");
+   }
+   xSemaphoreGive(h->mutex);
+}
+
+static void broker_out(broker_out_t * o, lwmqtt_t h, lwmqtt_msg_t * m)
+{                               // Add a send, holding session and message, called with broker_mutex
+   if (o->count == o->max)
+   {
+      int max = (o->max ? : 4) * 2;
+      broker_send_t *s = realloc(o->send, max * sizeof(*s));
+      if (!s)
+      {
+         ESP_LOGE(TAG, "Broker send to %s dropped", h->client ? : "?");
+         return;
+      }
+      o->send = s;
+      o->max = max;
+   }
+   __atomic_add_fetch(&h->refs, 1, __ATOMIC_SEQ_CST);
+   o->send[o->count].handle = h;
+   o->send[o->count].msg = lwmqtt_msg_hold(m);
+   o->count++;
+}
+
+static void broker_flush(broker_out_t * o)
+{                               // Do the sends, after releasing broker_mutex, so a slow session does not hold up the broker
+   for (int i = 0; i < o->count; i++)
+   {
+      session_send(o->send[i].handle, o->send[i].msg, o->retain);
+      lwmqtt_msg_release(&o->send[i].msg);
+      session_release(o->send[i].handle);
+   }
+   freez(o->send);
+   o->count = o->max = 0;
+}
+
+static broker_node_t *broker_level(broker_node_t * n, const char *level, int len, int create)
+{                               // Find (or create) child node for a level
+   broker_node_t *c;
+   for (c = n->child; c && (c->len != len || memcmp(c->level, level, len)); c = c->next);
+   if (c || !create)
+      return c;
+   c = malloc(sizeof(*c) + len);
+   if (!c)
+      return c;
+   memset(c, 0, sizeof(*c));
+   c->parent = n;
+   c->len = len;
+   memcpy(c->level, level, len);
+   c->next = n->child;
+   n->child = c;
+   return c;
+}
+
+static broker_node_t *broker_node(const char *topic, int tlen, int create)
+{                               // Find (or create) node for whole topic / filter
+   broker_node_t *n = &broker_root;
+   const char *e = topic + tlen;
+   while (n)
+   {
+      const char *l = topic;
+      while (topic < e && *topic != '/')
+         topic++;
+      n = broker_level(n, l, topic - l, create);
+      if (topic == e)
+         break;
+      topic++;
+   }
+   return n;
+}
+
+static void broker_prune(broker_node_t * n)
+{                               // Remove unused nodes working back to root
+   while (n && n != &broker_root && !n->subs && !n->retain && !n->child)
+   {
+      broker_node_t *p = n->parent,
+          **q;
+      for (q = &p->child; *q && *q != n; q = &(*q)->next);
+      if (*q)
+         *q = n->next;
+      free(n);
+      n = p;
+   }
+}
+
+static const char *broker_filter_check(const char *filter, int flen)
+{                               // Check a subscription filter is valid
+   if (!flen)
+      return "Empty filter";
+   for (int i = 0; i < flen; i++)
+      if ((filter[i] == '+' || filter[i] == '#') && ((i && filter[i - 1] != '/') || (i + 1 < flen && filter[i + 1] != '/')))
+         return "Wildcard not whole level";
+      else if (filter[i] == '#' && i + 1 != flen)
+         return "Multi level wildcard not last";
+   return NULL;
+}
+
+static void broker_found(broker_node_t * n, broker_out_t * o, lwmqtt_msg_t * m)
+{                               // Matching subscriptions
+   for (broker_sub_t * s = n->subs; s; s = s->next)
+      broker_out(o, s->handle, m);
+}
+
+static void broker_match(broker_node_t * n, const char *topic, const char *e, char root, broker_out_t * o, lwmqtt_msg_t * m)
+{                               // Find all subscriptions matching a topic
+   if (!root || *topic != '$')
+   {                            // Wildcards do not match $ topics at top level
+      broker_node_t *w = broker_level(n, "#", 1, 0);
+      if (w)
+         broker_found(w, o, m); // Matches rest, including parent level
+   }
+   if (topic > e)
+   {                            // End of topic
+      broker_found(n, o, m);
+      return;
+   }
+   const char *l = topic;
+   while (topic < e && *topic != '/')
+      topic++;
+   broker_node_t *c = broker_level(n, l, topic - l, 0);
+   if (c)
+      broker_match(c, topic + 1, e, 0, o, m);
+   if ((!root || *l != '$') && (c = broker_level(n, "+", 1, 0)))
+      broker_match(c, topic + 1, e, 0, o, m);
+}
+
+static void broker_retained_all(broker_node_t * n, broker_out_t * o, lwmqtt_t h)
+{                               // All retained messages at and below a node
+   if (n->retain)
+      broker_out(o, h, n->retain);
+   for (broker_node_t * c = n->child; c; c = c->next)
+      broker_retained_all(c, o, h);
+}
+
+static void broker_retained(broker_node_t * n, const char *filter, const char *e, char root, broker_out_t * o, lwmqtt_t h)
+{                               // Find retained messages matching a filter
+   if (filter > e)
+   {                            // End of filter
+      if (n->retain)
+         broker_out(o, h, n->retain);
+      return;
+   }
+   const char *l = filter;
+   while (filter < e && *filter != '/')
+      filter++;
+   if (filter - l == 1 && *l == '#')
+   {
+      if (n->retain && !root)
+         broker_out(o, h, n->retain);
+      for (broker_node_t * c = n->child; c; c = c->next)
+         if (!root || !c->len || *c->level != '$')
+            broker_retained_all(c, o, h);
+   } else if (filter - l == 1 && *l == '+')
+   {
+      for (broker_node_t * c = n->child; c; c = c->next)
+         if (!root || !c->len || *c->level != '$')
+            broker_retained(c, filter + 1, e, 0, o, h);
+   } else
+   {
+      broker_node_t *c = broker_level(n, l, filter - l, 0);
+      if (c)
+         broker_retained(c, filter + 1, e, 0, o, h);
+   }
+}
+
+static void broker_publish(int tlen, const char *topic, int plen, const unsigned char *payload, char retain)
+{                               // Publish a message to all matching subscribers, and store if retained
+   if (tlen <= 0)
+   {                            // Not valid MQTT, and matching expects at least one character
+      ESP_LOGE(TAG, "Broker publish empty topic");
+      return;
+   }
+   lwmqtt_msg_t *m = lwmqtt_msg(tlen, topic, plen, payload, 0);
+   if (!m)
+   {
+      ESP_LOGE(TAG, "Broker publish failed %.*s", tlen, topic);
+      return;
+   }
+   xSemaphoreTake(broker_mutex, portMAX_DELAY);
+   if (retain)
+   {                            // Retained, stored against topic, zero length payload clears
+      broker_node_t *n = broker_node(topic, tlen, plen);
+      if (n)
+      {
+         lwmqtt_msg_release(&n->retain);
+         if (plen)
+            n->retain = lwmqtt_msg_hold(m);
+         else
+            broker_prune(n);
+      }
+   }
+   broker_out_t o = { };
+   broker_match(&broker_root, topic, topic + tlen, 1, &o, m);
+   xSemaphoreGive(broker_mutex);
+   broker_flush(&o);
+   lwmqtt_msg_release(&m);
+}
+
+static const char *broker_subscribe(lwmqtt_t h, int flen, const char *filter, char unsubscribe)
+{                               // Subscribe or unsubscribe a session
+   const char *err = broker_filter_check(filter, flen);
+   if (err)
+      return err;
+   xSemaphoreTake(broker_mutex, portMAX_DELAY);
+   broker_node_t *n = broker_node(filter, flen, !unsubscribe);
+   if (!n)
+      err = (unsubscribe ? NULL : "Malloc");
+   else
+   {
+      broker_sub_t **q;
+      for (q = &n->subs; *q && (*q)->handle != h; q = &(*q)->next);
+      if (unsubscribe)
+      {
+         if (*q)
+         {
+            broker_sub_t *s = *q;
+            *q = s->next;
+            free(s);
+            broker_prune(n);
+         }
+      } else
+      {
+         if (!*q && (*q = malloc(sizeof(**q))))
+         {
+            (*q)->next = NULL;
+            (*q)->handle = h;
+         }
+         if (!*q)
+            err = "Malloc";
+      }
+   }
+   xSemaphoreGive(broker_mutex);
+   return err;
+}
+
+static void broker_send_retained(lwmqtt_t h, int flen, const char *filter)
+{                               // Send retained messages for new subscription
+   broker_out_t o = {.retain = 1 };
+   xSemaphoreTake(broker_mutex, portMAX_DELAY);
+   broker_retained(&broker_root, filter, filter + flen, 1, &o, h);
+   xSemaphoreGive(broker_mutex);
+   broker_flush(&o);
+}
+
+static void broker_unsubscribe_all(lwmqtt_t h)
+{                               // Remove all subscriptions for a session that has closed
+   int zap(broker_node_t * n) { // Returns true if node now unused
+      broker_node_t **c = &n->child;
+      while (*c)
+         if (zap(*c))
+         {
+            broker_node_t *d = *c;
+            *c = d->next;
+            free(d);
+         } else
+            c = &(*c)->next;
+      broker_sub_t **q;
+      for (q = &n->subs; *q && (*q)->handle != h; q = &(*q)->next);
+      if (*q)
+      {
+         broker_sub_t *s = *q;
+         *q = s->next;
+         free(s);
+      }
+      return !n->subs && !n->retain && !n->child;
+   }
+   xSemaphoreTake(broker_mutex, portMAX_DELAY);
+   zap(&broker_root);
+   xSemaphoreGive(broker_mutex);
+}
+#endif
+
 static void client_task(void *pvParameters);
+static void handle_resolve(lwmqtt_t handle);
+static int handle_socket(struct sockaddr *sa);
+static int handle_connect(lwmqtt_t handle, int timeout, int *addrp);
+static int handle_probe(lwmqtt_t handle);
+static void handle_probe_failed(lwmqtt_t handle);
+static int handle_pick(lwmqtt_t handle);
 #ifdef  CONFIG_REVK_MQTT_SERVER
 static void listen_task(void *pvParameters);
 #endif
@@ -188,13 +709,22 @@ lwmqtt_t lwmqtt_client(lwmqtt_client_config_t * config)
       return handle_free(handle);
    memset(handle, 0, sizeof(*handle));
    handle->sock = -1;
+   handle->probe = -1;
    handle->callback = config->callback;
    handle->arg = config->arg;
    handle->keepalive = config->keepalive ? : 60;
+   handle->inflights = config->inflight ? : LWMQTT_INFLIGHT;
    if ((handle->hostname_ref = config->hostname_ref))
       handle->hostname = (void *) config->hostname;
    else if (!(handle->hostname = strdup(config->hostname)))
       return handle_free(handle);
+   if (!(handle->hosts = strdup(config->hostname)))
+      return handle_free(handle);
+   char *save = NULL;
+   for (char *p = strtok_r(handle->hosts, " ,", &save); p && handle->hostn < LWMQTT_HOSTS; p = strtok_r(NULL, " ,", &save))
+      handle->host[handle->hostn++] = p;
+   if (!handle->hostn)
+      return handle_free(handle);
    handle->port = (config->port ? : (config->ca_cert_bytes || config->crt_bundle_attach) ? 8883 : 1883);
    if ((handle->tlsname_ref = config->tlsname_ref))
       handle->tlsname = (void *) config->tlsname;
@@ -290,6 +820,15 @@ lwmqtt_t lwmqtt_server(lwmqtt_server_config_t * config)
    memset(handle, 0, sizeof(*handle));
    handle->callback = config->callback;
    handle->port = (config->port ? : config->ca_cert_bytes ? 8883 : 1883);
+   handle->server = 1;
+   handle->listener = 1;
+   if ((config->username && !(handle->username = strdup(config->username))) || (config->password && !(handle->password = strdup(config->password))))
+      return handle_free(handle);
+   if (!broker_mutex)
+   {
+      broker_mutex = xSemaphoreCreateBinary();
+      xSemaphoreGive(broker_mutex);
+   }
    if (handle_certs(handle, config->ca_cert_ref, config->ca_cert_bytes, config->ca_cert_buf, config->server_cert_ref, config->server_cert_bytes, config->server_cert_buf, config->server_key_ref, config->server_key_bytes, config->server_key_buf))
       return handle_free(handle);
    handle->running = 1;
@@ -315,6 +854,12 @@ void lwmqtt_end(lwmqtt_t * handle)
 
 // Subscribe (return is non null error message if failed)
 const char *lwmqtt_subscribeub(lwmqtt_t handle, const char *topic, char unsubscribe)
+{
+   return lwmqtt_subscribeub_multi(handle, 1, &topic, unsubscribe);
+}
+
+// Subscribe multiple topics, packed in to as few packets as possible (return is non null error message if failed)
+const char *lwmqtt_subscribeub_multi(lwmqtt_t handle, int count, const char *const *topics, char unsubscribe)
 {
    const char *ret = NULL;
    if (!handle)
@@ -323,42 +868,57 @@ const char *lwmqtt_subscribeub(lwmqtt_t handle, const char *topic, char unsubscr
       ret = "We are server";
    else
    {
-      int tlen = strlen(topic ? : "");
-      int mlen = 2 + 2 + tlen;
-      if (!unsubscribe)
-         mlen++;                // QoS requested
-      if (mlen >= 128 * 128)
-         ret = "Too big";
-      else
-      {
+      int t = 0;
+      while (!ret && t < count)
+      {                         // Each packet
+         int mlen = 2,
+             n = 0;
+         while (t + n < count)
+         {                      // How many topics fit
+            int l = 2 + strlen(topics[t + n] ? : "") + (unsubscribe ? 0 : 1);
+            if (n && mlen + l > LWMQTT_SUBMAX)
+               break;
+            mlen += l;
+            n++;
+         }
+         if (mlen >= 128 * 128)
+         {
+            ret = "Too big";
+            break;
+         }
          if (mlen >= 128)
             mlen++;             // two byte len
          mlen += 2;             // header and one byte len
          unsigned char *buf = malloc(mlen);
          if (!buf)
+         {
             ret = "Malloc";
+            break;
+         }
+         if (!xSemaphoreTake(handle->mutex, portMAX_DELAY))
+            ret = "Failed to get lock";
          else
          {
-            if (!xSemaphoreTake(handle->mutex, portMAX_DELAY))
-               ret = "Failed to get lock";
+            if (handle->sock < 0)
+               ret = "Not connected";
             else
             {
-               if (handle->sock < 0)
-                  ret = "Not connected";
-               else
+               unsigned char *p = buf;
+               *p++ = (unsubscribe ? 0xA2 : 0x82);      // subscribe/unsubscribe
+               if (mlen > 129)
+               {                // Two byte len
+                  *p++ = (((mlen - 3) & 0x7F) | 0x80);
+                  *p++ = ((mlen - 3) >> 7);
+               } else
+                  *p++ = mlen - 2;      // 1 byte len
+               if (!++(handle->seq))
+                  handle->seq++;        // Non zero
+               *p++ = handle->seq >> 8;
+               *p++ = handle->seq;
+               for (int i = 0; i < n; i++)
                {
-                  unsigned char *p = buf;
-                  *p++ = (unsubscribe ? 0xA2 : 0x82);   // subscribe/unsubscribe
-                  if (mlen > 129)
-                  {             // Two byte len
-                     *p++ = (((mlen - 3) & 0x7F) | 0x80);
-                     *p++ = ((mlen - 3) >> 7);
-                  } else
-                     *p++ = mlen - 2;   // 1 byte len
-                  if (!++(handle->seq))
-                     handle->seq++;     // Non zero
-                  *p++ = handle->seq >> 8;
-                  *p++ = handle->seq;
+                  const char *topic = topics[t + i];
+                  int tlen = strlen(topic ? : "");
                   *p++ = tlen >> 8;
                   *p++ = tlen;
                   if (tlen)
@@ -366,16 +926,17 @@ const char *lwmqtt_subscribeub(lwmqtt_t handle, const char *topic, char unsubscr
                   p += tlen;
                   if (!unsubscribe)
                      *p++ = 0x00;       // QoS requested
-                  assert((p - buf) == mlen);
-                  if (hwrite(handle, buf, mlen) < mlen)
-                     ret = "Failed to send";
-                  else
-                     handle->ka = uptime() + handle->keepalive;
                }
-               xSemaphoreGive(handle->mutex);
+               assert((p - buf) == mlen);
+               if (hwrite(handle, buf, mlen) < mlen)
+                  ret = "Failed to send";
+               else
+                  handle->ka = uptime() + handle->keepalive;
             }
-            freez(buf);
+            xSemaphoreGive(handle->mutex);
          }
+         freez(buf);
+         t += n;
       }
    }
    if (ret)
@@ -395,6 +956,13 @@ const char *lwmqtt_send_full(lwmqtt_t handle, int tlen, const char *topic, int p
          tlen = strlen(topic ? : "");
       if (plen < 0)
          plen = strlen((char *) payload ? : "");
+#ifdef	CONFIG_REVK_MQTT_SERVER
+      if (handle->listener)
+      {                         // Local publish in to broker
+         broker_publish(tlen, topic, plen, payload, retain);
+         return NULL;
+      }
+#endif
       int mlen = 2 + tlen + plen;
       if (mlen >= 128 * 128)
          ret = "Too big";
@@ -449,13 +1017,149 @@ const char *lwmqtt_send_full(lwmqtt_t handle, int tlen, const char *topic, int p
    return ret;
 }
 
+// Send a shared message
+const char *lwmqtt_send_msg(lwmqtt_t handle, lwmqtt_msg_t * m, char retain, char qos)
+{
+   if (!handle)
+      return "No handle";
+   if (!m)
+      return "No message";
+   const char *topic = (char *) m->data + m->hlen + 2;
+   const unsigned char *payload = m->data + m->hlen + 2 + m->tlen;
+   int plen = m->len - m->hlen - 2 - m->tlen;
+#ifdef	CONFIG_REVK_MQTT_SERVER
+   if (handle->listener)
+   {                            // Local publish in to broker
+      broker_publish(m->tlen, topic, plen, payload, retain);
+      return NULL;
+   }
+#endif
+   if (qos)
+      return lwmqtt_send_msg_qos1(handle, m, retain, NULL, NULL);
+   const char *ret = NULL;
+   if (!xSemaphoreTake(handle->mutex, portMAX_DELAY))
+      ret = "Failed to get lock";
+   else
+   {
+      if (handle->sock < 0)
+         ret = "Not connected";
+      else
+      {
+         int sent;
+         if ((m->data[0] & 1) == (retain ? 1 : 0))
+            sent = hwrite(handle, m->data, m->len);
+         else
+         {                      // Different retain, first byte separately
+            uint8_t b = (m->data[0] ^ 1);
+            sent = (hwrite(handle, &b, 1) == 1 ? 1 + hwrite_cont(handle, m->data + 1, m->len - 1) : -1);
+         }
+         if (sent < m->len)
+            ret = "Failed to send";
+         else if (!handle->server)
+            handle->ka = uptime() + handle->keepalive;  // client KA refresh
+      }
+      xSemaphoreGive(handle->mutex);
+   }
+   if (ret)
+      ESP_LOGD(TAG, "Send: %s", ret);
+   return ret;
+}
+
+static lwmqtt_inflight_t *inflight_find(lwmqtt_t handle, unsigned short id)
+{                               // Find in flight message (call with mutex)
+   for (int i = 0; i < handle->inflightn; i++)
+      if (handle->inflight[i].id == id)
+         return &handle->inflight[i];
+   return NULL;
+}
+
+static int inflight_write(lwmqtt_t handle, lwmqtt_inflight_t * f)
+{                               // Write QoS 1 PUBLISH from the held message, adding packet ID, DUP if sent before (call with mutex), returns 0 if OK
+   lwmqtt_msg_t *m = f->msg;
+   int tlen = 2 + m->tlen;      // Topic with its length
+   int plen = m->len - m->hlen - tlen;
+   int rlen = tlen + 2 + plen;  // Remaining length
+   uint8_t id[2] = { f->id >> 8, f->id };
+   uint8_t h[3],
+    *p = h;
+   *p++ = 0x32 + (f->retain ? 1 : 0) + (f->sent ? 0x08 : 0);   // message QoS 1
+   if (rlen >= 128)
+   {                            // Two byte len
+      *p++ = ((rlen & 0x7F) | 0x80);
+      *p++ = (rlen >> 7);
+   } else
+      *p++ = rlen;              // 1 byte len
+   f->sent = 1;
+   if (hwrite(handle, h, p - h) != p - h || hwrite_cont(handle, m->data + m->hlen, tlen) != tlen || hwrite_cont(handle, id, 2) != 2 || (plen && hwrite_cont(handle, m->data + m->hlen + tlen, plen) != plen))
+      return -1;
+   return 0;
+}
+
+// Send shared message QoS 1, held by reference until PUBACK (return is non null error message if not accepted, else done is called when PUBACK received, or with error if dropped)
+const char *lwmqtt_send_msg_qos1(lwmqtt_t handle, lwmqtt_msg_t * m, char retain, lwmqtt_done_t * done, void *arg)
+{
+   const char *ret = NULL;
+   if (!handle)
+      ret = "No handle";
+   else if (!m)
+      ret = "No message";
+   else if (handle->server)
+      ret = "We are server";
+   else if (m->len - m->hlen + 2 >= 128 * 128)
+      ret = "Too big";          // No room for packet ID
+   else if (!xSemaphoreTake(handle->mutex, portMAX_DELAY))
+      ret = "Failed to get lock";
+   else
+   {
+      if (!handle->inflight && !(handle->inflight = malloc(handle->inflights * sizeof(*handle->inflight))))
+         ret = "Malloc";
+      else if (handle->inflightn >= handle->inflights)
+         ret = "In flight window full";
+      else
+      {
+         do
+            if (!++(handle->seq))
+               handle->seq++;   // Non zero
+         while (inflight_find(handle, handle->seq));
+         lwmqtt_inflight_t *f = &handle->inflight[handle->inflightn++];
+         memset(f, 0, sizeof(*f));
+         f->msg = lwmqtt_msg_hold(m);
+         f->id = handle->seq;
+         f->done = done;
+         f->arg = arg;
+         f->retain = (retain ? 1 : 0);
+         if (handle->connected && handle->sock >= 0 && !inflight_write(handle, f))
+            handle->ka = uptime() + handle->keepalive;  // client KA refresh, else sent on connect
+      }
+      xSemaphoreGive(handle->mutex);
+   }
+   if (ret)
+      ESP_LOGD(TAG, "Send QoS1: %s", ret);
+   return ret;
+}
+
+// Send QoS 1 (return is non null error message if not accepted, else done is called when PUBACK received, or with error if dropped)
+const char *lwmqtt_send_qos1(lwmqtt_t handle, int tlen, const char *topic, int plen, const unsigned char *payload, char retain, lwmqtt_done_t * done, void *arg)
+{
+   if (!handle)
+      return "No handle";
+   lwmqtt_msg_t *m = lwmqtt_msg(tlen, topic, plen, payload, retain);
+   if (!m)
+      return "Too big";
+   const char *ret = lwmqtt_send_msg_qos1(handle, m, retain, done, arg);
+   lwmqtt_msg_release(&m);
+   return ret;
+}
+
 static void lwmqtt_loop(lwmqtt_t handle)
 {
    // Handle rx messages
    unsigned char *buf = 0;
    int buflen = 0;
    int pos = 0;
+   const char *reason = NULL;
    handle->ka = uptime() + (handle->server ? 5 : handle->keepalive);    // Server does not know KA initially
+   handle->ping = 0;
    while (handle->running)
    {                            // Loop handling messages received, and timeouts
       int need = 0;
@@ -470,34 +1174,89 @@ static void lwmqtt_loop(lwmqtt_t handle)
       else
       {
          ESP_LOGE(TAG, "Silly len %02X %02X %02X", buf[0], buf[1], buf[2]);
+         reason = "Bad length";
          break;
       }
       if (pos < need)
       {
          uint32_t now = uptime();
+         if (handle->ping && esp_timer_get_time() - handle->ping > LWMQTT_PINGWAIT * 1000000LL)
+         {                      // Half dead TCP, do not wait for the kernel to notice
+            ESP_LOGI(TAG, "No ping response %s:%d", handle->host[handle->hostnow], handle->port);
+            reason = "No ping response";
+            handle->backoff = 0;        // Reconnect now
+            break;
+         }
+         if (handle->probe >= 0 && now >= handle->probed + LWMQTT_CONNECT)
+         {                      // Preferred host did not answer
+            close(handle->probe);
+            handle->probe = -1;
+            handle_probe_failed(handle);
+         }
+         if (!handle->server && handle->connected && handle->hostnow && handle->probe < 0 && now >= handle->failback)
+         {                      // Check if a preferred host is back, non blocking, answer picked up by select below
+            handle->failback = now + handle->probewait;
+            handle->probed = now;
+            handle->probe = handle_probe(handle);
+            if (handle->probe < 0)
+               handle_probe_failed(handle);
+            else
+               ESP_LOGI(TAG, "Checking if preferred host is back, from %s (every %us)", handle->host[handle->hostnow], handle->probewait);
+         }
          if (now >= handle->ka)
          {
             if (handle->server)
-               break;           // timeout
+            {
+               reason = "Keepalive timeout";
+               break;
+            }
             // client, so send ping
             uint8_t b[] = { 0xC0, 0x00 };       // Ping
             xSemaphoreTake(handle->mutex, portMAX_DELAY);
             if (hwrite(handle, b, sizeof(b)) == sizeof(b))
+            {
                handle->ka = uptime() + handle->keepalive;       // Client KA refresh
+               if (!handle->ping)
+                  handle->ping = esp_timer_get_time();
+            }
             xSemaphoreGive(handle->mutex);
          }
          if (!handle->tls || esp_tls_get_bytes_avail(handle->tls) <= 0)
          {                      // Wait for data to arrive
-            fd_set r;
+            fd_set r,
+             w;
             FD_ZERO(&r);
+            FD_ZERO(&w);
             FD_SET(handle->sock, &r);
+            if (handle->probe >= 0)
+               FD_SET(handle->probe, &w);
             struct timeval to = { 1, 0 };       // Keeps us checking running but is light load at once a second
-            int sel = select(handle->sock + 1, &r, NULL, NULL, &to);
+            int sel = select((handle->probe > handle->sock ? handle->probe : handle->sock) + 1, &r, &w, NULL, &to);
             if (sel < 0)
             {
                ESP_LOGE(TAG, "Select failed");
+               reason = "Select failed";
                break;
             }
+            if (handle->probe >= 0 && FD_ISSET(handle->probe, &w))
+            {                   // Probe finished
+               int err = 0;
+               socklen_t len = sizeof(err);
+               if (getsockopt(handle->probe, SOL_SOCKET, SO_ERROR, &err, &len))
+                  err = -1;
+               close(handle->probe);
+               handle->probe = -1;
+               if (err)
+                  handle_probe_failed(handle);
+               else
+               {
+                  ESP_LOGI(TAG, "Failback from %s", handle->host[handle->hostnow]);
+                  reason = "Failback";
+                  handle->hostbad = 0;  // Try in order again
+                  handle->backoff = 0;  // Reconnect now
+                  break;
+               }
+            }
             if (!FD_ISSET(handle->sock, &r))
                continue;        // Nothing waiting
          }
@@ -507,6 +1266,7 @@ static void lwmqtt_loop(lwmqtt_t handle)
             if (!buf)
             {
                ESP_LOGE(TAG, "realloc fail %d", need);
+               reason = "No memory";
                break;
             }
          }
@@ -519,39 +1279,139 @@ static void lwmqtt_loop(lwmqtt_t handle)
          pos += got;
          continue;
       }
+      handle->stats.rx_msgs++;
+      handle->stats.rx_bytes += pos;
       if (handle->server)
-         handle->ka = uptime() + handle->keepalive * 3 / 2;     // timeout for client resent on message received
+         handle->ka = (handle->keepalive ? uptime() + handle->keepalive * 3 / 2 : ~0);  // timeout for client resent on message received
       unsigned char *p = buf + 1,
           *e = buf + pos;
       while (p < e && (*p & 0x80))
          p++;
       p++;
       if (handle->server && !handle->connected && (*buf >> 4) != 1)
+      {
+         reason = "Not connect";
          break;                 // Expect login as first message
+      }
       switch (*buf >> 4)
       {
-      case 1:
+      case 1:                  // connect
 #ifdef CONFIG_REVK_MQTT_SERVER
-         if (!handle->server)
+         if (!handle->server || handle->connected)
+         {
+            handle->running = 0;        // Protocol violation
             break;
-         handle->connected = 1;
-         ESP_LOGI(TAG, "Connected incoming %d", handle->port);
-         // TODO incoming connect
-         handle->keepalive = 10;        // TODO get from message
-         uint8_t b[4] = { 0x20 };       // conn ack
-         xSemaphoreTake(handle->mutex, portMAX_DELAY);
-         if (hwrite(handle, b, sizeof(b)) == sizeof(b) && !handle->server)
-            handle->ka = uptime() + handle->keepalive;  // KA client refresh
-         xSemaphoreGive(handle->mutex);
+         }
+         {
+            int get(unsigned char **v) {        // Get length prefixed field, -1 if past end
+               if (p + 2 > e)
+                  return -1;
+               int l = (p[0] << 8) + p[1];
+               p += 2;
+               if (p + l > e)
+                  return -1;
+               *v = p;
+               p += l;
+               return l;
+            }
+            unsigned char *proto = NULL,
+                *id = NULL,
+                *wt = NULL,
+                *wp = NULL,
+                *user = NULL,
+                *pass = NULL;
+            int protol = get(&proto),
+                idl = -1,
+                wtl = 0,
+                wpl = 0,
+                userl = 0,
+                passl = 0;
+            uint8_t level = 0,
+                flags = 0x01;
+            if (protol >= 0 && p + 4 <= e)
+            {
+               level = *p++;
+               flags = *p++;
+               handle->keepalive = (p[0] << 8) + p[1];
+               p += 2;
+               idl = get(&id);
+               if (flags & 0x04)
+               {                // Will
+                  wtl = get(&wt);
+                  wpl = get(&wp);
+               }
+               if (flags & 0x80)
+                  userl = get(&user);
+               if (flags & 0x40)
+                  passl = get(&pass);
+            }
+            if (idl < 0 || wtl < 0 || wpl < 0 || userl < 0 || passl < 0 || (flags & 0x01) || p != e)
+            {
+               ESP_LOGE(TAG, "Bad connect %d", handle->port);
+               handle->running = 0;
+               break;
+            }
+            uint8_t rc = 0;     // Accepted
+            if (!((protol == 4 && !memcmp(proto, "MQTT", 4) && level == 4) || (protol == 6 && !memcmp(proto, "MQIsdp", 6) && level == 3)))
+               rc = 1;          // Unacceptable protocol version
+            else if (!idl && !(flags & 0x02))
+               rc = 2;          // Identifier rejected, empty ID needs clean session
+            else if ((handle->username && (!(flags & 0x80) || userl != strlen(handle->username) || memcmp(user, handle->username, userl))) || (handle->password && (!(flags & 0x40) || passl != strlen(handle->password) || memcmp(pass, handle->password, passl))))
+               rc = 4;          // Bad user name or password
+            else if (handle->certname && (idl != strlen(handle->certname) || memcmp(id, handle->certname, idl)))
+               rc = 5;          // Not authorised, client ID is not the name in the client certificate
+            else if (!(handle->client = strndup((char *) id, idl)) || ((flags & 0x04) && (!(handle->willtopic = strndup((char *) wt, wtl)) || (wpl && !(handle->willpayload = malloc(wpl))))))
+               rc = 3;          // Server unavailable
+            else if (flags & 0x04)
+            {                   // Will
+               if (wpl)
+                  memcpy(handle->willpayload, wp, wpl);
+               handle->willplen = wpl;
+               handle->willretain = ((flags & 0x20) ? 1 : 0);
+            }
+            uint8_t b[4] = { 0x20, 2, 0, rc };  // conn ack
+            xSemaphoreTake(handle->mutex, portMAX_DELAY);
+            hwrite(handle, b, sizeof(b));
+            xSemaphoreGive(handle->mutex);
+            if (rc)
+            {
+               ESP_LOGI(TAG, "Refused incoming %d (%d)", handle->port, rc);
+               handle->running = 0;
+               break;
+            }
+            handle->connected = 1;
+            handle->ka = (handle->keepalive ? uptime() + handle->keepalive * 3 / 2 : ~0);
+            ESP_LOGI(TAG, "Connected incoming %d %s keepalive %d", handle->port, handle->client, handle->keepalive);
+            if (handle->callback)
+               handle->callback(handle->arg, NULL, idl, (void *) handle->client);
+         }
 #endif
          break;
       case 2:                  // conack
          if (handle->server)
             break;
-         ESP_LOGI(TAG, "Connected %s:%d", handle->hostname, handle->port);
+         if (e - p < 2 || p[1])
+         {                      // Refused, host counts as failed
+            ESP_LOGE(TAG, "Refused %s:%d (%d)", handle->host[handle->hostnow], handle->port, e - p < 2 ? -1 : p[1]);
+            reason = "Refused";
+            break;
+         }
+         ESP_LOGI(TAG, "Connected %s:%d", handle->host[handle->hostnow], handle->port);
+         handle->hostbad &= ~(1 << handle->hostnow);
          handle->backoff = 1;
+         handle->probewait = LWMQTT_FAILBACK;
+         handle->failback = uptime() + handle->probewait;
+         handle->stats.connects++;
+         xSemaphoreTake(handle->mutex, portMAX_DELAY);
+         handle->connected = 1;
+         for (int i = 0; i < handle->inflightn; i++)
+         {                      // Send, or resend with DUP, QoS 1 messages, oldest first
+            if (inflight_write(handle, &handle->inflight[i]))
+               break;
+         }
+         xSemaphoreGive(handle->mutex);
          if (handle->callback)
-            handle->callback(handle->arg, NULL, strlen(handle->hostname), (void *) handle->hostname);
+            handle->callback(handle->arg, NULL, strlen(handle->host[handle->hostnow]), (void *) handle->host[handle->hostnow]);
          break;
       case 3:                  // pub
          {                      // Topic
@@ -570,6 +1430,18 @@ static void lwmqtt_loop(lwmqtt_t handle)
                ESP_LOGE(TAG, "Bad msg");
                break;
             }
+#ifdef	CONFIG_REVK_MQTT_SERVER
+            if (handle->server)
+            {                   // Route via broker before topic is changed in situ for callback
+               if (!tlen || memchr(topic, '+', tlen) || memchr(topic, '#', tlen))
+               {
+                  ESP_LOGE(TAG, "%s in publish from %s", tlen ? "Wildcard" : "Empty topic", handle->client);
+                  handle->running = 0;
+                  break;
+               }
+               broker_publish(tlen, topic, e - p, p, *buf & 1);
+            }
+#endif
             if (*buf & 0x06)
             {                   // reply
                uint8_t b[4] = { (*buf & 0x4) ? 0x50 : 0x40, 2, id >> 8, id };
@@ -592,9 +1464,32 @@ static void lwmqtt_loop(lwmqtt_t handle)
             }
          }
          break;
-      case 4:                  // puback - no action as we don't use non QoS 0
+      case 4:                  // puback
+         if (handle->server || p + 2 > e)
+            break;
+         {
+            unsigned short id = (p[0] << 8) + p[1];
+            lwmqtt_inflight_t done = { };
+            xSemaphoreTake(handle->mutex, portMAX_DELAY);
+            lwmqtt_inflight_t *f = inflight_find(handle, id);
+            if (f)
+            {                   // Remove, keeping the rest in order
+               done = *f;
+               handle->inflightn--;
+               memmove(f, f + 1, (handle->inflight + handle->inflightn - f) * sizeof(*f));
+            }
+            xSemaphoreGive(handle->mutex);
+            if (!done.msg)
+               ESP_LOGD(TAG, "Unexpected puback %04X", id);
+            else
+            {
+               lwmqtt_msg_release(&done.msg);
+               if (done.done)
+                  done.done(done.arg, NULL);
+            }
+         }
          break;
-      case 5:                  // pubrec - not expected as we don't use non QoS 0
+      case 5:                  // pubrec - not expected as we only send QoS 0 and 1
          if (handle->server)
             break;
          {
@@ -605,33 +1500,134 @@ static void lwmqtt_loop(lwmqtt_t handle)
             xSemaphoreGive(handle->mutex);
          }
          break;
-      case 6:                  // pubcomp - no action as we don't use non QoS 0
+      case 6:                  // pubcomp - no action as we don't use QoS 2
          break;
       case 8:                  // sub
+      case 10:                 // unsub
 #ifdef CONFIG_REVK_MQTT_SERVER
-         if (!handle->server)
+         if (!handle->server || p + 2 > e)
             break;
-         // TODO
+         {
+            char unsub = ((*buf >> 4) == 10);
+            unsigned char *f = p + 2;
+            int n = 0;          // Number of filters
+            while (f + 2 <= e)
+            {
+               f += 2 + (f[0] << 8) + f[1] + (unsub ? 0 : 1);
+               if (f <= e)
+                  n++;
+            }
+            int alen = 2 + (unsub ? 0 : n);
+            uint8_t *ack = malloc(3 + alen);
+            if (!ack)
+               break;
+            uint8_t *a = ack;
+            *a++ = (unsub ? 0xB0 : 0x90);       // sub ack / unsub ack
+            if (alen >= 128)
+            {
+               *a++ = ((alen & 0x7F) | 0x80);
+               *a++ = (alen >> 7);
+            } else
+               *a++ = alen;
+            *a++ = *p++;        // ID
+            *a++ = *p++;
+            unsigned char *start = p;
+            for (int i = 0; i < n; i++)
+            {
+               int l = (p[0] << 8) + p[1];
+               p += 2;
+               char *filter = (char *) p;
+               p += l;
+               if (unsub)
+                  broker_subscribe(handle, l, filter, 1);
+               else
+               {
+                  p++;          // QoS requested, we only grant QoS 0
+                  const char *err = broker_subscribe(handle, l, filter, 0);
+                  *a++ = (err ? 0x80 : 0x00);
+                  if (err)
+                     ESP_LOGI(TAG, "Subscribe %.*s failed: %s", l, filter, err);
+               }
+            }
+            xSemaphoreTake(handle->mutex, portMAX_DELAY);
+            hwrite(handle, ack, a - ack);
+            xSemaphoreGive(handle->mutex);
+            if (!unsub)
+            {                   // Retained messages after the sub ack
+               p = start;
+               for (int i = 0; i < n; i++)
+               {
+                  int l = (p[0] << 8) + p[1];
+                  char *filter = (char *) p + 2;
+                  p += 2 + l + 1;
+                  if (ack[(ack[1] & 0x80) ? 5 + i : 4 + i])
+                     continue;  // Failed
+                  broker_send_retained(handle, l, filter);
+                  if (handle->callback)
+                  {             // Filter is followed by QoS byte which we have read, so can null terminate in situ
+                     filter[l] = 0;
+                     handle->callback(handle->arg, filter, 0, NULL);
+                  }
+               }
+            }
+            free(ack);
+         }
 #endif
          break;
       case 9:                  // suback - no action
          break;
-      case 10:                 // unsub - no action
-         break;
       case 11:                 // unsuback - ok
          if (handle->server)
             break;
          break;
-      case 12:                 // ping (no action as resets ka anyway)
+      case 12:                 // ping (resets ka anyway)
+#ifdef CONFIG_REVK_MQTT_SERVER
+         if (handle->server)
+         {
+            uint8_t b[] = { 0xD0, 0x00 };       // Ping response
+            xSemaphoreTake(handle->mutex, portMAX_DELAY);
+            hwrite(handle, b, sizeof(b));
+            xSemaphoreGive(handle->mutex);
+         }
+#endif
+         break;
+      case 13:                 // pingresp
+         if (handle->server || !handle->ping)
+            break;
+         {                      // Round trip
+            static const uint16_t rtt_bucket[LWMQTT_RTT_BUCKETS - 1] = { 10, 20, 50, 100, 200, 500, 1000 };
+            uint32_t rtt = (esp_timer_get_time() - handle->ping) / 1000;
+            int b = 0;
+            while (b < LWMQTT_RTT_BUCKETS - 1 && rtt >= rtt_bucket[b])
+               b++;
+            handle->stats.rtt = rtt;
+            handle->stats.rtt_hist[b]++;
+            handle->ping = 0;
+         }
          break;
-      case 13:                 // pingresp - no action - though we could use lack of reply to indicate broken connection I guess
+      case 14:                 // disconnect
+#ifdef CONFIG_REVK_MQTT_SERVER
+         if (handle->server)
+         {                      // Clean, so no will
+            freez(handle->willtopic);
+            handle->running = 0;
+         }
+#endif
          break;
       default:
          ESP_LOGE(TAG, "Unknown MQTT %02X (%d)", *buf, pos);
       }
+      if (reason)
+         break;
       pos = 0;
    }
    freez(buf);
+   if (handle->probe >= 0)
+   {
+      close(handle->probe);
+      handle->probe = -1;
+   }
+   handle->stats.reason = reason ? : handle->running ? "Closed" : "Stopped";
    if (!handle->server && !handle->running)
    {                            // Close connection - as was clean
       ESP_LOGD(TAG, "Close cleanly");
@@ -640,11 +1636,191 @@ static void lwmqtt_loop(lwmqtt_t handle)
       hwrite(handle, b, sizeof(b));
       xSemaphoreGive(handle->mutex);
    }
+   if (!handle->server)
+   {                            // Anything in flight is held for resend on reconnect
+      xSemaphoreTake(handle->mutex, portMAX_DELAY);
+      handle->connected = 0;
+      xSemaphoreGive(handle->mutex);
+   }
+   xSemaphoreTake(handle->mutex, portMAX_DELAY);        // Not while a broker send in progress
    handle_close(handle);
+   xSemaphoreGive(handle->mutex);
+#ifdef	CONFIG_REVK_MQTT_SERVER
+   if (handle->server && handle->connected)
+   {
+      broker_unsubscribe_all(handle);
+      if (handle->willtopic)
+      {                         // Not a clean disconnect
+         ESP_LOGI(TAG, "Will from %s", handle->client);
+         broker_publish(strlen(handle->willtopic), handle->willtopic, handle->willplen, handle->willpayload, handle->willretain);
+      }
+   }
+#endif
    if (handle->callback)
       handle->callback(handle->arg, NULL, 0, NULL);
 }
 
+static void handle_resolve(lwmqtt_t handle)
+{                               // DNS lookup of all hosts, cached
+   if (handle->addrs && uptime() < handle->resolved + LWMQTT_DNSTTL)
+      return;
+   handle->addrs = 0;
+   for (int h = 0; h < handle->hostn; h++)
+   {
+    struct addrinfo base = { ai_family: AF_UNSPEC, ai_socktype:SOCK_STREAM };
+      struct addrinfo *a = 0,
+          *p;
+      char sport[6];
+      snprintf(sport, sizeof(sport), "%d", handle->port);
+      if (getaddrinfo(handle->host[h], sport, &base, &a) || !a)
+      {
+         ESP_LOGI(TAG, "Could not resolve %s", handle->host[h]);
+         continue;
+      }
+      // Interleave families, starting with whatever DNS put first, so a dead path for one family does not hold us up
+      int max = handle->addrs + (LWMQTT_ADDRS - handle->addrs) / (handle->hostn - h);       // Fair share for each host
+      struct addrinfo *fam[2][LWMQTT_ADDRS];
+      int n[2] = { };
+      for (p = a; p; p = p->ai_next)
+      {
+         int f = (p->ai_family != a->ai_family);
+         if (n[f] < LWMQTT_ADDRS && p->ai_addrlen <= sizeof(handle->addr[0]))
+            fam[f][n[f]++] = p;
+      }
+      for (int i = 0; i < LWMQTT_ADDRS && handle->addrs < max; i++)
+         for (int f = 0; f < 2 && handle->addrs < max; f++)
+            if (i < n[f])
+            {
+               handle->addrhost[handle->addrs] = h;
+               memcpy(&handle->addr[handle->addrs++], fam[f][i]->ai_addr, fam[f][i]->ai_addrlen);
+            }
+      freeaddrinfo(a);
+   }
+   handle->resolved = uptime();
+}
+
+static int handle_socket(struct sockaddr *sa)
+{                               // Start a non blocking connect, returns socket or -1
+   int s = socket(sa->sa_family, SOCK_STREAM, 0);
+   if (s >= 0)
+   {
+      fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+      if (connect(s, sa, sa->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6)) && errno != EINPROGRESS)
+      {
+         close(s);
+         s = -1;
+      }
+   }
+   return s;
+}
+
+static int handle_probe(lwmqtt_t handle)
+{                               // Start a connect to the next cached address of a host preferred to the current one, returns socket or -1
+   // Uses the cached DNS only, as a lookup would block the receive task, it is refreshed on each reconnect
+   int addrs = 0;
+   while (addrs < handle->addrs && handle->addrhost[addrs] < handle->hostnow)
+      addrs++;
+   if (!addrs)
+      return -1;
+   return handle_socket((void *) &handle->addr[handle->probeaddr++ % addrs]);
+}
+
+static int handle_pick(lwmqtt_t handle)
+{                               // First cached address of a host that has not failed, starting again in order once all have
+   for (int a = 0; a < handle->addrs; a++)
+      if (!(handle->hostbad & (1 << handle->addrhost[a])))
+         return a;
+   handle->hostbad = 0;         // All tried
+   return 0;
+}
+
+static void handle_probe_failed(lwmqtt_t handle)
+{                               // Preferred host still down, check less often
+   handle->probewait *= 2;
+   if (handle->probewait > LWMQTT_FAILBACKMAX)
+      handle->probewait = LWMQTT_FAILBACKMAX;
+   handle->failback = uptime() + handle->probewait;
+   ESP_LOGD(TAG, "Preferred host still down, next check in %us", handle->probewait);
+}
+
+static int handle_connect(lwmqtt_t handle, int timeout, int *addrp)
+{                               // Non blocking connects to cached addresses, staggered, first to connect wins, returns socket or -1
+   // Addresses are in host order, so the stagger favours preferred hosts, but a faster one later in the list can still win
+   int socks[LWMQTT_ADDRS];
+   uint8_t addr[LWMQTT_ADDRS];
+   int addrs = 0;
+   for (int all = 0; all < 2 && !addrs; all++)
+      for (int a = 0; a < handle->addrs; a++)
+         if (all || !(handle->hostbad & (1 << handle->addrhost[a])))
+            addr[addrs++] = a;  // Skip hosts that failed, unless they all have
+   int tried = 0,
+       sock = -1;
+   int64_t start = esp_timer_get_time(),
+       next = start;
+   while (sock < 0)
+   {
+      int64_t now = esp_timer_get_time();
+      if (now - start >= timeout * 1000000LL)
+         break;                 // Timeout
+      if (tried < addrs && now >= next)
+      {                         // Start next address
+         int s = handle_socket((void *) &handle->addr[addr[tried]]);
+         socks[tried++] = s;
+         next = (s < 0 ? now : now + LWMQTT_STAGGER * 1000LL);
+         continue;
+      }
+      fd_set w;
+      FD_ZERO(&w);
+      int max = -1;
+      for (int i = 0; i < tried; i++)
+         if (socks[i] >= 0)
+         {
+            FD_SET(socks[i], &w);
+            if (socks[i] > max)
+               max = socks[i];
+         }
+      if (max < 0)
+      {                         // Nothing in progress
+         if (tried < addrs)
+         {
+            next = now;
+            continue;
+         }
+         break;
+      }
+      int64_t wait = (tried < addrs ? next : start + timeout * 1000000LL) - now;
+      if (wait < 0)
+         wait = 0;
+      struct timeval to = { wait / 1000000LL, wait % 1000000LL };
+      if (select(max + 1, NULL, &w, NULL, &to) < 0)
+         break;
+      for (int i = 0; i < tried && sock < 0; i++)
+         if (socks[i] >= 0 && FD_ISSET(socks[i], &w))
+         {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(socks[i], SOL_SOCKET, SO_ERROR, &err, &len) || err)
+            {                   // Failed, start next straight away
+               close(socks[i]);
+               socks[i] = -1;
+               next = now;
+            } else
+            {                   // Winner
+               sock = socks[i];
+               socks[i] = -1;
+               if (addrp)
+                  *addrp = addr[i];
+            }
+         }
+   }
+   for (int i = 0; i < tried; i++)
+      if (socks[i] >= 0)
+         close(socks[i]);
+   if (sock >= 0)
+      fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK);
+   return sock;
+}
+
 static void client_task(void *pvParameters)
 {
    lwmqtt_t handle = pvParameters;
@@ -658,71 +1834,126 @@ static void client_task(void *pvParameters)
    {                            // Loop connecting and trying repeatedly
       // Connect
       ESP_LOGD(TAG, "Connecting %s:%d", handle->hostname, handle->port);
-      // Can connect using TLS or non TLS with just sock set instead
-      if (handle->ca_cert_bytes || handle->crt_bundle_attach)
+      handle_resolve(handle);
+      uint8_t tls = (handle->ca_cert_bytes || handle->crt_bundle_attach);
+      int addr = 0;
+      int sock = -1;
+      if (handle->addrs)
       {
-         esp_tls_t *tls = NULL;
-         esp_tls_cfg_t cfg = {
-            .cacert_buf = handle->ca_cert_buf,
-            .cacert_bytes = handle->ca_cert_bytes,
-            .common_name = handle->tlsname,
-            .clientcert_buf = handle->our_cert_buf,
-            .clientcert_bytes = handle->our_cert_bytes,
-            .clientkey_buf = handle->our_key_buf,
-            .clientkey_bytes = handle->our_key_bytes,
-            .crt_bundle_attach = handle->crt_bundle_attach,
-         };
-         tls = esp_tls_init();
-         if (esp_tls_conn_new_sync(handle->hostname, strlen(handle->hostname), handle->port, &cfg, tls) != 1)
-         {
-            ESP_LOGE(TAG, "Could not TLS connect to %s:%d", handle->hostname, handle->port);
-            free(tls);
-         } else
-         {
-            handle->tls = tls;
-            esp_tls_get_conn_sockfd(handle->tls, &handle->sock);
-         }
+         if (tls)
+            sock = addr = handle_pick(handle);  // esp_tls does its own connect, so no race, just the address to use
+         else
+            sock = handle_connect(handle, LWMQTT_CONNECT, &addr);
+      }
+      if (sock < 0)
+      {
+         ESP_LOGD(TAG, "Could not connect to %s:%d", handle->hostname, handle->port);
+         handle->addrs = 0;     // Try DNS again next time
+         handle->hostbad = 0;   // All tried
       } else
-      {                         // Non TLS
-       struct addrinfo base = { ai_family: AF_UNSPEC, ai_socktype:SOCK_STREAM };
-         struct addrinfo *a = 0,
-             *p;
-         char sport[6];
-         snprintf(sport, sizeof(sport), "%d", handle->port);
-         if (!getaddrinfo(handle->hostname, sport, &base, &a) && a)
-            for (p = a; p; p = p->ai_next)
+      {                         // Picked host and address
+         if (handle->hostnow != handle->addrhost[addr])
+         {                      // Different host
+            handle->hostnow = handle->addrhost[addr];
+#ifdef	CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+            if (handle->session)
+            {                   // Session is for the other host
+               esp_tls_free_client_session(handle->session);
+               handle->session = NULL;
+            }
+            handle->full = 0;
+#endif
+         }
+         handle->stats.host = handle->host[handle->hostnow];
+         if (!tls)
+            handle->sock = sock;
+         else
+         {                      // esp_tls connects by IP to the address picked
+            char ip[INET6_ADDRSTRLEN] = "";
+            struct sockaddr *sa = (void *) &handle->addr[addr];
+            if (sa->sa_family == AF_INET)
+               inet_ntop(AF_INET, &((struct sockaddr_in *) sa)->sin_addr, ip, sizeof(ip));
+            else
+               inet_ntop(AF_INET6, &((struct sockaddr_in6 *) sa)->sin6_addr, ip, sizeof(ip));
+            esp_tls_t *tls = NULL;
+            esp_tls_cfg_t cfg = {
+               .cacert_buf = handle->ca_cert_buf,
+               .cacert_bytes = handle->ca_cert_bytes,
+               .common_name = handle->tlsname ? : handle->host[handle->hostnow],        // As connecting by IP
+               .timeout_ms = LWMQTT_CONNECT * 1000,
+               .clientcert_buf = handle->our_cert_buf,
+               .clientcert_bytes = handle->our_cert_bytes,
+               .clientkey_buf = handle->our_key_buf,
+               .clientkey_bytes = handle->our_key_bytes,
+               .crt_bundle_attach = handle->crt_bundle_attach,
+#ifdef	CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+               .client_session = handle->session,       // Abbreviated handshake if the server still has it
+#endif
+            };
+            tls = esp_tls_init();
+            int64_t start = esp_timer_get_time();
+            if (esp_tls_conn_new_sync(ip, strlen(ip), handle->port, &cfg, tls) != 1)
             {
-               handle->sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-               if (handle->sock < 0)
-                  continue;
-               if (connect(handle->sock, p->ai_addr, p->ai_addrlen))
-               {
-                  close(handle->sock);
-                  handle->sock = -1;
-                  continue;
+               ESP_LOGE(TAG, "Could not TLS connect to %s:%d (%s)", handle->host[handle->hostnow], handle->port, ip);
+               free(tls);
+               handle->hostbad |= (1 << handle->hostnow);       // Try the next host
+#ifdef	CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+               if (handle->session)
+               {                // Do not try it again
+                  esp_tls_free_client_session(handle->session);
+                  handle->session = NULL;
                }
-               break;
+#endif
+            } else
+            {
+               handle->tls = tls;
+               esp_tls_get_conn_sockfd(handle->tls, &handle->sock);
+               handle->stats.handshake = (esp_timer_get_time() - start) / 1000;
+               handle->resumed = 0;
+#ifdef	CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+               if (cfg.client_session && handle->full && handle->stats.handshake * 2 < handle->full)
+                  handle->resumed = 1;  // No certificate check or key exchange, so the server took the ticket
+               else
+                  handle->full = handle->stats.handshake;
+               esp_tls_client_session_t *s = esp_tls_get_client_session(tls);
+               if (s)
+               {                // Keep latest for next time
+                  if (handle->session)
+                     esp_tls_free_client_session(handle->session);
+                  handle->session = s;
+               }
+#endif
+               ESP_LOGI(TAG, "TLS %s:%d %ums%s", handle->host[handle->hostnow], handle->port, handle->stats.handshake, handle->resumed ? " (resumed)" : "");
             }
-         if (a)
-            freeaddrinfo(a);
-         if (handle->sock < 0)
-            ESP_LOGD(TAG, "Could not connect to %s:%d", handle->hostname, handle->port);
+         }
       }
       if (handle->sock < 0)
       {                         // Failed before we even start
+         handle->stats.fails++;
+         handle->stats.reason = "Connect failed";
          if (handle->callback)
             handle->callback(handle->arg, NULL, 0, NULL);
       } else
       {
+         uint32_t connects = handle->stats.connects;
          hwrite(handle, handle->connect, handle->connectlen);
          lwmqtt_loop(handle);
+         if (handle->stats.connects == connects)
+            handle->hostbad |= (1 << handle->hostnow);  // No CONNACK, or refused, try the next host
       }
       if (!handle->running)
          break;                 // client was stopped
+      if (!handle->backoff)
+      {                         // Dead link, so try again straight away
+         handle->backoff = 1;
+         continue;
+      }
+      // Jitter, half to full backoff, so a fleet does not all come back at once, first retry is quick
+      uint32_t wait = handle->backoff * 500 + esp_random() % (handle->backoff * 500 + 1);
+      ESP_LOGI(TAG, "Waiting %ums (mem:%d)", wait, esp_get_free_heap_size());
+      usleep(wait * 1000);
       if (handle->backoff < 60)
          handle->backoff *= 2;
-      ESP_LOGI(TAG, "Waiting %d (mem:%d)", handle->backoff, esp_get_free_heap_size());
-      sleep(handle->backoff);
    }
    handle_free(handle);
    vTaskDelete(NULL);
@@ -733,7 +1964,7 @@ static void server_task(void *pvParameters)
 {
    lwmqtt_t handle = pvParameters;
    lwmqtt_loop(handle);
-   handle_free(handle);
+   session_release(handle);     // Freed once no broker sends in progress
    vTaskDelete(NULL);
 }
 
@@ -750,7 +1981,7 @@ static void listen_task(void *pvParameters)
       int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
       if (sock >= 0)
       {
-         if (bind(sock, (void *) &dst, sizeof(dst)) < 0 || listen(sock, 1) < 0)
+         if (bind(sock, (void *) &dst, sizeof(dst)) < 0 || listen(sock, 5) < 0)
             close(sock);
          else
          {
@@ -765,16 +1996,25 @@ static void listen_task(void *pvParameters)
                ESP_LOGD(TAG, "Connect on MQTT %d", handle->port);
                lwmqtt_t h = malloc(sizeof(*h));
                if (!h)
+               {
+                  close(s);
                   break;
+               }
                memset(h, 0, sizeof(*h));
                h->port = handle->port;  // Only for debugging
                h->callback = handle->callback;
                h->arg = h;
                h->mutex = xSemaphoreCreateBinary();
+               xSemaphoreGive(h->mutex);
                h->server = 1;
                h->sock = s;
                h->running = 1;
-               if (handle->ca_cert_bytes)
+               h->refs = 1;     // The session task
+               if ((handle->username && !(h->username = strdup(handle->username))) || (handle->password && !(h->password = strdup(handle->password))))
+                  h->running = 0;
+               struct timeval to = { 5, 0 };    // A stuck session cannot hold up the broker for long
+               setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &to, sizeof(to));
+               if (h->running && handle->ca_cert_bytes)
                {                // TLS
 #ifdef CONFIG_ESP_TLS_SERVER
                   esp_tls_cfg_server_t cfg = {
@@ -792,26 +2032,25 @@ static void listen_task(void *pvParameters)
                      ESP_LOGE(TAG, "TLS server failed %s", h->tls ? esp_err_to_name(e) : "No TLS");
                      h->running = 0;
                   } else
-                  {             // Check client name? Do login callback
-                     // TODO server client name check
+                  {             // Client certificate, if any, was checked against our CA, its name must then be the client ID
+                     const mbedtls_x509_crt *crt = mbedtls_ssl_get_peer_cert(esp_tls_get_ssl_context(h->tls));
+                     const mbedtls_x509_name *n = (crt ? &crt->subject : NULL);
+                     while (n && MBEDTLS_OID_CMP(MBEDTLS_OID_AT_CN, &n->oid))
+                        n = n->next;
+                     if (n && !(h->certname = strndup((char *) n->val.p, n->val.len)))
+                        h->running = 0;
                   }
 #else
                   ESP_LOGE(TAG, "Not built for TLS server");
                   h->running = 0;
 #endif
                }
-               if (h->running)
-               {
-                  TaskHandle_t task_id = NULL;
-                  xTaskCreate(server_task, "mqtt", 5 * 1024, (void *) h, 2, &task_id);
-               } else
+               TaskHandle_t task_id = NULL;
+               if (!h->running || xTaskCreate(server_task, "mqtt", 5 * 1024, (void *) h, 2, &task_id) != pdPASS)
                {                // Close
                   ESP_LOGI(TAG, "MQTT aborted");
-#ifdef CONFIG_ESP_TLS_SERVER
-                  if (h->tls)
-                     esp_tls_server_session_delete(h->tls);
-#endif
-                  close(h->sock);
+                  handle_close(h);
+                  handle_free(h);
                }
 
             }
@@ -837,3 +2076,24 @@ const char *lwmqtt_send_str(lwmqtt_t handle, const char *msg)
       p++;
    return lwmqtt_send_full(handle, tlen, msg, strlen(p), (void *) p, 0);
 }
+
+// Last TLS handshake time (ms), 0 if not TLS
+uint32_t lwmqtt_handshake(lwmqtt_t handle, uint8_t * resumed)
+{
+   if (resumed)
+      *resumed = (handle && handle->tls && handle->resumed);
+   if (!handle || !handle->tls)
+      return 0;
+   return handle->stats.handshake;
+}
+
+// Get connection stats
+const char *lwmqtt_stats(lwmqtt_t handle, lwmqtt_stats_t * stats)
+{
+   if (!handle)
+      return "No handle";
+   xSemaphoreTake(handle->mutex, portMAX_DELAY);
+   *stats = handle->stats;
+   xSemaphoreGive(handle->mutex);
+   return NULL;
+}
@@ -1,4 +1,4 @@
-// Main control code, working with WiFi, MQTT, and managing settings and OTA Copyright  2019 Adrian Kennard Andrews & Arnold Ltd
+// Main control code, working with WiFi, MQTT, and managing settings and OTA Copyright � �2019 Adrian Kennard Andrews & Arnold Ltd
 
 static const char
     __attribute__((unused)) * TAG = "RevK";
@@ -66,67 +66,70 @@ static const char
 #define	MQTT_MAX CONFIG_MQTT_BUFFER_SIZE
 #endif
 
-#define	MQTT_CLIENTS	2       // Smaller that 8 as top bit used for retain
+#ifndef	CONFIG_REVK_MQTT_CLIENTS
+#define	CONFIG_REVK_MQTT_CLIENTS	2
+#endif
+#define	MQTT_CLIENTS	CONFIG_REVK_MQTT_CLIENTS        // Max, smaller that 8 as top bit used for retain
 #define	settings	\
-		s(otahost,CONFIG_REVK_OTAHOST);		\
-		bd(otacert,CONFIG_REVK_OTACERT);		\
-		s(ntphost,CONFIG_REVK_NTPHOST);		\
-		s(tz,CONFIG_REVK_TZ);			\
-		u32(watchdogtime,10);			\
-		s(appname,CONFIG_REVK_APPNAME);		\
-    		s(nodename,NULL);				\
-		s(hostname,NULL);			\
-		p(command);				\
-		p(setting);				\
-		p(state);				\
-		p(event);				\
-		p(info);				\
-		p(error);				\
-		ioa(blink,3);				\
-    		bdp(clientkey,NULL);			\
-    		bd(clientcert,NULL);			\
+		s(otahost,CONFIG_REVK_OTAHOST)		\
+		bd(otacert,CONFIG_REVK_OTACERT)		\
+		s(ntphost,CONFIG_REVK_NTPHOST)		\
+		s(tz,CONFIG_REVK_TZ)			\
+		u32(watchdogtime,10)			\
+		s(appname,CONFIG_REVK_APPNAME)		\
+    		s(nodename,NULL)				\
+		s(hostname,NULL)			\
+		p(command)				\
+		p(setting)				\
+		p(state)				\
+		p(event)				\
+		p(info)				\
+		p(error)				\
+		ioa(blink,3)				\
+    		bdp(clientkey,NULL)			\
+    		bd(clientcert,NULL)			\
 
 #define	apconfigsettings	\
-		u32(apport,CONFIG_REVK_APPORT);		\
-		u32(aptime,CONFIG_REVK_APTIME);		\
-		u32(apwait,CONFIG_REVK_APWAIT);		\
-		io(apgpio);		\
+		u32(apport,CONFIG_REVK_APPORT)		\
+		u32(aptime,CONFIG_REVK_APTIME)		\
+		u32(apwait,CONFIG_REVK_APWAIT)		\
+		io(apgpio)		\
 
 #define	mqttsettings	\
-		sa(mqtthost,MQTT_CLIENTS,CONFIG_REVK_MQTTHOST);	\
-		sa(mqttuser,MQTT_CLIENTS,CONFIG_REVK_MQTTUSER);	\
-		sap(mqttpass,MQTT_CLIENTS,CONFIG_REVK_MQTTPASS);	\
-		u16a(mqttport,MQTT_CLIENTS,CONFIG_REVK_MQTTPORT);	\
-		bad(mqttcert,MQTT_CLIENTS,CONFIG_REVK_MQTTCERT);	\
+		sa(mqtthost,MQTT_CLIENTS,CONFIG_REVK_MQTTHOST)	\
+		sa(mqttuser,MQTT_CLIENTS,CONFIG_REVK_MQTTUSER)	\
+		sap(mqttpass,MQTT_CLIENTS,CONFIG_REVK_MQTTPASS)	\
+		u16a(mqttport,MQTT_CLIENTS,CONFIG_REVK_MQTTPORT)	\
+		bad(mqttcert,MQTT_CLIENTS,CONFIG_REVK_MQTTCERT)	\
 
 #define	wifisettings	\
-		u16(wifireset,CONFIG_REVK_WIFIRESET);	\
-		s(wifissid,CONFIG_REVK_WIFISSID);	\
-		s(wifiip,CONFIG_REVK_WIFIIP);		\
-		s(wifigw,CONFIG_REVK_WIFIGW);		\
-		sa(wifidns,3,CONFIG_REVK_WIFIDNS);		\
-		h(wifibssid,6,CONFIG_REVK_WIFIBSSID);	\
-		u8(wifichan,CONFIG_REVK_WIFICHAN);	\
-		sp(wifipass,CONFIG_REVK_WIFIPASS);	\
+		u16(wifireset,CONFIG_REVK_WIFIRESET)	\
+		s(wifissid,CONFIG_REVK_WIFISSID)	\
+		s(wifiip,CONFIG_REVK_WIFIIP)		\
+		s(wifigw,CONFIG_REVK_WIFIGW)		\
+		sa(wifidns,3,CONFIG_REVK_WIFIDNS)		\
+		h(wifibssid,6,CONFIG_REVK_WIFIBSSID)	\
+		u8(wifichan,CONFIG_REVK_WIFICHAN)	\
+		sp(wifipass,CONFIG_REVK_WIFIPASS)	\
 
 #define	apsettings	\
-		s(apssid,CONFIG_REVK_APSSID);		\
-		sp(appass,CONFIG_REVK_APPASS);		\
-    		u8(apmax,CONFIG_REVK_APMAX);	\
-		s(apip,CONFIG_REVK_APIP);		\
-		b(aplr,CONFIG_REVK_APLR);		\
-		b(aphide,CONFIG_REVK_APHIDE);		\
+		s(apssid,CONFIG_REVK_APSSID)		\
+		sp(appass,CONFIG_REVK_APPASS)		\
+    		u8(apmax,CONFIG_REVK_APMAX)	\
+		s(apip,CONFIG_REVK_APIP)		\
+		b(aplr,CONFIG_REVK_APLR)		\
+		b(aphide,CONFIG_REVK_APHIDE)		\
 
 #define	meshsettings	\
-		u16(meshreset,CONFIG_REVK_MESHRESET);	\
-		h(meshid,6,CONFIG_REVK_MESHID);		\
-		hs(meshkey,16,NULL);		\
-    		u16(meshwidth,CONFIG_REVK_MESHWIDTH);	\
-    		u16(meshdepth,CONFIG_REVK_MESHDEPTH);	\
-    		u16(meshmax,CONFIG_REVK_MESHMAX);	\
-		sp(meshpass,CONFIG_REVK_MESHPASS);	\
-		b(meshlr,CONFIG_REVK_MESHLR);		\
-    		b(meshroot,"false");			\
+		u16(meshreset,CONFIG_REVK_MESHRESET)	\
+		h(meshid,6,CONFIG_REVK_MESHID)		\
+		hs(meshkey,16,NULL)		\
+    		u16(meshwidth,CONFIG_REVK_MESHWIDTH)	\
+    		u16(meshdepth,CONFIG_REVK_MESHDEPTH)	\
+    		u16(meshmax,CONFIG_REVK_MESHMAX)	\
+		sp(meshpass,CONFIG_REVK_MESHPASS)	\
+		b(meshlr,CONFIG_REVK_MESHLR)		\
+    		b(meshroot,"false")			\
 
 #define s(n,d)		char *n;
 #define sp(n,d)		char *n;
@@ -141,8 +144,8 @@ static const char
 #define	u8(n,d)		uint8_t n;
 #define	b(n,d)		uint8_t n;
 #define	s8(n,d)		int8_t n;
-#define	io(n)		uint8_t n;
-#define	ioa(n,a)	uint8_t n[a];
+#define	io(n)		revk_gpio_t n;
+#define	ioa(n,a)	revk_gpio_t n[a];
 #define p(n)		char *prefix##n;
 #define h(n,l,d)	char n[l];
 #define hs(n,l,d)	uint8_t n[l];
@@ -188,15 +191,17 @@ settings
 /* Local types */
 typedef struct setting_s setting_t;
 struct setting_s {
+   const revk_setting_def_t *def;       // Descriptor, const if from table
    nvs_handle nvs;              // Where stored
    setting_t *next;             // Next setting
-   const char *name;            // Setting name
-   const char *defval;          // Default value, or bitfield{[space]default}
-   void *data;                  // Stored data
-   uint16_t size;               // Size of data, 0=dynamic
-   uint8_t array;               // array size
-   uint8_t flags;               // flags 
-   uint8_t namelen;             // Length of name
+   setting_t *hnext;            // Next in name hash chain
+   setting_t *kids;             // First child (parent)
+   setting_t *sibling;          // Next child of same parent (child)
+   setting_t *alias;            // Child holding same data (dup parent)
+   revk_setting_changed_t *changed;     // Change handler
+   uint32_t gen;                // setting_gen when last changed
+   const char *dv;              // Default value, after any bitfield prefix
+   uint8_t bitlen;              // Bitfield characters at start of defval
    uint8_t set:1;               // Has been set
    uint8_t parent:1;            // Parent setting
    uint8_t child:1;             // Child setting
@@ -233,23 +238,187 @@ static TaskHandle_t ap_task_id = NULL;
 #endif
 static app_callback_t *app_callback = NULL;
 lwmqtt_t mqtt_client[MQTT_CLIENTS] = { };
+#ifdef	CONFIG_REVK_MQTT
+static uint8_t mqtt_clients = 0;        // Clients in use, set from settings at init
+typedef struct
+{
+   QueueHandle_t queue;         // Outbound shared messages, if sending in own task
+   uint32_t sent;               // Messages sent
+   uint32_t failed;             // Messages not sent or not queued
+   const char *err;             // Last error
+} revk_tx_t;
+static revk_tx_t *mqtt_tx = NULL;       // Per client, MQTT_CLIENTS entries
+typedef struct
+{
+   lwmqtt_msg_t *m;             // Held for this client
+   uint8_t retain;
+} revk_tx_msg_t;
+#endif
 
 static uint32_t restart_time = 0;
 static uint32_t nvs_time = 0;
-static uint8_t setting_dump_requested = 0;
+static uint32_t setting_dump_requested = 0;    // Dump requests, 0 when none pending (setting_old_mutex)
+static const char *setting_dump_after = NULL;   // Resume dump after this setting (setting_old_mutex)
+static uint32_t setting_dump_since = 0; // Only dump settings changed after this generation (setting_old_mutex)
+static uint32_t setting_gen = 0;        // Settings generation, counts changes since boot
+static uint32_t setting_boot = 0;       // Random per boot, a gen is only meaningful with the boot it came from
+typedef struct setting_old_s setting_old_t;
+struct setting_old_s
+{                               // Replaced dynamic setting value, freed once no readers could have it
+   setting_old_t *next;
+   void *value;
+   uint32_t epoch;              // Epoch when replaced
+   uint32_t when;               // Uptime when replaced
+};
+static setting_old_t *setting_old = NULL;
+static SemaphoreHandle_t setting_old_mutex = NULL;
+static volatile uint32_t setting_epoch = 0;
+static volatile uint16_t setting_readers[2] = { };      // Readers in progress by epoch
+#define	SETTING_GRACE	2       // Seconds old values are kept anyway, for readers not using revk_setting_read_begin()
+#define	SETTING_DUMP_PACKETS	4       // Packets per slice of setting dump
 static const char *restart_reason = "Unknown";
 static nvs_handle nvs = -1;
 static setting_t *setting = NULL;
+#define	SETTING_HASH	64
+static setting_t *setting_hash[SETTING_HASH] = { };     // By name
+// Settings snapshot, all settings values from a namespace in one blob, read in one go at boot, per key NVS is fallback
+#define	SNAP_KEY	"_snapshot"
+#define	SNAP_MAGIC	0x5253
+#define	SNAP_VERSION	1
+#define	SNAP_ABSENT	0xFFFF  // Value length for key not in NVS
+#define	SNAPS	4               // Namespaces
+typedef struct
+{
+   uint16_t magic;
+   uint8_t version;
+   uint8_t spare;
+   uint32_t len;                // Records after header
+   uint32_t hash;               // FNV-1a of records
+} snap_head_t;
+typedef struct
+{
+   nvs_handle nvs;
+   uint8_t *blob;               // Loaded records (boot only)
+   uint32_t len;
+   uint32_t pos;                // Where next lookup starts, as keys are read in the same order each boot
+   uint32_t hit;                // Last record found, as a key is often looked up for length and then data, 0 for none
+   uint8_t *new;                // Records read from NVS (boot only), added to loaded records if any
+   uint32_t newlen;
+   uint32_t newsize;
+   uint8_t used:1;
+   uint8_t loaded:1;            // Snapshot loaded and valid
+   uint8_t miss:1;              // Key not in snapshot, so write new one
+   uint8_t stale:1;             // Setting changed, snapshot erased
+} snap_t;
+static snap_t snap[SNAPS] = { };
+static uint8_t snap_boot = 0;   // Using snapshots (boot)
+static int64_t boot_start = 0;  // When revk_boot called (us)
+static uint32_t boot_ms = 0;    // revk_boot to revk_start (ms)
 #if	defined(CONFIG_REVK_WIFI) || defined(CONFIG_REVK_MESH)
 static uint32_t link_down = 1;  // When link last down
 static esp_netif_t *sta_netif = NULL;
 static esp_netif_t *ap_netif = NULL;
 #endif
+#ifdef	CONFIG_REVK_MQTT
+// Out queue - events, errors and state held while not connected, and sent on reconnect
+// Also paced by a token bucket per client, higher classes first
+enum
+{                               // Classes, highest priority first
+   QUEUE_ERROR,
+   QUEUE_STATE,
+   QUEUE_EVENT,
+   QUEUE_INFO,
+   QUEUE_BULK,
+};
+typedef struct revk_queue_s revk_queue_t;
+struct revk_queue_s
+{
+   revk_queue_t *next;
+   uint8_t clients;             // Clients still to send to
+   uint8_t retain:1;            // State, replaced by later state for same topic
+   uint8_t pri:3;               // Class
+   uint16_t tlen;               // Topic length
+   uint16_t plen;               // Payload length
+   unsigned char data[];        // Topic then payload
+};
+static SemaphoreHandle_t queue_mutex = NULL;
+static revk_queue_t *queue = NULL;      // Oldest first
+static uint32_t queue_bytes = 0;        // RAM used by queue
+static uint32_t queue_count = 0;        // Messages in RAM queue
+static uint32_t queue_dropped = 0;      // Messages lost since last reported
+static uint32_t queue_deferred = 0;     // Messages delayed by rate limit or higher class
+#if	CONFIG_REVK_MQTT_RATE > 0
+static int32_t queue_tokens[MQTT_CLIENTS] = { };        // Token bucket (1/1000 message)
+static int64_t queue_token_time = 0;    // Last refill
+#endif
+static uint32_t queue_hold = 0; // Do not drain until this uptime, lets connect messages go first
+// Cached prefix/app/id topic for each prefix setting, rebuilt when settings change
+static char **const topic_prefix[] = { &prefixcommand, &prefixsetting, &prefixstate, &prefixevent, &prefixinfo, &prefixerror };
+#define	TOPICS	(sizeof(topic_prefix)/sizeof(*topic_prefix))
+static struct
+{
+   char *topic;                 // prefix/app/id
+   uint16_t len;                // Length of topic
+   uint16_t base;               // Length of prefix/app/
+   uint32_t gen;                // topic_gen when built
+} topic_cache[TOPICS] = { };
+static uint32_t topic_gen = 1;  // Changed when live settings change
+static SemaphoreHandle_t topic_mutex = NULL;
+// Error ring, errors are held and sent when connected, repeats counted
+#define	ERROR_TS	4       // Occurrence times kept per error
+#define	ERROR_FLUSH	5       // Seconds between sending held errors, so a burst of repeats goes as one
+typedef struct
+{
+   char *suffix;                // malloc'd, NULL for none
+   char *payload;               // malloc'd JSON
+   uint8_t clients;             // Clients still to send to
+   uint16_t count;              // Occurrences
+   uint32_t up[ERROR_TS];       // Uptime of most recent occurrences (by count)
+} revk_err_t;
+static revk_err_t error_ring[CONFIG_REVK_ERRORS] = { };
+static uint8_t error_first = 0; // Oldest
+static uint8_t error_count = 0; // Number held
+static uint32_t error_lost = 0; // Errors lost as ring full
+static SemaphoreHandle_t error_mutex = NULL;
+#if	CONFIG_REVK_MQTT_WORKERS > 0
+typedef struct
+{
+   int64_t queued;              // When queued (us)
+   uint8_t client;
+   uint16_t tlen;               // Topic length
+   uint16_t plen;               // Payload length
+   unsigned char *data;         // malloc'd topic, NULL, payload, NULL
+} rx_work_t;
+#define	RX_WAIT		500     // ms the receive path waits on a full worker queue before dropping
+static QueueHandle_t rx_queue[CONFIG_REVK_MQTT_WORKERS] = { };
+static SemaphoreHandle_t rx_mutex = NULL;
+static struct
+{
+   uint32_t count;              // Messages run
+   uint32_t full;               // Times receive path blocked on full queue
+   uint32_t dropped;            // Messages dropped as queue still full after RX_WAIT
+   uint64_t wait;               // Total queue wait (us)
+   uint64_t run;                // Total handler time (us)
+   uint32_t waitmax;            // Longest queue wait (us)
+   uint32_t runmax;             // Longest handler time (us)
+} rx_stats = { };
+#endif
+#endif
 static char wdt_test = 0;
 static uint8_t blink_on = 0,
     blink_off = 0;
 static const char *blink_colours = "RYGCBM";
-static const char *revk_setting_dump(void);
+static const char *revk_setting_dump(const char *after, uint32_t since, int packets);
+static uint32_t setting_etag(void);
+static setting_t *setting_lookup(const char *tag, int *index);
+static void setting_reclaim(void);
+#ifdef	CONFIG_REVK_MQTT
+static uint8_t mqtt_out(uint8_t clients, int tlen, const char *topic, int plen, const unsigned char *payload, char retain);
+#if	CONFIG_REVK_MQTT_TXQ > 0
+static void mqtt_tx_task(void *arg);
+#endif
+static void revk_queue_hold(uint8_t clients, lwmqtt_msg_t * m, char retain);
+#endif
 
 #ifdef	CONFIG_REVK_MESH
 // OTA to mesh devices
@@ -268,6 +437,15 @@ static void ap_task(void *pvParameters);
 static void ip_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
 static void mqtt_rx(void *arg, char *topic, unsigned short plen, unsigned char *payload);
 static const char *revk_upgrade(const char *target, jo_t j);
+static void revk_register_commands(void);
+static void snap_done(void);
+#ifdef	CONFIG_REVK_MQTT
+static void revk_queue_drain(void);
+static void revk_error_flush(void);
+#ifdef	CONFIG_REVK_MQTT_QUEUE_FLASH
+static void queue_flash_init(void);
+#endif
+#endif
 
 #ifdef	CONFIG_REVK_MESH
 static void mesh_init(void);
@@ -513,9 +691,7 @@ static void mesh_task(void *pvParameters)
             {                   // To root: tag is client bit map of which external MQTT server to send to
                if (memcmp(from.addr, revk_mac, 6))
                {                // From us is exception, we would have sent direct
-                  for (int client = 0; client < MQTT_CLIENTS; client++)
-                     if (tag & (1 << client))
-                        lwmqtt_send_full(mqtt_client[client], -1, topic, e - payload, (void *) payload, tag >> 7);      // Out
+                  mqtt_out(tag & 0x7F, -1, topic, e - payload, (void *) payload, tag >> 7);       // Out
                }
             } else
             {                   // To leaf: tag is client ID
@@ -755,207 +931,564 @@ static void mesh_init(void)
 }
 #endif
 
+#ifdef	CONFIG_REVK_MQTT
+static char *revk_topic(char *buf, int size, const char *prefix, const char *target, const char *suffix)
+{                               // Make prefix/app/target/suffix in buf, or malloc'd if too long, target NULL for us, suffix may be NULL
+   int tlen = (target ? strlen(target) : 0),
+       slen = (suffix ? strlen(suffix) + 1 : 0),
+       len = 0;
+   char *t = NULL;
+   int i;
+   for (i = 0; i < TOPICS && *topic_prefix[i] != prefix; i++);
+   if (i < TOPICS && topic_mutex)
+   {                            // One of ours, use cache
+      xSemaphoreTake(topic_mutex, portMAX_DELAY);
+      if (topic_cache[i].gen != topic_gen)
+      {                         // (Re)build
+         freez(topic_cache[i].topic);
+         if (asprintf(&topic_cache[i].topic, "%s/%s/%s", prefix, appname, *hostname ? hostname : revk_id) >= 0)
+         {
+            topic_cache[i].len = strlen(topic_cache[i].topic);
+            topic_cache[i].base = strlen(prefix) + 1 + strlen(appname) + 1;
+            topic_cache[i].gen = topic_gen;
+         } else
+            topic_cache[i].topic = NULL;
+      }
+      if (topic_cache[i].topic)
+      {
+         len = (target ? topic_cache[i].base + tlen : topic_cache[i].len);
+         t = (len + slen < size ? buf : malloc(len + slen + 1));
+         if (t)
+         {
+            memcpy(t, topic_cache[i].topic, target ? topic_cache[i].base : len);
+            if (target)
+               memcpy(t + topic_cache[i].base, target, tlen);
+         }
+      }
+      xSemaphoreGive(topic_mutex);
+   } else
+   {                            // App specific prefix
+      if (!target)
+         target = (*hostname ? hostname : revk_id);
+      int plen = strlen(prefix),
+          alen = strlen(appname);
+      tlen = strlen(target);
+      len = plen + 1 + alen + 1 + tlen;
+      t = (len + slen < size ? buf : malloc(len + slen + 1));
+      if (t)
+      {
+         memcpy(t, prefix, plen);
+         t[plen] = '/';
+         memcpy(t + plen + 1, appname, alen);
+         t[plen + 1 + alen] = '/';
+         memcpy(t + plen + 1 + alen + 1, target, tlen);
+      }
+   }
+   if (!t)
+      return NULL;
+   if (suffix)
+   {
+      t[len] = '/';
+      memcpy(t + len + 1, suffix, slen - 1);
+      len += slen;
+   }
+   t[len] = 0;
+   return t;
+}
+#endif
+
+#ifdef	CONFIG_REVK_MQTT
+#define	SUBUNSUB_MACS	8       // Devices per batch of topics
+static void revk_send_subunsub(int client, int count, const mac_t * macs, char unsubscribe)
+{                               // Build the whole subscription set for devices and send in as few packets as possible
+   if (client >= MQTT_CLIENTS || !mqtt_client[client] || count <= 0)
+      return;
+   ESP_LOGI(TAG, "MQTT%d %s %d device%s", client, unsubscribe ? "Unsubscribe" : "Subscribe", count, count == 1 ? "" : "s");
+   typedef char topic_t[64];
+   topic_t *buf = malloc(sizeof(topic_t) * 6 * SUBUNSUB_MACS);
+   if (!buf)
+      return;
+   char *topics[6 * SUBUNSUB_MACS];
+   int n = 0;
+   void add(const char *prefix, const char *target) {
+      if ((topics[n] = revk_topic(buf[n], sizeof(buf[n]), prefix, target, "#")))
+         n++;
+   }
+   void send(void) {
+      lwmqtt_subscribeub_multi(mqtt_client[client], n, (const char *const *) topics, unsubscribe);
+      while (n--)
+         if (topics[n] != buf[n])
+            free(topics[n]);
+      n = 0;
+   }
+   char any = 0;                // Wildcard target only needed once, and only unsubscribed for us
+   for (int m = 0; m < count; m++)
+   {
+      const uint8_t *mac = macs[m];
+      char id[13];
+      sprintf(id, "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+      char self = !memcmp(mac, revk_mac, 6);
+      void sub(const char *prefix) {
+         add(prefix, id);
+         if (!any && (!unsubscribe || self))
+            add(prefix, "*");
+         if (self && *hostname && strcmp(hostname, id))
+            add(prefix, hostname);
+      }
+      sub(prefixcommand);
+      if (!client)
+         sub(prefixsetting);
+      if (!unsubscribe || self)
+         any = 1;
+      if (n > 6 * (SUBUNSUB_MACS - 1))
+         send();                // No room for another device
+   }
+   if (n)
+      send();
+   free(buf);
+}
+#endif
+
 #ifdef	CONFIG_REVK_MESH
 void revk_send_unsub(int client, const mac_t mac)
 {
-   if (client >= MQTT_CLIENTS || !mqtt_client[client])
-      return;
-   char id[13];
-   sprintf(id, "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-   ESP_LOGI(TAG, "MQTT%d Unsubscribe %s", client, id);
-   void sub(const char *prefix) {
-      char *topic = NULL;
-      if (asprintf(&topic, "%s/%s/%s/#", prefix, appname, id) < 0)
-         return;
-      lwmqtt_unsubscribe(mqtt_client[client], topic);
-      freez(topic);
-      if (asprintf(&topic, "%s/%s/*/#", prefix, appname) < 0)
-         return;
-      lwmqtt_unsubscribe(mqtt_client[client], topic);
-      freez(topic);
-      if (*hostname && strcmp(hostname, id))
+   revk_send_subunsub(client, 1, (const mac_t *) mac, 1);
+}
+
+void revk_send_unsub_multi(int client, int count, const mac_t * macs)
+{
+   revk_send_subunsub(client, count, macs, 1);
+}
+
+void revk_send_sub_multi(int client, int count, const mac_t * macs)
+{
+   revk_send_subunsub(client, count, macs, 0);
+}
+#endif
+
+#ifdef	CONFIG_REVK_MQTT
+void revk_send_sub(int client, const mac_t mac)
+{
+   revk_send_subunsub(client, 1, (const mac_t *) mac, 0);
+}
+
+static void revk_send_sub_all(int client)
+{                               // Subscribe for us, and if mesh root all the nodes we route for, batched
+#ifdef	CONFIG_REVK_MESH
+   if (esp_mesh_is_root())
+   {
+      int size = esp_mesh_get_routing_table_size();
+      mesh_addr_t *table = (size > 0 ? malloc(size * sizeof(*table)) : NULL);
+      if (table)
       {
-         if (asprintf(&topic, "%s/%s/%s/#", prefix, appname, hostname) < 0)
-            return;
-         lwmqtt_unsubscribe(mqtt_client[client], topic);
-         freez(topic);
+         if (esp_mesh_get_routing_table(table, size * sizeof(*table), &size) == ESP_OK && size > 0)
+         {                      // Includes us
+            mac_t *macs = malloc(size * sizeof(*macs));
+            if (macs)
+            {
+               for (int i = 0; i < size; i++)
+                  memcpy(macs[i], table[i].addr, 6);
+               revk_send_subunsub(client, size, macs, 0);
+               free(macs);
+               free(table);
+               return;
+            }
+         }
+         free(table);
       }
    }
-   sub(prefixcommand);
-   if (!client)
-      sub(prefixsetting);
+#endif
+   revk_send_sub(client, revk_mac);     // Self
 }
 #endif
 
 #ifdef	CONFIG_REVK_MQTT
-void revk_send_sub(int client, const mac_t mac)
+// Routing of incoming MQTT, specific suffix routes first, then any suffix routes, in order registered
+// Compiled by revk_start in to a list per prefix, so an incoming message finds its prefix once and only checks routes for it
+#define	ROUTE_PREFIXES	8       // Max prefixes with their own routes
+typedef struct revk_route_s revk_route_t;
+struct revk_route_s
 {
-   if (client >= MQTT_CLIENTS || !mqtt_client[client])
-      return;
-   char id[13];
-   sprintf(id, "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-   ESP_LOGI(TAG, "MQTT%d Subscribe %s", client, id);
-   void sub(const char *prefix) {
-      char *topic = NULL;
-      if (asprintf(&topic, "%s/%s/%s/#", prefix, appname, id) < 0)
-         return;
-      lwmqtt_subscribe(mqtt_client[client], topic);
-      freez(topic);
-      if (asprintf(&topic, "%s/%s/*/#", prefix, appname) < 0)
-         return;
-      lwmqtt_subscribe(mqtt_client[client], topic);
-      freez(topic);
-      if (*hostname && strcmp(hostname, id))
+   revk_route_t *next;
+   char **prefix;               // Prefix setting, NULL for any
+   const char *target;          // Target pattern, NULL for any, ending * for any starting with the rest
+   uint8_t tlen;                // Target pattern length, not including ending *
+   uint8_t twild:1;             // Target pattern ends *
+   const char *suffix;          // Suffix, NULL for any
+   uint16_t slen;               // Suffix length
+   uint8_t flags;
+   app_callback_t *handler;
+};
+static revk_route_t *route = NULL;      // As registered
+static char **route_prefix[ROUTE_PREFIXES];     // Prefixes with routes
+static uint8_t route_prefixes = 0;
+static revk_route_t **route_list[ROUTE_PREFIXES + 1] = { };     // NULL terminated routes to try for each prefix, last is for any other prefix
+
+const char *revk_route(char **prefix, const char *target, const char *suffix, uint8_t flags, app_callback_t * handler)
+{
+   if (route_list[0])
+      return "Too late";        // Already compiled
+   revk_route_t *r = malloc(sizeof(*r));
+   if (!r)
+      return "Malloc";
+   memset(r, 0, sizeof(*r));
+   r->prefix = prefix;
+   if ((r->target = target))
+   {
+      int l = strlen(target);
+      if (l && target[l - 1] == '*')
       {
-         if (asprintf(&topic, "%s/%s/%s/#", prefix, appname, hostname) < 0)
-            return;
-         lwmqtt_subscribe(mqtt_client[client], topic);
-         freez(topic);
+         r->twild = 1;
+         l--;
       }
+      r->tlen = l;
    }
-   sub(prefixcommand);
-   if (!client)
-      sub(prefixsetting);
+   r->suffix = suffix;
+   r->slen = (suffix ? strlen(suffix) : 0);
+   r->flags = flags;
+   r->handler = handler;
+   revk_route_t **rp = &route;
+   while (*rp && (!suffix || (*rp)->suffix))
+      rp = &(*rp)->next;        // Specific before any suffix
+   r->next = *rp;
+   *rp = r;
+   return NULL;
+}
+
+static void route_compile(void)
+{                               // Make the per prefix lists, once all registered
+   int n = 0;
+   for (revk_route_t * r = route; r; r = r->next)
+   {
+      n++;
+      if (!r->prefix)
+         continue;
+      int p = 0;
+      while (p < route_prefixes && route_prefix[p] != r->prefix)
+         p++;
+      if (p < route_prefixes)
+         continue;
+      if (route_prefixes == ROUTE_PREFIXES)
+      {
+         ESP_LOGE(TAG, "Too many route prefixes");
+         continue;
+      }
+      route_prefix[route_prefixes++] = r->prefix;
+   }
+   revk_route_t **l = malloc(sizeof(*l) * (route_prefixes + 1) * (n + 1));      // Worst case every list has every route
+   if (!l)
+      return;
+   for (int p = 0; p <= route_prefixes; p++)
+   {
+      route_list[p] = l;
+      for (revk_route_t * r = route; r; r = r->next)
+         if (!r->prefix || (p < route_prefixes && r->prefix == route_prefix[p]))
+            *l++ = r;           // Keeps specific suffix first order
+      *l++ = NULL;
+   }
+}
+
+static int route_target(revk_route_t * r, const char *target)
+{                               // Target matches route target pattern
+   if (!r->target)
+      return 1;
+   if (!target || (r->twild ? strlen(target) < r->tlen : strlen(target) != r->tlen))
+      return 0;
+   return !memcmp(target, r->target, r->tlen);
+}
+
+static const char *route_upgrade(int client, const char *prefix, const char *target, const char *suffix, jo_t j)
+{                               // Special case as command can be to other host
+   return revk_upgrade(target, j);
+}
+
+static const char *route_command(int client, const char *prefix, const char *target, const char *suffix, jo_t j)
+{
+   return revk_command(suffix, j);
+}
+
+static void setting_dump_request(const char *after, uint32_t since)
+{                               // Start a settings dump, replacing any in progress, done a slice at a time from revk_task
+   xSemaphoreTake(setting_old_mutex, portMAX_DELAY);
+   setting_dump_after = after;
+   setting_dump_since = since;
+   setting_dump_requested++;
+   xSemaphoreGive(setting_old_mutex);
+}
+
+static const char *route_setting(int client, const char *prefix, const char *target, const char *suffix, jo_t j)
+{
+   if (!j)
+   {                            // Dump, or with suffix dump settings after that one
+      setting_t *s = NULL;
+      int index;
+      if (suffix && !(s = setting_lookup(suffix, &index)))
+         return "Unknown setting";
+      setting_dump_request(s ? s->def->name : NULL, 0);
+      return "";
+   }
+   if (!suffix && jo_here(j) == JO_STRING)
+   {                            // Conditional dump, "if-not-match etag" or "since boot:gen"
+      char cmd[40];
+      if (jo_strncpy(j, cmd, sizeof(cmd)) < 0)
+         return "Bad request";
+      uint32_t since = 0;
+      if (!strncmp(cmd, "if-not-match ", 13))
+      {
+         if (strtoul(cmd + 13, NULL, 16) == setting_etag())
+         {
+            jo_t u = jo_object_alloc();
+            jo_bool(u, "unchanged", 1);
+            jo_stringf(u, "boot", "%08X", (unsigned int) setting_boot);
+            jo_int(u, "gen", setting_gen);
+            jo_stringf(u, "etag", "%08X", (unsigned int) setting_etag());
+            revk_info("setting", &u);
+            return "";
+         }
+      } else if (!strncmp(cmd, "since ", 6))
+      {
+         char *p;
+         uint32_t boot = strtoul(cmd + 6, &p, 16);
+         if (*p == ':' && boot == setting_boot)
+            since = strtoul(p + 1, NULL, 10);
+         if (since > setting_gen)
+            since = 0;          // Not this boot, or no boot given, send all
+      } else
+         return "Unknown request";
+      setting_dump_request(NULL, since);
+      return "";
+   }
+   return revk_setting(j) ? : "Unknown setting";
 }
 #endif
 
 #ifdef	CONFIG_REVK_MQTT
-static void mqtt_rx(void *arg, char *topic, unsigned short plen, unsigned char *payload)
-{                               // Expects to be able to write over topic
-   int client = (int) arg;
-   if (client < 0 || client >= MQTT_CLIENTS)
-      return;
-   if (topic)
+static void mqtt_rx_topic(int client, char *topic, unsigned short plen, unsigned char *payload)
+{                               // Process a received message, expects to be able to write over topic
+   const char *err = NULL;
+   // Break up topic
+   char *prefix = topic;
+   char *target = "?";
+   char *suffix = NULL;
+   char *appname = NULL;
+   char *p = topic;
+   while (*p && *p != '/')
+      p++;
+   if (*p)
+   {                            // Expect app name next
+      appname = ++p;
+      while (*p && *p != '/')
+         p++;
+   }
+   if (*p)
    {
-      const char *err = NULL;
-      // Break up topic
-      char *prefix = topic;
-      char *target = "?";
-      char *suffix = NULL;
-      char *appname = NULL;
-      char *p = topic;
+      target = ++p;
       while (*p && *p != '/')
          p++;
-      if (*p)
-      {                         // Expect app name next
-         appname = ++p;
-         while (*p && *p != '/')
-            p++;
-      }
-      if (*p)
-      {
-         target = ++p;
-         while (*p && *p != '/')
-            p++;
-      }
-      if (*p)
-         suffix = ++p;
+   }
+   if (*p)
+      suffix = ++p;
 #ifdef	CONFIG_REVK_MESH
-      if (esp_mesh_is_root() && (*target == '*' || strncmp(target, revk_id, strlen(revk_id))))
-      {                         // pass on to clients as global or not for us
-         mesh_data_t data = {.proto = MESH_PROTO_MQTT };
-         mesh_make_mqtt(&data, client, -1, topic, plen, payload);       // Ensures MESH_PAD space one end
-         mesh_addr_t addr = {.addr = { 255, 255, 255, 255, 255, 255 }
-         };
-         if (*target != '*')
-            for (int n = 0; n < sizeof(addr.addr); n++)
-               addr.addr[n] = (((target[n * 2] & 0xF) + (target[n * 2] > '9' ? 9 : 0)) << 4) + ((target[1 + n * 2] & 0xF) + (target[1 + n * 2] > '9' ? 9 : 0));
-         mesh_encode_send(&addr, &data, MESH_DATA_P2P); // **** THIS EXPECTS MESH_PAD AVAILABLE EXTRA BYTES ON SIZE ****
-         free(data.data);
-      }
+   if (esp_mesh_is_root() && (*target == '*' || strncmp(target, revk_id, strlen(revk_id))))
+   {                            // pass on to clients as global or not for us
+      mesh_data_t data = {.proto = MESH_PROTO_MQTT };
+      mesh_make_mqtt(&data, client, -1, topic, plen, payload);  // Ensures MESH_PAD space one end
+      mesh_addr_t addr = {.addr = { 255, 255, 255, 255, 255, 255 }
+      };
+      if (*target != '*')
+         for (int n = 0; n < sizeof(addr.addr); n++)
+            addr.addr[n] = (((target[n * 2] & 0xF) + (target[n * 2] > '9' ? 9 : 0)) << 4) + ((target[1 + n * 2] & 0xF) + (target[1 + n * 2] > '9' ? 9 : 0));
+      mesh_encode_send(&addr, &data, MESH_DATA_P2P);    // **** THIS EXPECTS MESH_PAD AVAILABLE EXTRA BYTES ON SIZE ****
+      free(data.data);
+   }
 #endif
-      // Break up topic
-      if (appname)
-         appname[-1] = 0;
+   // Break up topic
+   if (appname)
+      appname[-1] = 0;
+   if (target)
+      target[-1] = 0;
+   if (suffix)
+      suffix[-1] = 0;
+   int rp = 0;                  // Which prefix we route on
+   while (rp < route_prefixes && strcmp(prefix, *route_prefix[rp]))
+      rp++;
+   char **pre = (rp < route_prefixes ? route_prefix[rp] : NULL);
+   jo_t j = NULL;
+   if (plen)
+   {
+      if (*payload != '"' && *payload != '{' && *payload != '[')
+      {                         // Looks like non JSON
+         if (suffix && pre == &prefixsetting)
+         {                      // Special case for settings, the suffix is the setting
+            j = jo_object_alloc();
+            jo_stringf(j, suffix, "%.*s", plen, payload);
+         } else
+         {                      // Just JSON the argument
+            j = jo_create_alloc();
+            int q = 0;
+            if (q + 1 < plen && payload[q] == '-' && payload[q + 1] >= '0' && payload[q + 1] <= '9')
+               q++;
+            while (q < plen && payload[q] >= '0' && payload[q] <= '9')
+               q++;
+            if (plen && q == plen)
+               jo_litf(j, NULL, "%.*s", plen, payload); // Looks safe as number
+            else
+               jo_stringf(j, NULL, "%.*s", plen, payload);
+         }
+      } else
+      {                         // Parse JSON argument
+         j = jo_parse_mem(payload, plen + 1);   // +1 as we can trust a trailing NULL from lwmqtt
+         jo_skip(j);            // Check whole JSON
+         int pos;
+         err = jo_error(j, &pos);
+         if (err)
+            ESP_LOGE(TAG, "Fail at pos %d, %s: (%.10s...) %.*s", pos, err, jo_debug(j), plen, payload);
+      }
+      jo_rewind(j);
+   }
+   const char *topictarget = target;    // As in topic, for target patterns
+   if (!strcmp(target, "*") || !strcmp(target, revk_id) || (*hostname && !strcmp(target, hostname)))
+      target = NULL;            // Mark as us for simple testing by app_command, etc
+   int slen = (suffix ? strlen(suffix) : 0);
+   revk_route_t *r = NULL;
+   if (route_list[rp])
+      for (revk_route_t ** l = route_list[rp]; (r = *l); l++)
+         if ((!(r->flags & REVK_ROUTE_US) || !target) && (!(r->flags & REVK_ROUTE_MAIN) || !client) && route_target(r, topictarget) && (!r->suffix || (suffix && r->slen == slen && !memcmp(r->suffix, suffix, slen))))
+            break;
+   if (r)
+   {
+      jo_rewind(j);
+      err = (err ? : r->handler(client, prefix, target, suffix, j));
+   } else if (!client && !target)
+      err = (err ? : "");       // For us, ignore (could otherwise be for app callback)
+   if ((!err || !*err) && app_callback && (!r || !(r->flags & REVK_ROUTE_ONLY)))
+   {                            /* Pass to app, even if we handled with no error */
+      jo_rewind(j);
+      const char *e2 = app_callback(client, prefix, target, suffix, j);
+      if (e2 && (*e2 || !err))
+         err = e2;              /* Overwrite error if we did not have one */
+   }
+   if (!err && !target)
+      err = "Unknown";
+   if (err && *err)
+   {
+      jo_t e = jo_make(NULL);
+      jo_string(e, "description", err);
+      if (prefix)
+         jo_string(e, "prefix", prefix);
       if (target)
-         target[-1] = 0;
+         jo_string(e, "target", target);
       if (suffix)
-         suffix[-1] = 0;
-      jo_t j = NULL;
-      if (plen)
+         jo_string(e, "suffix", suffix);
+      if (j)
+         jo_lit(e, "payload", (char *) payload);
+      else if (plen)
+         jo_string(e, "payload", (char *) payload);
+      revk_error(suffix, &e);
+   }
+   jo_free(&j);
+}
+
+#if	CONFIG_REVK_MQTT_WORKERS > 0
+static void rx_worker(void *arg)
+{                               // Runs received messages, so slow handlers do not block the MQTT receive path
+   QueueHandle_t q = arg;
+   rx_work_t w;
+   while (1)
+      if (xQueueReceive(q, &w, portMAX_DELAY) == pdTRUE)
       {
-         if (*payload != '"' && *payload != '{' && *payload != '[')
-         {                      // Looks like non JSON
-            if (prefix && suffix && !strcmp(prefix, prefixsetting))
-            {                   // Special case for settings, the suffix is the setting
-               j = jo_object_alloc();
-               jo_stringf(j, suffix, "%.*s", plen, payload);
-            } else
-            {                   // Just JSON the argument
-               j = jo_create_alloc();
-               int q = 0;
-               if (q + 1 < plen && payload[q] == '-' && payload[q + 1] >= '0' && payload[q + 1] <= '9')
-                  q++;
-               while (q < plen && payload[q] >= '0' && payload[q] <= '9')
-                  q++;
-               if (plen && q == plen)
-                  jo_litf(j, NULL, "%.*s", plen, payload);      // Looks safe as number
-               else
-                  jo_stringf(j, NULL, "%.*s", plen, payload);
-            }
-         } else
-         {                      // Parse JSON argument
-            j = jo_parse_mem(payload, plen + 1);        // +1 as we can trust a trailing NULL from lwmqtt
-            jo_skip(j);         // Check whole JSON
-            int pos;
-            err = jo_error(j, &pos);
-            if (err)
-               ESP_LOGE(TAG, "Fail at pos %d, %s: (%.10s...) %.*s", pos, err, jo_debug(j), plen, payload);
-         }
-         jo_rewind(j);
+         int64_t start = esp_timer_get_time();
+         uint32_t wait = start - w.queued;
+         mqtt_rx_topic(w.client, (char *) w.data, w.plen, w.data + w.tlen + 1);
+         uint32_t run = esp_timer_get_time() - start;
+         free(w.data);
+         xSemaphoreTake(rx_mutex, portMAX_DELAY);
+         rx_stats.count++;
+         rx_stats.wait += wait;
+         if (wait > rx_stats.waitmax)
+            rx_stats.waitmax = wait;
+         rx_stats.run += run;
+         if (run > rx_stats.runmax)
+            rx_stats.runmax = run;
+         xSemaphoreGive(rx_mutex);
       }
-      if (!strcmp(target, "*") || !strcmp(target, revk_id) || (*hostname && !strcmp(target, hostname)))
-         target = NULL;         // Mark as us for simple testing by app_command, etc
-      if (!client && prefix && !strcmp(prefix, prefixcommand) && suffix && !strcmp(suffix, "upgrade"))
-         err = (err ? : revk_upgrade(target, j));       // Special case as command can be to other host
-      else if (!client && !target)
-      {                         // For us (could otherwise be for app callback)
-         if (prefix && !strcmp(prefix, prefixcommand))
-            err = (err ? : revk_command(suffix, j));
-         else if (prefix && !strcmp(prefix, prefixsetting))
+}
+
+static int rx_work_queue(int client, const char *topic, unsigned short plen, const unsigned char *payload)
+{                               // Copy and queue for a worker, returns 0 if not queued
+   if (!rx_mutex)
+      return 0;
+   int tlen = strlen(topic);
+   rx_work_t w = {.client = client,.tlen = tlen,.plen = plen };
+   w.data = malloc(tlen + 1 + plen + 1);
+   if (!w.data)
+      return 0;                 // Run inline
+   memcpy(w.data, topic, tlen + 1);
+   memcpy(w.data + tlen + 1, payload, plen);
+   w.data[tlen + 1 + plen] = 0; // Parsing trusts a trailing NULL
+   int n = 0;
+#if	CONFIG_REVK_MQTT_WORKERS > 1
+   const char *s = topic;
+   for (int i = 0; i < 3 && s; i++)
+      if ((s = strchr(s, '/')))
+         s++;
+   uint32_t h = 2166136261;     // Same suffix always to same worker, so stays in order
+   for (s = s ? : topic; *s; s++)
+      h = (h ^ (uint8_t) * s) * 16777619;
+   n = h % CONFIG_REVK_MQTT_WORKERS;
+#endif
+   w.queued = esp_timer_get_time();
+   if (xQueueSend(rx_queue[n], &w, 0) != pdTRUE)
+   {                            // Full, block the receive path a while, which stops reading the socket
+      xSemaphoreTake(rx_mutex, portMAX_DELAY);
+      rx_stats.full++;
+      xSemaphoreGive(rx_mutex);
+      if (xQueueSend(rx_queue[n], &w, RX_WAIT / portTICK_PERIOD_MS) != pdTRUE)
+      {                         // Still full, drop, a command gets told
+         free(w.data);
+         xSemaphoreTake(rx_mutex, portMAX_DELAY);
+         rx_stats.dropped++;
+         xSemaphoreGive(rx_mutex);
+         int l = strlen(prefixcommand);
+         if (!strncmp(topic, prefixcommand, l) && topic[l] == '/')
          {
-            if (!suffix && !plen)
-            {
-               setting_dump_requested = 1;
-               err = "";
-            } else
-               err = ((err ? : revk_setting(j)) ? : "Unknown setting");
-         } else
-            err = (err ? : ""); // Ignore
-      }
-      if ((!err || !*err) && app_callback)
-      {                         /* Pass to app, even if we handled with no error */
-         jo_rewind(j);
-         const char *e2 = app_callback(client, prefix, target, suffix, j);
-         if (e2 && (*e2 || !err))
-            err = e2;           /* Overwrite error if we did not have one */
+            jo_t e = jo_make(NULL);
+            jo_string(e, "description", "Busy");
+            jo_string(e, "topic", topic);
+            revk_error("busy", &e);
+         }
+         ESP_LOGE(TAG, "RX worker busy, dropped %s", topic);
       }
-      if (!err && !target)
-         err = "Unknown";
-      if (err && *err)
-      {
-         jo_t e = jo_make(NULL);
-         jo_string(e, "description", err);
-         if (prefix)
-            jo_string(e, "prefix", prefix);
-         if (target)
-            jo_string(e, "target", target);
-         if (suffix)
-            jo_string(e, "suffix", suffix);
-         if (j)
-            jo_lit(e, "payload", (char *) payload);
-         else if (plen)
-            jo_string(e, "payload", (char *) payload);
-         revk_error(suffix, &e);
-      }
-      jo_free(&j);
+   }
+   return 1;
+}
+#endif
+
+static void mqtt_rx(void *arg, char *topic, unsigned short plen, unsigned char *payload)
+{                               // Expects to be able to write over topic
+   int client = (int) arg;
+   if (client < 0 || client >= MQTT_CLIENTS)
+      return;
+   if (topic)
+   {
+#if	CONFIG_REVK_MQTT_WORKERS > 0
+      if (rx_work_queue(client, topic, plen, payload))
+         return;
+#endif
+      mqtt_rx_topic(client, topic, plen, payload);
    } else if (payload)
    {
-      ESP_LOGI(TAG, "MQTT%d connected %s", client, (char *) payload);
+      uint8_t resumed = 0;
+      uint32_t handshake = lwmqtt_handshake(mqtt_client[client], &resumed);
+      if (handshake)
+         ESP_LOGI(TAG, "MQTT%d connected %s (TLS %ums%s)", client, (char *) payload, handshake, resumed ? " resumed" : "");
+      else
+         ESP_LOGI(TAG, "MQTT%d connected %s", client, (char *) payload);
       xEventGroupSetBits(revk_group, (GROUP_MQTT << client));
       xEventGroupClearBits(revk_group, (GROUP_MQTT_DOWN << client));
-      revk_send_sub(client, revk_mac);  // Self
+      revk_send_sub_all(client);
       up_next = 0;
+      queue_hold = uptime() + 2;        // Off line queue sent after connect messages
       if (app_callback)
       {
          jo_t j = jo_create_alloc();
@@ -992,6 +1525,17 @@ void revk_mqtt_init(void)
       return;                   // Already set up
    if (!*mqtthost[0])           /* No MQTT */
       return;
+   for (int client = 0; client < MQTT_CLIENTS; client++)
+      if (*mqtthost[client])
+         mqtt_clients = client + 1;
+   if (!mqtt_tx && (mqtt_tx = calloc(MQTT_CLIENTS, sizeof(*mqtt_tx))))
+   {
+#if	CONFIG_REVK_MQTT_TXQ > 0
+      for (int client = 0; client < MQTT_CLIENTS; client++)
+         if (*mqtthost[client] && (mqtt_tx[client].queue = xQueueCreate(CONFIG_REVK_MQTT_TXQ, sizeof(revk_tx_msg_t))))
+            revk_task("MQTTtx", mqtt_tx_task, (void *) client);
+#endif
+   }
    for (int client = 0; client < MQTT_CLIENTS; client++)
    {
       xEventGroupSetBits(revk_group, (GROUP_MQTT_DOWN << client));
@@ -1243,7 +1787,7 @@ static void task(void *pvParameters)
          tick += 100000ULL;     /* 10th second */
          if (!wdt_test && watchdogtime)
             esp_task_wdt_reset();
-         if (blink[0])
+         if (blink[0].set)
          {                      // LED blinking
             static uint8_t lit = 0,
                 count = 0;
@@ -1266,7 +1810,7 @@ static void task(void *pvParameters)
                }
                if (count)
                {
-                  if (blink[1] && blink_colours)
+                  if (blink[1].set && blink_colours)
                   {             // Coloured LED
                      static const char *c = "";
                      if (!*c)
@@ -1276,19 +1820,37 @@ static void task(void *pvParameters)
                         col = *c++;     // Sequences the colours set for the on state
                      if (restart_time)
                         col = 'W';      // Rebooting
-                     gpio_set_level(blink[0] & 0x3F, (col == 'R' || col == 'Y' || col == 'M' || col == 'W') ^ ((blink[0] & 0x40) ? 1 : 0));     // Red LED
-                     gpio_set_level(blink[1] & 0x3F, (col == 'G' || col == 'Y' || col == 'C' || col == 'W') ^ ((blink[1] & 0x40) ? 1 : 0));     // Green LED
-                     gpio_set_level(blink[2] & 0x3F, (col == 'B' || col == 'C' || col == 'M' || col == 'W') ^ ((blink[2] & 0x40) ? 1 : 0));     // Blue LED
+                     gpio_set_level(blink[0].num, (col == 'R' || col == 'Y' || col == 'M' || col == 'W') ^ blink[0].invert);     // Red LED
+                     gpio_set_level(blink[1].num, (col == 'G' || col == 'Y' || col == 'C' || col == 'W') ^ blink[1].invert);     // Green LED
+                     gpio_set_level(blink[2].num, (col == 'B' || col == 'C' || col == 'M' || col == 'W') ^ blink[2].invert);     // Blue LED
                   } else
-                     gpio_set_level(blink[0] & 0x3F, lit ^ ((blink[0] & 0x40) ? 1 : 0));        // Single LED
+                     gpio_set_level(blink[0].num, lit ^ blink[0].invert);        // Single LED
                }
             }
          }
-         if (setting_dump_requested)
-         {                      // Done here so not reporting from MQTT
-            setting_dump_requested = 0;
-            revk_setting_dump();
+         {                      // Settings dump, done here so not reporting from MQTT, a slice at a time
+            xSemaphoreTake(setting_old_mutex, portMAX_DELAY);
+            uint32_t req = setting_dump_requested;
+            const char *after = setting_dump_after;
+            uint32_t since = setting_dump_since;
+            xSemaphoreGive(setting_old_mutex);
+            if (req)
+            {
+               after = revk_setting_dump(after, since, SETTING_DUMP_PACKETS);
+               xSemaphoreTake(setting_old_mutex, portMAX_DELAY);
+               if (setting_dump_requested == req)
+               {                // Not asked again while sending
+                  if (!(setting_dump_after = after))
+                     setting_dump_requested = 0;
+               }
+               xSemaphoreGive(setting_old_mutex);
+            }
          }
+         setting_reclaim();
+#ifdef	CONFIG_REVK_MQTT
+         revk_error_flush();
+         revk_queue_drain();
+#endif
       }
       static uint32_t last = 0;
       uint32_t now = uptime();
@@ -1362,10 +1924,88 @@ static void task(void *pvParameters)
                      jo_stringf(j, "build", "%sT%s", date, app->time);
                      jo_int(j, "flash", spi_flash_get_chip_size());
                      jo_int(j, "rst", esp_reset_reason());
+                     jo_int(j, "boot", boot_ms);
                   }
                }
                if (!up_next || heap / 10000 < lastheap / 10000)
                   jo_int(j, "mem", esp_get_free_heap_size());
+               if (queue_count)
+                  jo_int(j, "queued", queue_count);
+               if (queue_deferred)
+                  jo_int(j, "deferred", queue_deferred);
+               jo_object(j, "settings");
+               jo_stringf(j, "boot", "%08X", (unsigned int) setting_boot);
+               jo_int(j, "gen", setting_gen);
+               jo_stringf(j, "etag", "%08X", (unsigned int) setting_etag());
+               jo_close(j);
+               if (now > up_next)
+               {                // MQTT link health, on connect and hourly
+                  jo_array(j, "mqtt");
+                  for (int client = 0; client < MQTT_CLIENTS; client++)
+                  {
+                     lwmqtt_stats_t s;
+                     if (lwmqtt_stats(mqtt_client[client], &s))
+                     {
+                        jo_null(j, NULL);
+                        continue;
+                     }
+                     jo_object(j, NULL);
+                     if (s.host)
+                        jo_string(j, "host", s.host);
+                     jo_int(j, "rtt", s.rtt);
+                     jo_array(j, "rtthist");
+                     for (int b = 0; b < LWMQTT_RTT_BUCKETS; b++)
+                        jo_int(j, NULL, s.rtt_hist[b]);
+                     jo_close(j);
+                     jo_int(j, "tx", s.tx_msgs);
+                     jo_int(j, "rx", s.rx_msgs);
+                     jo_int(j, "txbytes", s.tx_bytes);
+                     jo_int(j, "rxbytes", s.rx_bytes);
+                     jo_int(j, "blocked", s.blocked);
+                     jo_int(j, "connects", s.connects);
+                     if (s.fails)
+                        jo_int(j, "fails", s.fails);
+                     if (s.handshake)
+                        jo_int(j, "tls", s.handshake);
+                     if (s.reason)
+                        jo_string(j, "reason", s.reason);
+                     if (mqtt_tx && client < mqtt_clients)
+                     {
+                        if (mqtt_tx[client].queue)
+                           jo_int(j, "txq", uxQueueMessagesWaiting(mqtt_tx[client].queue));
+                        if (mqtt_tx[client].failed)
+                        {
+                           jo_int(j, "txfail", mqtt_tx[client].failed);
+                           jo_string(j, "txerr", mqtt_tx[client].err);
+                        }
+                     }
+                     jo_close(j);
+                  }
+                  jo_close(j);
+#if	CONFIG_REVK_MQTT_WORKERS > 0
+                  if (rx_mutex)
+                  {             // Receive workers
+                     xSemaphoreTake(rx_mutex, portMAX_DELAY);
+                     if (rx_stats.count)
+                     {
+                        jo_object(j, "rx");
+                        jo_int(j, "count", rx_stats.count);
+                        jo_int(j, "wait", rx_stats.wait / rx_stats.count);
+                        jo_int(j, "waitmax", rx_stats.waitmax);
+                        jo_int(j, "run", rx_stats.run / rx_stats.count);
+                        jo_int(j, "runmax", rx_stats.runmax);
+                        if (rx_stats.full)
+                           jo_int(j, "full", rx_stats.full);
+                        if (rx_stats.dropped)
+                           jo_int(j, "dropped", rx_stats.dropped);
+                        jo_close(j);
+                        rx_stats.waitmax = 0;
+                        rx_stats.runmax = 0;
+                     }
+                     xSemaphoreGive(rx_mutex);
+                  }
+#endif
+               }
                if (!up_next || lastch != ap.primary || memcmp(lastbssid, ap.bssid, 6))
                {                // Wifi
                   jo_string(j, "ssid", (char *) ap.ssid);
@@ -1399,7 +2039,7 @@ static void task(void *pvParameters)
             revk_restart("Offline too long", 0);
 #endif
 #ifdef	CONFIG_REVK_APCONFIG
-         if (!ap_task_id && ((apgpio && (gpio_get_level(apgpio & 0x3F) ^ (apgpio & 0x40 ? 1 : 0)))
+         if (!ap_task_id && ((apgpio.set && (gpio_get_level(apgpio.num) ^ apgpio.invert))
 #if     defined(CONFIG_REVK_WIFI) || defined(CONFIG_REVK_MQTT)
                              || (apwait && revk_link_down() > apwait)
 #endif
@@ -1442,12 +2082,37 @@ static void task(void *pvParameters)
 /* External functions */
 void revk_boot(app_callback_t * app_callback_cb)
 {                               /* Start the revk task, use __FILE__ and __DATE__ and __TIME__ to set task name and version ID */
+   boot_start = esp_timer_get_time();
+   snap_boot = 1;
+   setting_boot = esp_random();
    ESP_LOGI(TAG, "sem");
 #ifdef	CONFIG_REVK_MESH
    esp_wifi_disconnect();       // Just in case
    mesh_mutex = xSemaphoreCreateBinary();
    xSemaphoreGive(mesh_mutex);
    mesh_ota_sem = xSemaphoreCreateBinary();     // Leave in taken, only given on ack received
+#endif
+   setting_old_mutex = xSemaphoreCreateBinary();
+   xSemaphoreGive(setting_old_mutex);
+#ifdef	CONFIG_REVK_MQTT
+   queue_mutex = xSemaphoreCreateBinary();
+   xSemaphoreGive(queue_mutex);
+   topic_mutex = xSemaphoreCreateBinary();
+   xSemaphoreGive(topic_mutex);
+   error_mutex = xSemaphoreCreateBinary();
+   xSemaphoreGive(error_mutex);
+#if	CONFIG_REVK_MQTT_WORKERS > 0
+   for (int n = 0; n < CONFIG_REVK_MQTT_WORKERS; n++)
+   {
+      rx_queue[n] = xQueueCreate(CONFIG_REVK_MQTT_WORKQ, sizeof(rx_work_t));
+      revk_task("RX", rx_worker, rx_queue[n]);
+   }
+   rx_mutex = xSemaphoreCreateBinary();
+   xSemaphoreGive(rx_mutex);
+#endif
+#ifdef	CONFIG_REVK_MQTT_QUEUE_FLASH
+   queue_flash_init();
+#endif
 #endif
    /* Watchdog */
 #ifdef	CONFIG_REVK_PARTITION_CHECK
@@ -1496,52 +2161,55 @@ void revk_boot(app_callback_t * app_callback_cb)
    const esp_app_desc_t *app = esp_ota_get_app_description();
    if (nvs_open_from_partition(TAG, TAG, NVS_READWRITE, &nvs))
       REVK_ERR_CHECK(nvs_open(TAG, NVS_READWRITE, &nvs));
-   revk_register("client", 0, 0, &clientkey, NULL, SETTING_SECRET);     // Parent
-   revk_register("prefix", 0, 0, &prefixcommand, "command", SETTING_SECRET);    // Parent
    /* Fallback if no dedicated partition */
 #define str(x) #x
-#define s(n,d)		revk_register(#n,0,0,&n,d,0)
-#define sp(n,d)		revk_register(#n,0,0,&n,d,SETTING_SECRET)
-#define sa(n,a,d)	revk_register(#n,a,0,&n,d,0)
-#define sap(n,a,d)	revk_register(#n,a,0,&n,d,SETTING_SECRET)
-#define fh(n,a,s,d)	revk_register(#n,a,s,&n,d,SETTING_BINDATA|SETTING_HEX)
-#define	u32(n,d)	revk_register(#n,0,4,&n,str(d),0)
-#define	u16(n,d)	revk_register(#n,0,2,&n,str(d),0)
-#define	u16a(n,a,d)	revk_register(#n,a,2,&n,str(d),0)
-#define	i16(n)		revk_register(#n,0,2,&n,0,SETTING_SIGNED)
-#define	u8a(n,a,d)	revk_register(#n,a,1,&n,str(d),0)
-#define	u8(n,d)		revk_register(#n,0,1,&n,str(d),0)
-#define	b(n,d)		revk_register(#n,0,1,&n,str(d),SETTING_BOOLEAN)
-#define	s8(n,d)		revk_register(#n,0,1,&n,str(d),SETTING_SIGNED)
-#define io(n)		revk_register(#n,0,sizeof(n),&n,"-",SETTING_SET|SETTING_BITFIELD)
-#define ioa(n,a)	revk_register(#n,a,sizeof(*n),&n,"-",SETTING_SET|SETTING_BITFIELD)
-#define p(n)		revk_register("prefix"#n,0,0,&prefix##n,#n,0)
-#define h(n,l,d)	revk_register(#n,0,l,&n,d,SETTING_BINDATA|SETTING_HEX)
-#define hs(n,l,d)	revk_register(#n,0,l,&n,d,SETTING_BINDATA|SETTING_HEX|SETTING_SECRET)
-#define bd(n,d)		revk_register(#n,0,0,&n,d,SETTING_BINDATA)
-#define bad(n,a,d)	revk_register(#n,a,0,&n,d,SETTING_BINDATA)
-#define bdp(n,d)	revk_register(#n,0,0,&n,d,SETTING_BINDATA|SETTING_SECRET)
-   settings;
+#define s(n,d)		REVK_SETTING(#n,0,0,&n,d,0),
+#define sp(n,d)		REVK_SETTING(#n,0,0,&n,d,SETTING_SECRET),
+#define sa(n,a,d)	REVK_SETTING(#n,a,0,&n,d,0),
+#define sap(n,a,d)	REVK_SETTING(#n,a,0,&n,d,SETTING_SECRET),
+#define fh(n,a,s,d)	REVK_SETTING(#n,a,s,&n,d,SETTING_BINDATA|SETTING_HEX),
+#define	u32(n,d)	REVK_SETTING(#n,0,4,&n,str(d),0),
+#define	u16(n,d)	REVK_SETTING(#n,0,2,&n,str(d),0),
+#define	u16a(n,a,d)	REVK_SETTING(#n,a,2,&n,str(d),0),
+#define	i16(n)		REVK_SETTING(#n,0,2,&n,0,SETTING_SIGNED),
+#define	u8a(n,a,d)	REVK_SETTING(#n,a,1,&n,str(d),0),
+#define	u8(n,d)		REVK_SETTING(#n,0,1,&n,str(d),0),
+#define	b(n,d)		REVK_SETTING(#n,0,1,&n,str(d),SETTING_BOOLEAN),
+#define	s8(n,d)		REVK_SETTING(#n,0,1,&n,str(d),SETTING_SIGNED),
+#define io(n)		REVK_SETTING(#n,0,sizeof(n),&n,"-",SETTING_SET|SETTING_BITFIELD),
+#define ioa(n,a)	REVK_SETTING(#n,a,sizeof(*n),&n,"-",SETTING_SET|SETTING_BITFIELD),
+#define p(n)		REVK_SETTING("prefix"#n,0,0,&prefix##n,#n,0),
+#define h(n,l,d)	REVK_SETTING(#n,0,l,&n,d,SETTING_BINDATA|SETTING_HEX),
+#define hs(n,l,d)	REVK_SETTING(#n,0,l,&n,d,SETTING_BINDATA|SETTING_HEX|SETTING_SECRET),
+#define bd(n,d)		REVK_SETTING(#n,0,0,&n,d,SETTING_BINDATA),
+#define bad(n,a,d)	REVK_SETTING(#n,a,0,&n,d,SETTING_BINDATA),
+#define bdp(n,d)	REVK_SETTING(#n,0,0,&n,d,SETTING_BINDATA|SETTING_SECRET),
+   static const revk_setting_def_t revk_settings[] = {  // In flash, parents before children
+      REVK_SETTING("client", 0, 0, &clientkey, NULL, SETTING_SECRET),   // Parent
+      REVK_SETTING("prefix", 0, 0, &prefixcommand, "command", SETTING_SECRET),  // Parent
+      settings
 #if	defined(CONFIG_REVK_WIFI) || defined(CONFIG_REVK_MESH)
-   revk_register("wifi", 0, 0, &wifissid, CONFIG_REVK_WIFISSID, SETTING_SECRET);        // Parent
-   wifisettings;
+         REVK_SETTING("wifi", 0, 0, &wifissid, CONFIG_REVK_WIFISSID, SETTING_SECRET),   // Parent
+      wifisettings
 #ifdef	CONFIG_REVK_MESH
-   revk_register("mesh", 0, 6, &meshid, CONFIG_REVK_MESHID, SETTING_BINDATA | SETTING_HEX | SETTING_SECRET);    // Parent
-   meshsettings;
+         REVK_SETTING("mesh", 0, 6, &meshid, CONFIG_REVK_MESHID, SETTING_BINDATA | SETTING_HEX | SETTING_SECRET),       // Parent
+      meshsettings
 #else
 #ifdef	CONFIG_REVK_WIFI
-   revk_register("ap", 0, 0, &apssid, CONFIG_REVK_APSSID, SETTING_SECRET);      // Parent
-   apsettings;
+         REVK_SETTING("ap", 0, 0, &apssid, CONFIG_REVK_APSSID, SETTING_SECRET), // Parent
+      apsettings
 #endif
 #endif
 #endif
 #ifdef	CONFIG_REVK_MQTT
-   revk_register("mqtt", MQTT_CLIENTS, 0, &mqtthost, CONFIG_REVK_MQTTHOST, SETTING_SECRET);     // Parent
-   mqttsettings;
+         REVK_SETTING("mqtt", MQTT_CLIENTS, 0, &mqtthost, CONFIG_REVK_MQTTHOST, SETTING_SECRET),        // Parent
+      mqttsettings
 #endif
 #ifdef	CONFIG_REVK_APCONFIG
-   apconfigsettings;
+         apconfigsettings
 #endif
+   };
+   revk_register_table(revk_settings, sizeof(revk_settings) / sizeof(*revk_settings));
 #undef s
 #undef sa
 #undef fh
@@ -1569,17 +2237,17 @@ void revk_boot(app_callback_t * app_callback_cb)
       appname = strdup(app->project_name);
    /* Default is from build */
    for (int b = 0; b < sizeof(blink) / sizeof(*blink); b++)
-      if (blink[b])
+      if (blink[b].set)
       {
-         gpio_reset_pin(blink[b] & 0x3F);
-         gpio_set_level(blink[b] & 0x3F, (blink[b] & 0x40) ? 0 : 1);    /* on */
-         gpio_set_direction(blink[b] & 0x3F, GPIO_MODE_OUTPUT); /* Blinking LED */
+         gpio_reset_pin(blink[b].num);
+         gpio_set_level(blink[b].num, !blink[b].invert);       /* on */
+         gpio_set_direction(blink[b].num, GPIO_MODE_OUTPUT);   /* Blinking LED */
       }
 #ifdef	CONFIG_REVK_APCONFIG
-   if (apgpio)
+   if (apgpio.set)
    {
-      gpio_reset_pin(apgpio & 0x3F);
-      gpio_set_direction(apgpio & 0x3F, GPIO_MODE_INPUT);       /* AP mode button */
+      gpio_reset_pin(apgpio.num);
+      gpio_set_direction(apgpio.num, GPIO_MODE_INPUT);       /* AP mode button */
    }
 #endif
    restart_time = 0;
@@ -1598,6 +2266,12 @@ void revk_boot(app_callback_t * app_callback_cb)
    tzset();
    sntp_setservername(0, ntphost);
    app_callback = app_callback_cb;
+   revk_register_commands();
+#ifdef	CONFIG_REVK_MQTT
+   revk_route(&prefixcommand, NULL, "upgrade", REVK_ROUTE_MAIN, route_upgrade);
+   revk_route(&prefixcommand, NULL, NULL, REVK_ROUTE_MAIN | REVK_ROUTE_US, route_command);
+   revk_route(&prefixsetting, NULL, NULL, REVK_ROUTE_MAIN | REVK_ROUTE_US, route_setting);
+#endif
    {                            /* Chip ID from MAC */
       REVK_ERR_CHECK(esp_efuse_mac_get_default(revk_mac));
 #ifdef	CONFIG_REVK_SHORT_ID
@@ -1614,6 +2288,16 @@ void revk_boot(app_callback_t * app_callback_cb)
 
 void revk_start(void)
 {                               // Start stuff, init all doned
+   boot_ms = (esp_timer_get_time() - boot_start) / 1000;
+   uint8_t loaded = 0;
+   for (int i = 0; i < SNAPS; i++)
+      if (snap[i].loaded)
+         loaded++;
+   ESP_LOGI(TAG, "Boot %ums, %d settings snapshots used", boot_ms, loaded);
+   snap_done();
+#ifdef	CONFIG_REVK_MQTT
+   route_compile();
+#endif
 #ifdef	CONFIG_REVK_WIFI
    wifi_init();
 #endif
@@ -1693,26 +2377,557 @@ void revk_mesh_send_json(const mac_t mac, jo_t * jp)
 #endif
 
 #ifdef	CONFIG_REVK_MQTT
-const char *revk_mqtt_out(uint8_t clients, int tlen, const char *topic, int plen, const unsigned char *payload, char retain)
-{
-   if (!clients || link_down)
-      return NULL;
-#ifdef	CONFIG_REVK_MESH
-   if (esp_mesh_is_device_active() && !esp_mesh_is_root())
-   {                            // Send via mesh
-      mesh_data_t data = {.proto = MESH_PROTO_MQTT };
-      mesh_make_mqtt(&data, clients | (retain << 7), tlen, topic, plen, payload);       // Ensures MESH_PAD space one end
-      mesh_encode_send(NULL, &data, 0); // **** THIS EXPECTS MESH_PAD AVAILABLE EXTRA BYTES ON SIZE ****
-      free(data.data);
-      return NULL;
-   }
-#endif
-   const char *er = NULL;
-   for (int client = 0; client < MQTT_CLIENTS && !er; client++)
-      if (clients & (1 << client))
-         er = lwmqtt_send_full(mqtt_client[client], tlen, topic, plen, payload, retain);
+typedef struct
+{                               // QoS 1 message held until PUBACK
+   lwmqtt_msg_t *m;
+   uint8_t client;
+} mqtt_ack_t;
+
+static void mqtt_acked(void *arg, const char *err)
+{                               // PUBACK, or dropped unacknowledged so back to the out queue
+   mqtt_ack_t *a = arg;
+   if (err)
+      revk_queue_hold(1 << a->client, a->m, 1);
+   lwmqtt_msg_release(&a->m);
+   free(a);
+}
+
+static const char *mqtt_send_one(int client, lwmqtt_msg_t * m, char retain)
+{                               // Retained (state) is sent QoS 1 so not lost in a stall or reconnect, falling back to QoS 0 if window full
+   const char *er = "";
+   if (retain)
+   {
+      mqtt_ack_t *a = malloc(sizeof(*a));
+      if (a)
+      {
+         a->m = lwmqtt_msg_hold(m);
+         a->client = client;
+         if ((er = lwmqtt_send_msg_qos1(mqtt_client[client], m, retain, mqtt_acked, a)))
+         {
+            lwmqtt_msg_release(&a->m);
+            free(a);
+         }
+      }
+   }
+   if (er)
+      er = lwmqtt_send_msg(mqtt_client[client], m, retain, 0);
+   if (mqtt_tx)
+   {
+      if (er)
+      {
+         mqtt_tx[client].failed++;
+         mqtt_tx[client].err = er;
+      } else
+         mqtt_tx[client].sent++;
+   }
    return er;
 }
+
+#if	CONFIG_REVK_MQTT_TXQ > 0
+static void mqtt_tx_task(void *arg)
+{                               // Sends for one client, so a slow or dead server does not hold up the others
+   int client = (int) arg;
+   revk_tx_msg_t t;
+   while (1)
+      if (xQueueReceive(mqtt_tx[client].queue, &t, portMAX_DELAY) == pdTRUE)
+      {
+         if (mqtt_send_one(client, t.m, t.retain))
+            revk_queue_hold(1 << client, t.m, t.retain);        // Caller has moved on, so the out queue has it
+         lwmqtt_msg_release(&t.m);
+      }
+}
+#endif
+
+static uint8_t mqtt_out(uint8_t clients, int tlen, const char *topic, int plen, const unsigned char *payload, char retain)
+{                               // Send to each client independently, returns clients that failed
+   if (!clients || link_down)
+      return 0;
+#ifdef	CONFIG_REVK_MESH
+   if (esp_mesh_is_device_active() && !esp_mesh_is_root())
+   {                            // Send via mesh
+      mesh_data_t data = {.proto = MESH_PROTO_MQTT };
+      mesh_make_mqtt(&data, clients | (retain << 7), tlen, topic, plen, payload);       // Ensures MESH_PAD space one end
+      mesh_encode_send(NULL, &data, 0); // **** THIS EXPECTS MESH_PAD AVAILABLE EXTRA BYTES ON SIZE ****
+      free(data.data);
+      return 0;
+   }
+#endif
+   lwmqtt_msg_t *m = lwmqtt_msg(tlen, topic, plen, payload, retain);    // Encoded once for all clients
+   if (!m)
+      return clients;
+   uint8_t failed = 0;
+   for (int client = 0; client < mqtt_clients; client++)
+      if (clients & (1 << client))
+      {
+         if (mqtt_tx && mqtt_tx[client].queue)
+         {                      // Client's own sender
+            revk_tx_msg_t t = {.m = lwmqtt_msg_hold(m),.retain = retain };
+            if (xQueueSend(mqtt_tx[client].queue, &t, 0) != pdTRUE)
+            {
+               lwmqtt_msg_release(&t.m);
+               mqtt_tx[client].failed++;
+               mqtt_tx[client].err = "Send queue full";
+               failed |= (1 << client);
+            }
+         } else if (mqtt_send_one(client, m, retain))
+            failed |= (1 << client);
+      }
+   lwmqtt_msg_release(&m);
+   return failed;
+}
+
+const char *revk_mqtt_out(uint8_t clients, int tlen, const char *topic, int plen, const unsigned char *payload, char retain)
+{                               // Error if any client failed
+   uint8_t failed = mqtt_out(clients, tlen, topic, plen, payload, retain);
+   if (!failed)
+      return NULL;
+   for (int client = 0; client < mqtt_clients; client++)
+      if ((failed & (1 << client)) && mqtt_tx && mqtt_tx[client].err)
+         return mqtt_tx[client].err;
+   return "Send failed";
+}
+#endif
+
+#ifdef	CONFIG_REVK_MQTT
+#ifdef	CONFIG_REVK_MQTT_QUEUE_FLASH
+// Flash log, records do not span sectors, sector erased when first written, so oldest lost when full
+#define	QUEUE_MAGIC	0x5172
+typedef struct
+{
+   uint16_t magic;
+   uint16_t len;                // Record length, multiple of 4
+   uint8_t done;                // 0xFF until sent, then written as 0
+   uint8_t clients;
+   uint16_t tlen;
+   uint32_t seq;
+   uint16_t plen;
+   uint16_t spare;
+} queue_rec_t;
+static const esp_partition_t *queue_part = NULL;
+static uint32_t queue_rd = 0;   // Next record to send
+static uint32_t queue_wr = 0;   // Where next record is written
+static uint32_t queue_seq = 0;  // Next sequence number
+
+static int queue_rec(uint32_t o, queue_rec_t * r)
+{                               // Read record header at o, 0 if valid
+   uint32_t end = (o / SPI_FLASH_SEC_SIZE + 1) * SPI_FLASH_SEC_SIZE;
+   if (o + sizeof(*r) > end || esp_partition_read(queue_part, o, r, sizeof(*r)) || r->magic != QUEUE_MAGIC || r->len < sizeof(*r) || o + r->len > end)
+      return -1;
+   return 0;
+}
+
+static void queue_flash_init(void)
+{                               // Find the log, and where we are in it
+   queue_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "mqttq");
+   if (!queue_part)
+      return;
+   if (queue_part->size < 2 * SPI_FLASH_SEC_SIZE)
+   {
+      ESP_LOGE(TAG, "mqttq partition too small");
+      queue_part = NULL;
+      return;
+   }
+   uint8_t found = 0;
+   uint32_t first = 0,
+       last = 0;
+   for (uint32_t s = 0; s + SPI_FLASH_SEC_SIZE <= queue_part->size; s += SPI_FLASH_SEC_SIZE)
+   {
+      queue_rec_t r;
+      for (uint32_t o = s; !queue_rec(o, &r); o += r.len)
+      {
+         if (!(found & 1) || (int32_t) (r.seq - last) > 0)
+         {
+            last = r.seq;
+            queue_wr = o + r.len;
+         }
+         if (r.done == 0xFF && (!(found & 2) || (int32_t) (r.seq - first) < 0))
+         {
+            first = r.seq;
+            queue_rd = o;
+            found |= 2;
+         }
+         found |= 1;
+      }
+   }
+   if (queue_wr >= queue_part->size)
+      queue_wr = 0;
+   if (queue_wr % SPI_FLASH_SEC_SIZE)
+   {                            // Check not a part written record after last one
+      uint32_t blank[sizeof(queue_rec_t) / 4];
+      if (esp_partition_read(queue_part, queue_wr, blank, sizeof(blank)) || blank[0] != 0xFFFFFFFF || blank[1] != 0xFFFFFFFF || blank[2] != 0xFFFFFFFF || blank[3] != 0xFFFFFFFF)
+         queue_wr = (queue_wr / SPI_FLASH_SEC_SIZE + 1) * SPI_FLASH_SEC_SIZE % queue_part->size;
+   }
+   if (!(found & 2))
+      queue_rd = queue_wr;      // Nothing to send
+   queue_seq = last + 1;
+   if (queue_rd != queue_wr)
+      ESP_LOGI(TAG, "MQTT queue in flash to send");
+}
+
+static int queue_flash_put(revk_queue_t * q)
+{                               // Write to flash log (queue_mutex held), 0 if OK
+   if (!queue_part || q->retain)
+      return -1;                // Old state is not useful after a restart
+ queue_rec_t r = {.magic = QUEUE_MAGIC,.done = 0xFF,.clients = q->clients,.tlen = q->tlen,.plen = q->plen,.spare = 0xFFFF };
+   r.len = (sizeof(r) + q->tlen + q->plen + 3) & ~3;
+   if (r.len > SPI_FLASH_SEC_SIZE)
+      return -1;
+   if (queue_wr / SPI_FLASH_SEC_SIZE != (queue_wr + r.len - 1) / SPI_FLASH_SEC_SIZE)
+      queue_wr = (queue_wr / SPI_FLASH_SEC_SIZE + 1) * SPI_FLASH_SEC_SIZE % queue_part->size;   // Next sector
+   if (!(queue_wr % SPI_FLASH_SEC_SIZE))
+   {                            // New sector, erase, losing anything not sent
+      queue_rec_t old;
+      for (uint32_t o = queue_wr; !queue_rec(o, &old); o += old.len)
+         if (old.done == 0xFF)
+            queue_dropped++;
+      if (queue_rd != queue_wr && queue_rd / SPI_FLASH_SEC_SIZE == queue_wr / SPI_FLASH_SEC_SIZE)
+         queue_rd = (queue_wr + SPI_FLASH_SEC_SIZE) % queue_part->size; // Oldest is now next sector
+      if (esp_partition_erase_range(queue_part, queue_wr, SPI_FLASH_SEC_SIZE))
+         return -1;
+   }
+   r.seq = queue_seq++;
+   // Data then header, so a header means a complete record
+   if (esp_partition_write(queue_part, queue_wr + sizeof(r), q->data, q->tlen + q->plen) || esp_partition_write(queue_part, queue_wr, &r, sizeof(r)))
+      return -1;
+   queue_wr += r.len;
+   if (queue_wr >= queue_part->size)
+      queue_wr = 0;
+   return 0;
+}
+
+static revk_queue_t *queue_flash_get(uint32_t * posp)
+{                               // Next unsent record from flash log (queue_mutex held), malloc'd, NULL if none
+   while (queue_part && queue_rd != queue_wr)
+   {
+      queue_rec_t r;
+      if (queue_rec(queue_rd, &r))
+      {                         // End of sector
+         uint32_t end = (queue_rd / SPI_FLASH_SEC_SIZE + 1) * SPI_FLASH_SEC_SIZE;
+         if (queue_wr > queue_rd && queue_wr < end)
+            queue_rd = queue_wr;
+         else
+            queue_rd = end % queue_part->size;
+         continue;
+      }
+      if (r.done == 0xFF)
+      {
+         revk_queue_t *q = malloc(sizeof(*q) + r.tlen + r.plen);
+         if (!q)
+            return NULL;
+         memset(q, 0, sizeof(*q));
+         q->clients = r.clients;
+         q->tlen = r.tlen;
+         q->plen = r.plen;
+         if (esp_partition_read(queue_part, queue_rd + sizeof(r), q->data, r.tlen + r.plen))
+         {
+            free(q);
+            return NULL;
+         }
+         *posp = queue_rd;
+         return q;
+      }
+      queue_rd += r.len;
+      if (queue_rd >= queue_part->size)
+         queue_rd = 0;
+   }
+   return NULL;
+}
+
+static void queue_flash_done(uint32_t pos)
+{                               // Mark sent (queue_mutex held)
+   queue_rec_t r;
+   if (queue_rd != pos || queue_rec(pos, &r))
+      return;                   // Sector erased since
+   uint8_t done = 0;
+   esp_partition_write(queue_part, pos + offsetof(queue_rec_t, done), &done, 1);
+   queue_rd += r.len;
+   if (queue_rd >= queue_part->size)
+      queue_rd = 0;
+}
+#endif
+
+static uint8_t revk_mqtt_up(void)
+{                               // Clients we can send to now
+   if (link_down)
+      return 0;
+#ifdef	CONFIG_REVK_MESH
+   if (esp_mesh_is_device_active() && !esp_mesh_is_root())
+      return (1 << MQTT_CLIENTS) - 1;   // Root sends for us
+#endif
+   uint8_t up = 0;
+   EventBits_t bits = xEventGroupGetBits(revk_group);
+   for (int client = 0; client < MQTT_CLIENTS; client++)
+      if (bits & (GROUP_MQTT << client))
+         up |= (1 << client);
+   return up;
+}
+
+static uint8_t revk_tokens(void)
+{                               // Refill token buckets, return clients with a token to spend (queue_mutex held)
+#if	CONFIG_REVK_MQTT_RATE > 0
+   int64_t now = esp_timer_get_time();
+   int64_t add = (now - queue_token_time) * CONFIG_REVK_MQTT_RATE / 1000;       // 1/1000 message
+   queue_token_time = now;
+   uint8_t ok = 0;
+   for (int client = 0; client < MQTT_CLIENTS; client++)
+   {
+      int64_t t = queue_tokens[client] + add;
+      if (t > CONFIG_REVK_MQTT_BURST * 1000)
+         t = CONFIG_REVK_MQTT_BURST * 1000;
+      queue_tokens[client] = t;
+      if (t >= 1000)
+         ok |= (1 << client);
+   }
+   return ok;
+#else
+   return (1 << MQTT_CLIENTS) - 1;      // No limit
+#endif
+}
+
+static void revk_tokens_take(uint8_t clients)
+{                               // Spend a token (queue_mutex held)
+#if	CONFIG_REVK_MQTT_RATE > 0
+   for (int client = 0; client < MQTT_CLIENTS; client++)
+      if (clients & (1 << client))
+         queue_tokens[client] -= 1000;
+#endif
+}
+
+static uint8_t queue_put(uint8_t later, int tlen, const char *topic, int plen, const unsigned char *payload, char retain, uint8_t pri)
+{                               // Add to queue (queue_mutex held), returns clients it was dropped for
+   revk_queue_t **qp = &queue;
+   while (*qp)
+   {
+      revk_queue_t *q = *qp;
+      if (retain && q->retain && q->tlen == tlen && !memcmp(q->data, topic, tlen) && !(q->clients &= ~later))
+      {                         // Coalesce state, only latest matters
+         *qp = q->next;
+         queue_bytes -= sizeof(*q) + q->tlen + q->plen;
+         queue_count--;
+         free(q);
+         continue;
+      }
+      qp = &q->next;
+   }
+   uint32_t need = sizeof(revk_queue_t) + tlen + plen;
+   while (queue_bytes + need > CONFIG_REVK_MQTT_QUEUE)
+   {                            // Make space, losing oldest of lowest class
+      revk_queue_t **vp = NULL;
+      for (qp = &queue; *qp; qp = &(*qp)->next)
+         if (!vp || (*qp)->pri > (*vp)->pri)
+            vp = qp;
+      if (!vp || (*vp)->pri < pri)
+         break;                 // Nothing of same or lower class to lose
+      revk_queue_t *q = *vp;
+      *vp = q->next;
+      queue_bytes -= sizeof(*q) + q->tlen + q->plen;
+      queue_count--;
+#ifdef	CONFIG_REVK_MQTT_QUEUE_FLASH
+      if (q->pri > QUEUE_EVENT || queue_flash_put(q))
+#endif
+         queue_dropped++;
+      free(q);
+   }
+   revk_queue_t *q = malloc(need);
+   if (q)
+   {
+      memset(q, 0, sizeof(*q));
+      q->clients = later;
+      q->retain = retain;
+      q->pri = pri;
+      q->tlen = tlen;
+      q->plen = plen;
+      memcpy(q->data, topic, tlen);
+      memcpy(q->data + tlen, payload, plen);
+      if (queue_bytes + need <= CONFIG_REVK_MQTT_QUEUE)
+      {
+         for (qp = &queue; *qp; qp = &(*qp)->next);
+         *qp = q;
+         queue_bytes += need;
+         queue_count++;
+         q = NULL;
+      }
+#ifdef	CONFIG_REVK_MQTT_QUEUE_FLASH
+      else if (pri <= QUEUE_EVENT && !queue_flash_put(q))
+      {
+         free(q);
+         q = NULL;
+      }
+#endif
+   }
+   if (q)
+   {
+      queue_dropped++;
+      free(q);
+      return later;
+   }
+   return 0;
+}
+
+static uint8_t revk_queue_out(uint8_t clients, const char *topic, const char *payload, char retain, uint8_t pri)
+{                               // Send, or queue if rate limited, behind higher priority, or for clients not connected, returns clients it failed for
+   if (!queue_mutex)
+      return mqtt_out(clients, strlen(topic), topic, strlen(payload), (void *) payload, retain);
+   uint8_t known = 0;
+   for (int client = 0; client < MQTT_CLIENTS; client++)
+      if (*mqtthost[client])
+         known |= (1 << client);
+   uint8_t up = revk_mqtt_up(),
+       pending = 0;
+   xSemaphoreTake(queue_mutex, portMAX_DELAY);
+   for (revk_queue_t * q = queue; q; q = q->next)
+      if (q->pri <= pri)
+         pending |= q->clients; // Keep order, queue behind anything of same or higher class not yet sent
+#ifdef	CONFIG_REVK_MQTT_QUEUE_FLASH
+   if (pri >= QUEUE_EVENT && queue_part && queue_rd != queue_wr)
+      pending |= known;
+#endif
+   uint8_t now = (clients & up & ~pending);
+   if (now)
+      now &= revk_tokens();
+   revk_tokens_take(now);
+   uint8_t later = (clients & known & ~now);
+   if (pri > QUEUE_EVENT)
+      later &= up;              // Info and bulk are not held for clients off line
+   if (later & up)
+      queue_deferred++;
+   uint8_t failed = 0;
+   if (later)
+      failed = queue_put(later, strlen(topic), topic, strlen(payload), (void *) payload, retain, pri);
+   xSemaphoreGive(queue_mutex);
+   if (now)
+      failed |= mqtt_out(now, strlen(topic), topic, strlen(payload), (void *) payload, retain);
+   return failed;
+}
+
+static void revk_queue_hold(uint8_t clients, lwmqtt_msg_t * m, char retain)
+{                               // Queue a message that failed to send, class from its topic prefix
+   if (!queue_mutex)
+      return;
+   const char *topic;
+   const unsigned char *payload;
+   int tlen = lwmqtt_msg_topic(m, &topic);
+   int plen = lwmqtt_msg_payload(m, &payload);
+   int l = 0;
+   while (l < tlen && topic[l] != '/')
+      l++;
+   uint8_t pri = QUEUE_INFO;
+   if (l == strlen(prefixerror) && !memcmp(topic, prefixerror, l))
+      pri = QUEUE_ERROR;
+   else if (l == strlen(prefixstate) && !memcmp(topic, prefixstate, l))
+      pri = QUEUE_STATE;
+   else if (l == strlen(prefixevent) && !memcmp(topic, prefixevent, l))
+      pri = QUEUE_EVENT;
+   else if (l == strlen(prefixsetting) && !memcmp(topic, prefixsetting, l))
+      pri = QUEUE_BULK;
+   if (pri > QUEUE_EVENT)
+      clients &= revk_mqtt_up();        // Info and bulk are not held for clients off line
+   if (!clients)
+      return;
+   xSemaphoreTake(queue_mutex, portMAX_DELAY);
+   if (retain)
+      for (revk_queue_t * q = queue; q; q = q->next)
+         if (q->retain && q->tlen == tlen && !memcmp(q->data, topic, tlen))
+            clients &= ~q->clients;     // Already has later state for this topic
+   if (clients)
+      queue_put(clients, tlen, topic, plen, payload, retain, pri);
+   xSemaphoreGive(queue_mutex);
+}
+
+static void revk_queue_drain(void)
+{                               // Send from the queue, paced by the token buckets, highest class first, called every 100ms
+   if (!queue_mutex || (queue_hold && queue_hold > uptime()))
+      return;
+   queue_hold = 0;
+   uint8_t up = revk_mqtt_up();
+   if (!up)
+      return;
+   while (1)
+   {
+      xSemaphoreTake(queue_mutex, portMAX_DELAY);
+      uint8_t ok = (up & revk_tokens());
+      if (!ok)
+      {
+         xSemaphoreGive(queue_mutex);
+         return;
+      }
+      revk_queue_t **qp = NULL;
+      for (revk_queue_t ** p = &queue; *p; p = &(*p)->next)
+         if (((*p)->clients & ok) && (!qp || (*p)->pri < (*qp)->pri))
+            qp = p;             // Oldest of highest class
+      revk_queue_t *q = NULL;
+#ifdef	CONFIG_REVK_MQTT_QUEUE_FLASH
+      uint32_t pos = 0;
+      if ((!qp || (*qp)->pri >= QUEUE_EVENT) && (q = queue_flash_get(&pos)))
+      {                         // Flash is events and errors older than RAM
+         if ((q->clients & ok) != q->clients)
+         {                      // Wait for all its clients
+            xSemaphoreGive(queue_mutex);
+            free(q);
+            return;
+         }
+         revk_tokens_take(q->clients);
+         xSemaphoreGive(queue_mutex);
+         uint8_t failed = mqtt_out(q->clients, q->tlen, (char *) q->data, q->plen, q->data + q->tlen, 0);
+         free(q);
+         if (failed)
+            return;
+         xSemaphoreTake(queue_mutex, portMAX_DELAY);
+         queue_flash_done(pos);
+         xSemaphoreGive(queue_mutex);
+         continue;
+      }
+#endif
+      if (!qp)
+      {
+         if (queue_dropped && !queue)
+         {                      // All sent, report what was lost
+            jo_t j = jo_object_alloc();
+            jo_int(j, "dropped", queue_dropped);
+            queue_dropped = 0;
+            xSemaphoreGive(queue_mutex);
+            revk_info_clients("queue", &j, up);
+            return;
+         }
+         xSemaphoreGive(queue_mutex);
+         return;
+      }
+      q = *qp;
+      *qp = q->next;
+      queue_bytes -= sizeof(*q) + q->tlen + q->plen;
+      queue_count--;
+      uint8_t to = (q->clients & ok);
+      revk_tokens_take(to);
+      xSemaphoreGive(queue_mutex);
+      uint8_t failed = mqtt_out(to, q->tlen, (char *) q->data, q->plen, q->data + q->tlen, q->retain);
+      q->clients &= ~(to & ~failed);    // Done for clients that accepted it
+      if (!q->clients)
+      {
+         free(q);
+         continue;
+      }
+      // Not all sent, put back at the front
+      xSemaphoreTake(queue_mutex, portMAX_DELAY);
+      q->next = queue;
+      queue = q;
+      queue_bytes += sizeof(*q) + q->tlen + q->plen;
+      queue_count++;
+      xSemaphoreGive(queue_mutex);
+      if (failed)
+         return;
+   }
+}
+
+static uint8_t revk_queue_bulk(void)
+{                               // Clients that are up with queued bulk messages, so a big dump can stop until they have gone rather than fill the queue
+   uint8_t bulk = 0;
+   xSemaphoreTake(queue_mutex, portMAX_DELAY);
+   for (revk_queue_t * q = queue; q; q = q->next)
+      if (q->pri == QUEUE_BULK)
+         bulk |= q->clients;
+   xSemaphoreGive(queue_mutex);
+   return bulk & revk_mqtt_up();
+}
 #endif
 
 void revk_mqtt_send_raw(const char *topic, int retain, const char *payload, uint8_t clients)
@@ -1737,19 +2952,29 @@ void revk_mqtt_send_str_clients(const char *str, int retain, uint8_t clients)
 #endif
 }
 
-void revk_mqtt_send_payload_clients(const char *prefix, int retain, const char *suffix, const char *payload, uint8_t clients)
-{                               // Send to main, and N additional MQTT servers, or only to extra server N if copy -ve
 #ifdef	CONFIG_REVK_MQTT
+static uint8_t mqtt_send_payload(const char *prefix, int retain, const char *suffix, const char *payload, uint8_t clients)
+{                               // Send or queue, returns clients it failed for
+   char buf[128];
    char *topic = NULL;
    if (!prefix)
       topic = (char *) suffix;  /* Set fixed topic */
-   else if (asprintf(&topic, suffix ? "%s/%s/%s/%s" : "%s/%s/%s", prefix, appname, *hostname ? hostname : revk_id, suffix) < 0)
-      topic = NULL;
+   else
+      topic = revk_topic(buf, sizeof(buf), prefix, NULL, suffix);
    if (!topic)
-      return;
-   revk_mqtt_send_raw(topic, retain, payload, clients);
-   if (topic != suffix)
+      return clients;
+   ESP_LOGD(TAG, "MQTT%02X publish %s (%s)", clients, topic, payload);
+   uint8_t failed = revk_queue_out(clients, topic, payload, retain, prefix == prefixerror ? QUEUE_ERROR : prefix == prefixstate ? QUEUE_STATE : prefix == prefixevent ? QUEUE_EVENT : prefix == prefixsetting ? QUEUE_BULK : QUEUE_INFO);
+   if (topic != suffix && topic != buf)
       freez(topic);
+   return failed;
+}
+#endif
+
+void revk_mqtt_send_payload_clients(const char *prefix, int retain, const char *suffix, const char *payload, uint8_t clients)
+{                               // Send to main, and N additional MQTT servers, or only to extra server N if copy -ve
+#ifdef	CONFIG_REVK_MQTT
+   mqtt_send_payload(prefix, retain, suffix, payload, clients);
 #endif
 }
 
@@ -1787,14 +3012,198 @@ void revk_event_clients(const char *suffix, jo_t * jp, uint8_t clients)
    revk_mqtt_send_clients(prefixevent, 0, suffix, jp, clients);
 }
 
+#ifdef	CONFIG_REVK_MQTT
+static char *error_payload(revk_err_t * e, uint32_t u, uint32_t lost)
+{                               // Make malloc'd payload for held error, with count, times, and lost (error_mutex held)
+   jo_t j = jo_object_alloc();
+   if (e->count > 1)
+      jo_int(j, "count", e->count);
+   jo_array(j, "ts");           // Most recent occurrences, oldest first
+   time_t now = time(0);
+   int ts = (e->count < ERROR_TS ? e->count : ERROR_TS);
+   for (int t = 0; t < ts; t++)
+   {
+      uint32_t when = e->up[(e->count - ts + t) % ERROR_TS];
+      if (now > 1000000000)
+         jo_datetime(j, NULL, now - (u - when));
+      else
+         jo_int(j, NULL, when); // Uptime, clock not set
+   }
+   jo_close(j);
+   if (lost)
+      jo_int(j, "lost", lost);
+   char *extra = jo_finisha(&j);
+   char *payload = NULL;
+   int plen = strlen(e->payload);
+   if (extra)
+   {
+      int r;
+      if (*e->payload == '{' && plen >= 2 && e->payload[plen - 1] == '}')
+         r = asprintf(&payload, "%.*s%s%s", plen - 1, e->payload, plen > 2 ? "," : "", extra + 1);      // Add to object
+      else
+         r = asprintf(&payload, "{\"error\":%s,%s", e->payload, extra + 1);
+      if (r < 0)
+         payload = NULL;
+      free(extra);
+   }
+   if (!payload)
+      payload = strdup(e->payload);
+   return payload;
+}
+
+#ifdef	CONFIG_REVK_MQTT_QUEUE_FLASH
+static int error_flash(revk_err_t * e)
+{                               // Error pushed out of full ring to the flash queue (error_mutex held), 0 if OK or nothing to send
+   if (!e->clients)
+      return 0;
+   if (!queue_mutex || !queue_part)
+      return -1;
+   char buf[128];
+   char *topic = revk_topic(buf, sizeof(buf), prefixerror, NULL, e->suffix);
+   char *payload = error_payload(e, uptime(), 0);
+   int r = -1;
+   if (topic && payload)
+   {
+      int tlen = strlen(topic),
+          plen = strlen(payload);
+      revk_queue_t *q = malloc(sizeof(*q) + tlen + plen);
+      if (q)
+      {
+         memset(q, 0, sizeof(*q));
+         q->clients = e->clients;
+         q->pri = QUEUE_ERROR;
+         q->tlen = tlen;
+         q->plen = plen;
+         memcpy(q->data, topic, tlen);
+         memcpy(q->data + tlen, payload, plen);
+         xSemaphoreTake(queue_mutex, portMAX_DELAY);
+         r = queue_flash_put(q);
+         xSemaphoreGive(queue_mutex);
+         free(q);
+      }
+   }
+   free(payload);
+   if (topic != buf)
+      free(topic);
+   return r;
+}
+#endif
+
+static void revk_error_flush(void)
+{                               // Send held errors to clients that are connected, made under error_mutex, sent after
+   static uint32_t next = 0;
+   uint32_t u = uptime();
+   if (!error_mutex || u < next)
+      return;
+   uint8_t up = revk_mqtt_up();
+   if (!up)
+      return;
+   next = u + ERROR_FLUSH;
+   struct
+   {
+      char *suffix;
+      char *payload;
+      uint8_t to;
+      uint32_t lost;            // Lost count included
+   } out[CONFIG_REVK_ERRORS];
+   int outs = 0;
+   xSemaphoreTake(error_mutex, portMAX_DELAY);
+   uint32_t lost = error_lost;  // Cleared once sent
+   for (int n = 0; n < error_count; n++)
+   {
+      revk_err_t *e = &error_ring[(error_first + n) % CONFIG_REVK_ERRORS];
+      uint8_t to = (e->clients & up);
+      if (!to)
+         continue;
+      char *payload = error_payload(e, u, lost);
+      if (!payload)
+         continue;              // Try again next time
+      out[outs].suffix = (e->suffix ? strdup(e->suffix) : NULL);
+      out[outs].payload = payload;
+      out[outs].lost = lost;
+      out[outs++].to = to;
+      e->clients &= ~to;
+      lost = 0;
+   }
+   while (error_count && !error_ring[error_first].clients)
+   {                            // Done
+      revk_err_t *e = &error_ring[error_first];
+      freez(e->suffix);
+      freez(e->payload);
+      error_first = (error_first + 1) % CONFIG_REVK_ERRORS;
+      error_count--;
+   }
+   xSemaphoreGive(error_mutex);
+   for (int n = 0; n < outs; n++)
+   {                            // Send, not holding error_mutex, so a slow send does not stop errors being reported
+      if (!mqtt_send_payload(prefixerror, 0, out[n].suffix, out[n].payload, out[n].to) && out[n].lost)
+      {                         // Reported, so no longer lost, any lost since are still counted
+         xSemaphoreTake(error_mutex, portMAX_DELAY);
+         error_lost -= out[n].lost;
+         xSemaphoreGive(error_mutex);
+      }
+      freez(out[n].suffix);
+      freez(out[n].payload);
+   }
+}
+#endif
+
 void revk_error_clients(const char *suffix, jo_t * jp, uint8_t clients)
-{                               // Error message, waits a while for connection if possible before sending
-   xEventGroupWaitBits(revk_group,
-#ifdef	CONFIG_REVK_WIFI
-                       GROUP_WIFI |
+{                               // Error message, held in error ring and sent when connected, does not wait
+#ifdef	CONFIG_REVK_MQTT
+   if (!jp || !*jp || !error_mutex || !clients)
+   {
+      revk_mqtt_send_clients(prefixerror, 0, suffix, jp, clients);
+      return;
+   }
+   int pos = 0;
+   const char *err = jo_error(*jp, &pos);
+   if (err)
+   {
+      ESP_LOGE(TAG, "JSON error sending error/%s (%s) at %d", suffix ? : "", err, pos);
+      jo_free(jp);
+      return;
+   }
+   char *payload = (jo_isalloc(*jp) ? jo_finisha(jp) : strdup(jo_finish(jp) ? : ""));
+   if (!payload)
+      return;
+   xSemaphoreTake(error_mutex, portMAX_DELAY);
+   revk_err_t *e = NULL;
+   for (int n = 0; n < error_count && !e; n++)
+   {
+      revk_err_t *q = &error_ring[(error_first + n) % CONFIG_REVK_ERRORS];
+      if (q->clients == clients && !strcmp(q->payload, payload) && (q->suffix && suffix ? !strcmp(q->suffix, suffix) : q->suffix == suffix))
+         e = q;                 // Repeat
+   }
+   if (e)
+      free(payload);
+   else
+   {
+      if (error_count == CONFIG_REVK_ERRORS)
+      {                         // Full, oldest to flash queue if there is one, else lost
+         e = &error_ring[error_first];
+#ifdef	CONFIG_REVK_MQTT_QUEUE_FLASH
+         if (error_flash(e))
 #endif
-                       GROUP_MQTT, false, true, 20000 / portTICK_PERIOD_MS);
+            error_lost++;
+         freez(e->suffix);
+         freez(e->payload);
+         error_first = (error_first + 1) % CONFIG_REVK_ERRORS;
+         error_count--;
+      }
+      e = &error_ring[(error_first + error_count++) % CONFIG_REVK_ERRORS];
+      memset(e, 0, sizeof(*e));
+      e->suffix = (suffix ? strdup(suffix) : NULL);
+      e->payload = payload;
+      e->clients = clients;
+   }
+   e->up[e->count++ % ERROR_TS] = uptime();
+   if (!e->count)
+      e->count--;               // Stick at max
+   xSemaphoreGive(error_mutex);
+#else
    revk_mqtt_send_clients(prefixerror, 0, suffix, jp, clients);
+#endif
 }
 
 void revk_info_clients(const char *suffix, jo_t * jp, uint8_t clients)
@@ -2113,16 +3522,215 @@ static void ota_task(void *pvParameters)
    vTaskDelete(NULL);
 }
 
-static int nvs_get(setting_t * s, const char *tag, void *data, size_t len)
+static uint32_t snap_hash(const uint8_t * p, uint32_t len)
+{                               // FNV-1a
+   uint32_t h = 2166136261;
+   while (len--)
+      h = (h ^ *p++) * 16777619;
+   return h;
+}
+
+static snap_t *snap_get(nvs_handle nvs)
+{                               // Find snapshot for namespace, loading if first use at boot
+   snap_t *n = NULL;
+   for (int i = 0; i < SNAPS; i++)
+      if (snap[i].used && snap[i].nvs == nvs)
+         return &snap[i];
+      else if (!n && !snap[i].used)
+         n = &snap[i];
+   if (!n || !snap_boot)
+      return NULL;
+   memset(n, 0, sizeof(*n));
+   n->used = 1;
+   n->nvs = nvs;
+   size_t len = 0;
+   if (!nvs_get_blob(nvs, SNAP_KEY, NULL, &len) && len > sizeof(snap_head_t) && (n->blob = malloc(len)))
+   {
+      snap_head_t *h = (void *) n->blob;
+      if (!nvs_get_blob(nvs, SNAP_KEY, n->blob, &len) && h->magic == SNAP_MAGIC && h->version == SNAP_VERSION && h->len == len - sizeof(*h) && h->hash == snap_hash(n->blob + sizeof(*h), h->len))
+      {
+         n->loaded = 1;
+         n->len = len;
+         n->pos = sizeof(*h);
+      } else
+         freez(n->blob);
+   }
+   ESP_LOGD(TAG, "Snapshot %s", n->loaded ? "loaded" : "not found");
+   return n;
+}
+
+static int snap_find(snap_t * n, const char *tag, const uint8_t ** value)
+{                               // Find tag in loaded snapshot, returns value len, SNAP_ABSENT, or -1 if not in snapshot
+   int taglen = strlen(tag);
+   if (n->hit)
+   {                            // Same as last time
+      uint8_t *p = n->blob + n->hit;
+      if (p[0] == taglen && !memcmp(p + 1, tag, taglen))
+      {
+         *value = p + 3 + taglen;
+         return p[1 + p[0]] + (p[2 + p[0]] << 8);
+      }
+   }
+   if (n->pos >= n->len)
+      n->pos = sizeof(snap_head_t);
+   uint32_t start = n->pos;
+   do
+   {
+      uint8_t *p = n->blob + n->pos;
+      uint16_t vlen = p[1 + p[0]] + (p[2 + p[0]] << 8);
+      uint32_t pos = n->pos;
+      n->pos += 3 + p[0] + (vlen == SNAP_ABSENT ? 0 : vlen);
+      if (n->pos >= n->len)
+         n->pos = sizeof(snap_head_t);
+      if (p[0] == taglen && !memcmp(p + 1, tag, taglen))
+      {
+         n->hit = pos;
+         *value = p + 3 + taglen;
+         return vlen;
+      }
+   }
+   while (n->pos != start);
+   return -1;
+}
+
+static void snap_add(snap_t * n, const char *tag, const void *value, int vlen)
+{                               // Record value read (vlen SNAP_ABSENT if not in NVS)
+   int taglen = strlen(tag);
+   if (!n->new)
+      n->newlen = sizeof(snap_head_t);
+   uint32_t need = n->newlen + 3 + taglen + (vlen == SNAP_ABSENT ? 0 : vlen);
+   if (need > n->newsize)
+   {
+      uint8_t *new = realloc(n->new, need + 256);
+      if (!new)
+      {
+         n->stale = 1;          // Give up
+         return;
+      }
+      n->new = new;
+      n->newsize = need + 256;
+   }
+   uint8_t *p = n->new + n->newlen;
+   *p++ = taglen;
+   memcpy(p, tag, taglen);
+   p += taglen;
+   *p++ = vlen;
+   *p++ = vlen >> 8;
+   if (vlen != SNAP_ABSENT)
+      memcpy(p, value, vlen);
+   n->newlen = need;
+}
+
+static void snap_stale(nvs_handle nvs)
+{                               // Setting changed, snapshot no longer valid
+   snap_t *n = snap_get(nvs);
+   if (n && n->stale)
+      return;
+   nvs_erase_key(nvs, SNAP_KEY);
+   if (n)
+      n->stale = 1;
+   else
+      for (int i = 0; i < SNAPS; i++)
+         if (!snap[i].used)
+         {
+            snap[i].used = 1;
+            snap[i].nvs = nvs;
+            snap[i].stale = 1;
+            break;
+         }
+}
+
+static void snap_done(void)
+{                               // End of boot, write new snapshots if needed, free all
+   snap_boot = 0;
+   for (int i = 0; i < SNAPS; i++)
+   {
+      snap_t *n = &snap[i];
+      if (n->used && n->new && !n->stale && (!n->loaded || n->miss))
+      {
+         if (n->loaded)
+         {                      // Add new records to loaded ones
+            uint8_t *new = realloc(n->blob, n->len + n->newlen - sizeof(snap_head_t));
+            if (!new)
+            {
+               freez(n->blob);
+               freez(n->new);
+               continue;
+            }
+            memcpy(new + n->len, n->new + sizeof(snap_head_t), n->newlen - sizeof(snap_head_t));
+            n->blob = NULL;
+            free(n->new);
+            n->new = new;
+            n->newlen += n->len - sizeof(snap_head_t);
+         }
+         snap_head_t *h = (void *) n->new;
+         h->magic = SNAP_MAGIC;
+         h->version = SNAP_VERSION;
+         h->spare = 0;
+         h->len = n->newlen - sizeof(*h);
+         h->hash = snap_hash(n->new + sizeof(*h), h->len);
+         if (nvs_set_blob(n->nvs, SNAP_KEY, n->new, n->newlen) || nvs_commit(n->nvs))
+            ESP_LOGE(TAG, "Snapshot write failed");
+         else
+            ESP_LOGI(TAG, "Snapshot written (%u bytes)", n->newlen);
+      }
+      freez(n->blob);
+      freez(n->new);
+      n->len = n->newlen = n->newsize = 0;
+   }
+}
+
+static int nvs_get_snap(setting_t * s, const char *tag, void *data, size_t len)
+{                               // Get from snapshot, as nvs_get, returns -ESP_ERR_NOT_FOUND if not in snapshot
+   snap_t *n = (snap_boot ? snap_get(s->nvs) : NULL);
+   if (!n || !n->loaded)
+      return -ESP_ERR_NOT_FOUND;
+   const uint8_t *v = NULL;
+   int vlen = snap_find(n, tag, &v);
+   if (vlen < 0)
+   {
+      n->miss = 1;
+      return -ESP_ERR_NOT_FOUND;
+   }
+   if (vlen == SNAP_ABSENT)
+      return -ESP_ERR_NVS_NOT_FOUND;
+   int ret = vlen;
+   if (s->def->flags & SETTING_BINDATA)
+   {
+      if (!s->def->size)
+      {                         // Dynamic, len includes revk_bindata_t
+         ret += sizeof(revk_bindata_t);
+         if (data)
+         {
+            if (len < ret)
+               return -ESP_ERR_NVS_INVALID_LENGTH;
+            revk_bindata_t *d = data;
+            d->len = vlen;
+            data = d->data;
+         }
+      } else if (data && len < vlen)
+         return -ESP_ERR_NVS_INVALID_LENGTH;
+   } else if (s->def->size)
+   {                            // Number
+      if (vlen != s->def->size)
+         return -ESP_ERR_NVS_TYPE_MISMATCH;
+   } else if (data && len < vlen)
+      return -ESP_ERR_NVS_INVALID_LENGTH;       // String
+   if (data)
+      memcpy(data, v, vlen);
+   return ret;
+}
+
+static int nvs_get_key(setting_t * s, const char *tag, void *data, size_t len)
 {                               /* Low level get logic, returns < 0 if error.Calls the right nvs get function for type of setting */
    esp_err_t err;
-   if (s->flags & SETTING_BINDATA)
+   if (s->def->flags & SETTING_BINDATA)
    {
-      if (s->size || !data)
+      if (s->def->size || !data)
       {                         // Fixed size, or getting len
          if ((err = nvs_get_blob(s->nvs, tag, data, &len)) != ERR_OK)
             return -err;
-         if (!s->size)
+         if (!s->def->size)
             len += sizeof(revk_bindata_t);
          return len;
       }
@@ -2133,7 +3741,7 @@ static int nvs_get(setting_t * s, const char *tag, void *data, size_t len)
          return -err;
       return len + sizeof(revk_bindata_t);
    }
-   if (s->size == 0)
+   if (s->def->size == 0)
    {                            /* String */
       if ((err = nvs_get_str(s->nvs, tag, data, &len)) != ERR_OK)
          return -err;
@@ -2142,27 +3750,27 @@ static int nvs_get(setting_t * s, const char *tag, void *data, size_t len)
    uint64_t temp;
    if (!data)
       data = &temp;
-   if (s->flags & SETTING_SIGNED)
+   if (s->def->flags & SETTING_SIGNED)
    {
-      if (s->size == 8)
+      if (s->def->size == 8)
       {                         /* int64 */
          if ((err = nvs_get_i64(s->nvs, tag, data)) != ERR_OK)
             return -err;
          return 8;
       }
-      if (s->size == 4)
+      if (s->def->size == 4)
       {                         /* int32 */
          if ((err = nvs_get_i32(s->nvs, tag, data)) != ERR_OK)
             return -err;
          return 4;
       }
-      if (s->size == 2)
+      if (s->def->size == 2)
       {                         /* int16 */
          if ((err = nvs_get_i16(s->nvs, tag, data)) != ERR_OK)
             return -err;
          return 2;
       }
-      if (s->size == 1)
+      if (s->def->size == 1)
       {                         /* int8 */
          if ((err = nvs_get_i8(s->nvs, tag, data)) != ERR_OK)
             return -err;
@@ -2170,116 +3778,461 @@ static int nvs_get(setting_t * s, const char *tag, void *data, size_t len)
       }
    } else
    {
-      if (s->size == 8)
-      {                         /* uint64 */
-         if ((err = nvs_get_u64(s->nvs, tag, data)) != ERR_OK)
-            return -err;
-         return 8;
-      }
-      if (s->size == 4)
-      {                         /* uint32 */
-         if ((err = nvs_get_u32(s->nvs, tag, data)) != ERR_OK)
-            return -err;
-         return 4;
-      }
-      if (s->size == 2)
-      {                         /* uint16 */
-         if ((err = nvs_get_u16(s->nvs, tag, data)) != ERR_OK)
-            return -err;
-         return 2;
-      }
-      if (s->size == 1)
-      {                         /* uint8 */
-         if ((err = nvs_get_u8(s->nvs, tag, data)) != ERR_OK)
-            return -err;
+      if (s->def->size == 8)
+      {                         /* uint64 */
+         if ((err = nvs_get_u64(s->nvs, tag, data)) != ERR_OK)
+            return -err;
+         return 8;
+      }
+      if (s->def->size == 4)
+      {                         /* uint32 */
+         if ((err = nvs_get_u32(s->nvs, tag, data)) != ERR_OK)
+            return -err;
+         return 4;
+      }
+      if (s->def->size == 2)
+      {                         /* uint16 */
+         if ((err = nvs_get_u16(s->nvs, tag, data)) != ERR_OK)
+            return -err;
+         return 2;
+      }
+      if (s->def->size == 1)
+      {                         /* uint8 */
+         if ((err = nvs_get_u8(s->nvs, tag, data)) != ERR_OK)
+            return -err;
+         return 1;
+      }
+   }
+   return -999;
+}
+
+static int nvs_get(setting_t * s, const char *tag, void *data, size_t len)
+{                               // Get setting, from snapshot at boot if possible
+   int ret = nvs_get_snap(s, tag, data, len);
+   if (ret != -ESP_ERR_NOT_FOUND)
+      return ret;
+   ret = nvs_get_key(s, tag, data, len);
+   if (snap_boot && (data || ret == -ESP_ERR_NVS_NOT_FOUND))
+   {                            // Record for new snapshot
+      snap_t *n = snap_get(s->nvs);
+      if (n && !n->stale)
+      {
+         if (ret == -ESP_ERR_NVS_NOT_FOUND)
+            snap_add(n, tag, NULL, SNAP_ABSENT);
+         else if (ret >= 0)
+         {
+            if ((s->def->flags & SETTING_BINDATA) && !s->def->size)
+               snap_add(n, tag, ((revk_bindata_t *) data)->data, ((revk_bindata_t *) data)->len);
+            else
+               snap_add(n, tag, data, ret);
+         }
+      }
+   }
+   return ret;
+}
+
+static esp_err_t nvs_set(setting_t * s, const char *tag, void *data)
+{                               /* Low level set logic, returns < 0 if error. Calls the right nvs set function for type of setting */
+   if (s->def->flags & SETTING_BINDATA)
+   {
+      if (s->def->size)
+         return nvs_set_blob(s->nvs, tag, data, s->def->size);       // Fixed size - just store
+      // Variable size, store the size it is
+      revk_bindata_t *d = data;
+      return nvs_set_blob(s->nvs, tag, d->data, d->len);        // Variable
+   }
+   if (s->def->size == 0)
+      return nvs_set_str(s->nvs, tag, data);
+   if (s->def->flags & SETTING_SIGNED)
+   {
+      if (s->def->size == 8)
+         return nvs_set_i64(s->nvs, tag, *((int64_t *) data));
+      if (s->def->size == 4)
+         return nvs_set_i32(s->nvs, tag, *((int32_t *) data));
+      if (s->def->size == 2)
+         return nvs_set_i16(s->nvs, tag, *((int16_t *) data));
+      if (s->def->size == 1)
+         return nvs_set_i8(s->nvs, tag, *((int8_t *) data));
+   } else
+   {
+      if (s->def->size == 8)
+         return nvs_set_u64(s->nvs, tag, *((uint64_t *) data));
+      if (s->def->size == 4)
+         return nvs_set_u32(s->nvs, tag, *((uint32_t *) data));
+      if (s->def->size == 2)
+         return nvs_set_u16(s->nvs, tag, *((uint16_t *) data));
+      if (s->def->size == 1)
+         return nvs_set_u8(s->nvs, tag, *((uint8_t *) data));
+   }
+   ESP_LOGE(TAG, "Not saved setting %s", tag);
+   return -1;
+}
+
+static uint32_t setting_hashn(const char *name, int len)
+{                               // FNV-1a
+   uint32_t h = 2166136261;
+   while (len--)
+      h = (h ^ (uint8_t) * name++) * 16777619;
+   return h % SETTING_HASH;
+}
+
+static setting_t *setting_find(const char *name, int len)
+{                               // Find setting by name (len characters)
+   setting_t *s;
+   for (s = setting_hash[setting_hashn(name, len)]; s && (s->def->namelen != len || strncmp(s->def->name, name, len)); s = s->hnext);
+   return s;
+}
+
+static setting_t *setting_lookup(const char *tag, int *index)
+{                               // Find setting by tag, which can have array index on end (1 based), sets index (0 based)
+   int len = strlen(tag);
+   setting_t *s = setting_find(tag, len);
+   if (s)
+   {
+      *index = 0;
+      return s;
+   }
+   for (int l = len; l > 1 && isdigit((int) tag[l - 1]); l--)
+      if ((s = setting_find(tag, l - 1)) && s->def->array)
+      {
+         int v = atoi(tag + l - 1);
+         if (v && v <= s->def->array)
+         {
+            *index = v - 1;
+            return s;
+         }
+      }
+   return NULL;
+}
+
+static uint32_t setting_etag(void)
+{                               // Hash of dumped settings values, only worked out again if changed
+   static uint32_t etag = 0,
+       etag_gen = -1;
+   if (etag_gen == setting_gen)
+      return etag;
+   uint32_t h = 2166136261 ^ setting_boot;      // FNV-1a, per boot so an etag from before a restart does not match
+   void add(const void *p, int len) {
+      for (int i = 0; i < len; i++)
+         h = (h ^ ((const uint8_t *) p)[i]) * 16777619;
+   }
+   for (setting_t * s = setting; s; s = s->next)
+   {
+      const revk_setting_def_t *d = s->def;
+      if ((d->flags & SETTING_SECRET) && !s->parent && !s->child)
+         continue;              // Not dumped
+      add(d->name, d->namelen + 1);
+      int n = ((d->array && !(d->flags & SETTING_BOOLEAN)) ? d->array : 1);
+      if (d->size)
+         add(d->data, d->size * n);
+      else
+         for (int i = 0; i < n; i++)
+         {
+            void *v = ((void **) d->data)[i];
+            if (!v)
+               add("", 1);
+            else if (d->flags & SETTING_BINDATA)
+               add(v, sizeof(revk_bindata_t) + ((revk_bindata_t *) v)->len);
+            else
+               add(v, strlen(v) + 1);
+         }
+   }
+   etag = h;
+   etag_gen = setting_gen;
+   return etag;
+}
+
+// Settings transaction, all keys in a settings message are parsed and checked first, then only real changes written, and committed once
+typedef struct setting_txn_s setting_txn_t;
+struct setting_txn_s
+{
+   setting_txn_t *next;
+   setting_t *s;
+   char tag[16];                // NVS tag
+   void *data;                  // Where value is held in memory
+   unsigned char *n;            // New value (as stored)
+   unsigned char *o;            // Old value, NULL if not in NVS, for rollback
+   void *was;                   // Old live value, for change handler
+   int ol;                      // Old value length
+   unsigned int len;            // Value length (as passed)
+   uint8_t flags;
+   uint8_t erase:1;             // Erase from NVS (default)
+   uint8_t done:1;              // Written
+   uint8_t changed:1;           // Live value changed
+};
+
+int revk_setting_read_begin(void)
+{                               // Start reading dynamic settings
+   while (1)
+   {
+      uint32_t e = setting_epoch;
+      __atomic_add_fetch(&setting_readers[e & 1], 1, __ATOMIC_SEQ_CST);
+      if (e == setting_epoch)
+         return e & 1;
+      __atomic_sub_fetch(&setting_readers[e & 1], 1, __ATOMIC_SEQ_CST);  // Epoch moved on, try again
+   }
+}
+
+void revk_setting_read_end(int e)
+{                               // Done reading dynamic settings
+   __atomic_sub_fetch(&setting_readers[e & 1], 1, __ATOMIC_SEQ_CST);
+}
+
+static void setting_retire(void *value)
+{                               // Free replaced dynamic value once safe
+   if (!value)
+      return;
+   setting_old_t *o = NULL;
+   if (!setting_old_mutex || !(o = malloc(sizeof(*o))))
+   {
+      free(value);              // At boot (no readers), or no memory
+      return;
+   }
+   o->value = value;
+   o->when = uptime();
+   xSemaphoreTake(setting_old_mutex, portMAX_DELAY);
+   o->epoch = setting_epoch;
+   o->next = setting_old;
+   setting_old = o;
+   xSemaphoreGive(setting_old_mutex);
+}
+
+static void setting_reclaim(void)
+{                               // Free old values no reader can still have
+   if (!setting_old)
+      return;
+   xSemaphoreTake(setting_old_mutex, portMAX_DELAY);
+   if (!setting_readers[(setting_epoch + 1) & 1])
+      setting_epoch++;          // No readers left from previous epoch, move on
+   uint32_t now = uptime();
+   setting_old_t **op = &setting_old;
+   while (*op)
+   {
+      setting_old_t *o = *op;
+      if (setting_epoch - o->epoch >= 2 && now - o->when >= SETTING_GRACE)
+      {                         // Readers from when replaced have finished
+         *op = o->next;
+         free(o->value);
+         free(o);
+      } else
+         op = &o->next;
+   }
+   xSemaphoreGive(setting_old_mutex);
+}
+
+static void topic_stale(void)
+{                               // Topics may have changed, cached topics rebuilt on next use, called after the new value is stored
+#ifdef	CONFIG_REVK_MQTT
+   if (topic_mutex)
+      xSemaphoreTake(topic_mutex, portMAX_DELAY);
+   topic_gen++;
+   if (topic_mutex)
+      xSemaphoreGive(topic_mutex);
+#endif
+}
+
+static char setting_live(setting_t * s, void *data, unsigned char *n, unsigned int len, unsigned char flags, void **wasp)
+{                               // Store new value in memory, frees n, returns if changed, old value passed back in wasp if not NULL (caller retires)
+   if (!s->def->size)
+   {                            /* Dynamic */
+      void *o = *((void **) data);
+      /* See if different */
+      if (!o || ((flags & SETTING_BINDATA) ? memcmp(o, n, len) : strcmp(o, (char *) n)))
+      {
+         __atomic_store_n((void **) data, n, __ATOMIC_RELEASE); // Readers see old or new, old is retired not freed
+         if (wasp)
+            *wasp = o;
+         else
+            setting_retire(o);
+         topic_stale();
          return 1;
       }
+      freez(n);                 /* No change */
+      return 0;
+   } else
+   {                            /* Static (try and make update atomic) */
+      if (wasp && (*wasp = malloc(s->def->size)))
+         memcpy(*wasp, data, s->def->size);
+      if (s->def->size == 1)
+         *(uint8_t *) data = *(uint8_t *) n;
+      else if (s->def->size == 2)
+         *(uint16_t *) data = *(uint16_t *) n;
+      else if (s->def->size == 4)
+         *(uint32_t *) data = *(uint32_t *) n;
+      else if (s->def->size == 8)
+         *(uint64_t *) data = *(uint64_t *) n;
+      else
+         memcpy(data, n, s->def->size);
+      freez(n);
+      topic_stale();
+      return 1;
    }
-   return -999;
 }
 
-static esp_err_t nvs_set(setting_t * s, const char *tag, void *data)
-{                               /* Low level set logic, returns < 0 if error. Calls the right nvs set function for type of setting */
-   if (s->flags & SETTING_BINDATA)
+static void setting_txn_free(setting_txn_t ** txnp)
+{
+   while (*txnp)
    {
-      if (s->size)
-         return nvs_set_blob(s->nvs, tag, data, s->size);       // Fixed size - just store
-      // Variable size, store the size it is
-      revk_bindata_t *d = data;
-      return nvs_set_blob(s->nvs, tag, d->data, d->len);        // Variable
+      setting_txn_t *t = *txnp;
+      *txnp = t->next;
+      freez(t->n);
+      freez(t->o);
+      if (t->s->def->size)
+         freez(t->was);         // Copy of static value
+      else
+         setting_retire(t->was);
+      free(t);
    }
-   if (s->size == 0)
-      return nvs_set_str(s->nvs, tag, data);
-   if (s->flags & SETTING_SIGNED)
+}
+
+static const char *setting_txn_add(setting_txn_t ** txnp, setting_t * s, const char *tag, void *data, unsigned char *n, int l, unsigned int len, char erase, unsigned char flags)
+{                               // Add to transaction if a change, takes n
+   setting_txn_t **tp;
+   for (tp = txnp; *tp && ((*tp)->s->nvs != s->nvs || strcmp((*tp)->tag, tag)); tp = &(*tp)->next);
+   if (*tp)
+   {                            // Replaces earlier change in same transaction
+      setting_txn_t *t = *tp;
+      *tp = t->next;
+      t->next = NULL;
+      setting_txn_free(&t);
+   }
+   setting_txn_t *t = malloc(sizeof(*t));
+   if (!t)
    {
-      if (s->size == 8)
-         return nvs_set_i64(s->nvs, tag, *((int64_t *) data));
-      if (s->size == 4)
-         return nvs_set_i32(s->nvs, tag, *((int32_t *) data));
-      if (s->size == 2)
-         return nvs_set_i16(s->nvs, tag, *((int16_t *) data));
-      if (s->size == 1)
-         return nvs_set_i8(s->nvs, tag, *((int8_t *) data));
-   } else
+      freez(n);
+      return "Malloc";
+   }
+   memset(t, 0, sizeof(*t));
+   t->s = s;
+   strcpy(t->tag, tag);
+   t->data = data;
+   t->n = n;
+   t->len = len;
+   t->flags = flags;
+   t->erase = erase;
+   t->ol = nvs_get(s, tag, NULL, 0);
+   if (t->ol >= 0 && (!(t->o = malloc(t->ol ? : 1)) || nvs_get(s, tag, t->o, t->ol) != t->ol))
    {
-      if (s->size == 8)
-         return nvs_set_u64(s->nvs, tag, *((uint64_t *) data));
-      if (s->size == 4)
-         return nvs_set_u32(s->nvs, tag, *((uint32_t *) data));
-      if (s->size == 2)
-         return nvs_set_u16(s->nvs, tag, *((uint16_t *) data));
-      if (s->size == 1)
-         return nvs_set_u8(s->nvs, tag, *((uint8_t *) data));
+      setting_txn_free(&t);
+      return "Bad setting get";
    }
-   ESP_LOGE(TAG, "Not saved setting %s", tag);
-   return -1;
+   if (erase ? t->ol < 0 : (t->ol == l && !memcmp(t->o, n, l)))
+   {                            // No change
+      setting_txn_free(&t);
+      return NULL;
+   }
+   for (tp = txnp; *tp; tp = &(*tp)->next);
+   *tp = t;
+   return NULL;
 }
 
-static const char *revk_setting_internal(setting_t * s, unsigned int len, const unsigned char *value, unsigned char index, unsigned char flags)
-{                               // Value is expected to already be binary if using binary
-   flags |= s->flags;
-   {                            // Overlap check
-      setting_t *q;
-      for (q = setting; q && q->data != s->data; q = q->next);
-      if (q)
-         s = q;
+static const char *setting_txn_commit(setting_txn_t ** txnp, jo_t j)
+{                               // Write changes, all or nothing, commit once, adds changed tags to j
+   const char *er = NULL;
+   setting_txn_t *t;
+   for (t = *txnp; t && !er; t = t->next)
+   {
+      snap_stale(t->s->nvs);
+      esp_err_t e = (t->erase ? nvs_erase_key(t->s->nvs, t->tag) : nvs_set(t->s, t->tag, t->n));
+      if (!t->erase && e != ERR_OK && (nvs_erase_key(t->s->nvs, t->tag) != ERR_OK || nvs_set(t->s, t->tag, t->n) != ERR_OK))
+         er = "Unable to store";
+      else
+         t->done = 1;
+   }
+   for (t = *txnp; t && !er; t = t->next)
+   {                            // Commit once per namespace
+      setting_txn_t *q;
+      for (q = *txnp; q != t && q->s->nvs != t->s->nvs; q = q->next);
+      if (q == t && nvs_commit(t->s->nvs) != ERR_OK)
+         er = "Unable to commit";
+   }
+   if (er)
+   {                            // Put back what was written, nothing is applied, gen not changed
+      ESP_LOGE(TAG, "Settings not stored (%s), rolling back", er);
+      char bad = 0;
+      for (t = *txnp; t && t->done; t = t->next)
+      {
+         esp_err_t e = (t->o ? nvs_set(t->s, t->tag, t->o) : nvs_erase_key(t->s->nvs, t->tag));
+         if (e != ERR_OK && (t->o || e != ESP_ERR_NVS_NOT_FOUND))
+            bad = 1;
+      }
+      for (t = *txnp; t && t->done; t = t->next)
+      {
+         setting_txn_t *q;
+         for (q = *txnp; q != t && q->s->nvs != t->s->nvs; q = q->next);
+         if (q == t && nvs_commit(t->s->nvs) != ERR_OK)
+            bad = 1;
+      }
+      if (bad)
+      {
+         ESP_LOGE(TAG, "Settings rollback failed");
+         er = "Settings rollback failed";
+      }
+      setting_txn_free(txnp);
+      return er;
+   }
+   char restart = 0;
+   if (*txnp)
+      setting_gen++;
+   for (t = *txnp; t; t = t->next)
+   {
+      t->s->gen = setting_gen;
+#if defined(SETTING_DEBUG) || defined(SETTING_CHANGED)
+      ESP_LOGI(TAG, "Setting %s %s", t->tag, t->erase ? "erased" : "stored");
+#endif
+      if (j)
+         jo_string(j, NULL, t->tag);
+      if (t->flags & SETTING_LIVE)
+      {
+         t->changed = setting_live(t->s, t->data, t->n, t->len, t->flags, t->s->changed ? &t->was : NULL);
+         t->n = NULL;
+      } else
+         restart = 1;
    }
-   void *data = s->data;
-   if (s->array)
+   for (t = *txnp; t; t = t->next)
+      if (t->changed && t->s->changed)
+         t->s->changed(t->tag, t->was, t->s->def->size ? t->data : *(void **) t->data);      // Now all applied
+
+   setting_txn_free(txnp);
+   if (restart)
+      revk_restart("Settings changed", 5);
+   return NULL;
+}
+
+static const char *revk_setting_internal(setting_t * s, unsigned int len, const unsigned char *value, unsigned char index, unsigned char flags, setting_txn_t ** txn)
+{                               // Value is expected to already be binary if using binary, added to txn if not NULL
+   flags |= s->def->flags;
+   if (s->alias)
+      s = s->alias;             // Overlap, use the child holding the data
+   void *data = s->def->data;
+   if (s->def->array)
    {
-      if (index >= s->array)
+      if (index >= s->def->array)
          return "Bad index";
-      if (s->array && index && !(flags & SETTING_BOOLEAN))
-         data += index * (s->size ? : sizeof(void *));
+      if (s->def->array && index && !(flags & SETTING_BOOLEAN))
+         data += index * (s->def->size ? : sizeof(void *));
    }
    // TODO we should not have suffix on index 1, that is just silly, but change needs backwards compatibility...
    char tag[16];                /* Max NVS name size */
-   if (snprintf(tag, sizeof(tag), s->array ? "%s%u" : "%s", s->name, index + 1) >= sizeof(tag))
+   if (snprintf(tag, sizeof(tag), s->def->array ? "%s%u" : "%s", s->def->name, index + 1) >= sizeof(tag))
    {
-      ESP_LOGE(TAG, "Setting %s%u too long", s->name, index + 1);
+      ESP_LOGE(TAG, "Setting %s%u too long", s->def->name, index + 1);
       return "Setting name too long";
    }
    ESP_LOGD(TAG, "MQTT setting %s (%d)", tag, len);
    char erase = 0;
    /* Using default, so remove from flash(as defaults may change later, don 't store the default in flash) */
    unsigned char *temp = NULL;  // Malloced space to be freed
-   const char *defval = s->defval;
-   if (defval && (flags & SETTING_BITFIELD))
-   {                            /* default is after bitfields and a space */
-      while (*defval && *defval != ' ')
-         defval++;
-      if (*defval == ' ')
-         defval++;
-   }
+   const char *defval = ((flags & SETTING_BITFIELD) ? s->dv : s->def->defval);     /* default is after bitfields and a space */
    if (!len && defval && !index && !value)
    {                            /* Use default value */
-      if (s->flags & SETTING_BINDATA)
+      if (s->def->flags & SETTING_BINDATA)
       {                         // Convert to binary
          jo_t j = jo_create_alloc();
          jo_string(j, NULL, defval);
          jo_rewind(j);
          int l;
-         if (s->flags & SETTING_HEX)
+         if (s->def->flags & SETTING_HEX)
          {
             l = jo_strncpy16(j, NULL, 0);
             if (l > 0)
@@ -2320,7 +4273,7 @@ static const char *revk_setting_internal(setting_t * s, unsigned int len, const
       if (flags & SETTING_BINDATA)
       {                         /* Blob */
          unsigned char *o;
-         if (!s->size)
+         if (!s->def->size)
          {                      /* Dynamic */
             l += sizeof(revk_bindata_t);
             revk_bindata_t *d = malloc(l);
@@ -2333,18 +4286,18 @@ static const char *revk_setting_internal(setting_t * s, unsigned int len, const
             }
          } else
          {                      // Fixed size binary
-            if (l && l != s->size)
+            if (l && l != s->def->size)
                return "Wrong size";
-            o = n = malloc(s->size);
+            o = n = malloc(s->def->size);
             if (o)
             {
                if (l)
                   memcpy(o, value, l);
                else
-                  memset(o, 0, l = s->size);
+                  memset(o, 0, l = s->def->size);
             }
          }
-      } else if (!s->size)
+      } else if (!s->def->size)
       {                         /* String */
          l++;
          n = malloc(l);         /* One byte for null termination */
@@ -2356,13 +4309,13 @@ static const char *revk_setting_internal(setting_t * s, unsigned int len, const
          uint64_t v = 0;
          if (flags & SETTING_BOOLEAN)
          {                      /* Boolean */
-            if (s->size == 1)
+            if (s->def->size == 1)
                v = *(uint8_t *) data;
-            else if (s->size == 2)
+            else if (s->def->size == 2)
                v = *(uint16_t *) data;
-            else if (s->size == 4)
+            else if (s->def->size == 4)
                v = *(uint32_t *) data;
-            else if (s->size == 8)
+            else if (s->def->size == 8)
                v = *(uint64_t *) data;
             if (len && strchr("YytT1", *value))
                v |= (1ULL << index);
@@ -2371,7 +4324,7 @@ static const char *revk_setting_internal(setting_t * s, unsigned int len, const
          } else
          {
             char neg = 0;
-            int bits = s->size * 8;
+            int bits = s->def->size * 8;
             uint64_t bitfield = 0;
             if (flags & SETTING_SET)
             {                   /* Set top bit if a value is present */
@@ -2379,26 +4332,21 @@ static const char *revk_setting_internal(setting_t * s, unsigned int len, const
                if (len && value != (const unsigned char *) defval)
                   bitfield |= (1ULL << bits);   /* Value is set (not so if using default value) */
             }
-            if (flags & SETTING_BITFIELD && s->defval)
+            if (flags & SETTING_BITFIELD && s->bitlen)
             {                   /* Bit fields */
                while (len)
                {
-                  const char *c = s->defval;
-                  while (*c && *c != ' ' && *c != *value)
-                     c++;
-                  if (*c != *value)
+                  const char *c = memchr(s->def->defval, *value, s->bitlen);
+                  if (!c)
                      break;
-                  uint64_t m = (1ULL << (bits - 1 - (c - s->defval)));
+                  uint64_t m = (1ULL << (bits - 1 - (c - s->def->defval)));
                   if (bitfield & m)
                      break;
                   bitfield |= m;
                   len--;
                   value++;
                }
-               const char *c = s->defval;
-               while (*c && *c != ' ')
-                  c++;
-               bits -= (c - s->defval);
+               bits -= s->bitlen;
             }
             if (len && bits <= 0)
                return "Extra data on end";
@@ -2448,35 +4396,39 @@ static const char *revk_setting_internal(setting_t * s, unsigned int len, const
          }
          if (flags & SETTING_SIGNED)
          {
-            if (s->size == 8)
+            if (s->def->size == 8)
                *((int64_t *) (n = malloc(l = 8))) = v;
-            else if (s->size == 4)
+            else if (s->def->size == 4)
                *((int32_t *) (n = malloc(l = 4))) = v;
-            else if (s->size == 2)
+            else if (s->def->size == 2)
                *((int16_t *) (n = malloc(l = 2))) = v;
-            else if (s->size == 1)
+            else if (s->def->size == 1)
                *((int8_t *) (n = malloc(l = 1))) = v;
          } else
          {
-            if (s->size == 8)
+            if (s->def->size == 8)
                *((int64_t *) (n = malloc(l = 8))) = v;
-            else if (s->size == 4)
+            else if (s->def->size == 4)
                *((int32_t *) (n = malloc(l = 4))) = v;
-            else if (s->size == 2)
+            else if (s->def->size == 2)
                *((int16_t *) (n = malloc(l = 2))) = v;
-            else if (s->size == 1)
+            else if (s->def->size == 1)
                *((int8_t *) (n = malloc(l = 1))) = v;
          }
       }
       if (!n)
          return "Bad setting type";
+      if (txn)
+         return setting_txn_add(txn, s, tag, data, n, l, len, erase, flags);
       /* See if setting has changed */
       int o = nvs_get(s, tag, NULL, 0); // Get length
 #ifdef SETTING_DEBUG
       if (o < 0 && o != -ESP_ERR_NVS_NOT_FOUND)
          ESP_LOGI(TAG, "Setting %s nvs read fail %s", tag, esp_err_to_name(-o));
 #endif
-      if (o != l)
+      if (erase && o == -ESP_ERR_NVS_NOT_FOUND)
+         o = 0;                 /* Already absent, e.g. defaulting at boot, no need to erase */
+      else if (o != l)
       {
 #if defined(SETTING_DEBUG) || defined(SETTING_CHANGED)
          if (o >= 0)
@@ -2507,6 +4459,8 @@ static const char *revk_setting_internal(setting_t * s, unsigned int len, const
          if (erase)
          {
             esp_err_t __attribute__((unused)) err = nvs_erase_key(s->nvs, tag);
+            if (err != ESP_ERR_NVS_NOT_FOUND)
+               snap_stale(s->nvs);
             if (err == ESP_ERR_NVS_NOT_FOUND)
                o = 0;
 #if defined(SETTING_DEBUG) || defined(SETTING_CHANGED)
@@ -2515,6 +4469,7 @@ static const char *revk_setting_internal(setting_t * s, unsigned int len, const
 #endif
          } else
          {
+            snap_stale(s->nvs);
             if (nvs_set(s, tag, n) != ERR_OK && (nvs_erase_key(s->nvs, tag) != ERR_OK || nvs_set(s, tag, n) != ERR_OK))
             {
                freez(n);
@@ -2530,33 +4485,13 @@ static const char *revk_setting_internal(setting_t * s, unsigned int len, const
          nvs_time = uptime() + 60;
       }
       if (flags & SETTING_LIVE)
-      {                         /* Store changed value in memory live */
-         if (!s->size)
-         {                      /* Dynamic */
-            void *o = *((void **) data);
-            /* See if different */
-            if (!o || ((flags & SETTING_BINDATA) ? memcmp(o, n, len) : strcmp(o, (char *) n)))
-            {
-               *((void **) data) = n;
-               freez(o);
-            } else
-               freez(n);        /* No change */
-         } else
-         {                      /* Static (try and make update atomic) */
-            if (s->size == 1)
-               *(uint8_t *) data = *(uint8_t *) n;
-            else if (s->size == 2)
-               *(uint16_t *) data = *(uint16_t *) n;
-            else if (s->size == 4)
-               *(uint32_t *) data = *(uint32_t *) n;
-            else if (s->size == 8)
-               *(uint64_t *) data = *(uint64_t *) n;
-            else
-               memcpy(data, n, s->size);
-            freez(n);
-         }
-      } else if (o < 0)
-         revk_restart("Settings changed", 5);
+         setting_live(s, data, n, len, flags, NULL);    /* Store changed value in memory live */
+      else
+      {
+         freez(n);
+         if (o < 0)
+            revk_restart("Settings changed", 5);
+      }
       return NULL;
    }
    const char *fail = parse();
@@ -2564,58 +4499,77 @@ static const char *revk_setting_internal(setting_t * s, unsigned int len, const
    return fail;                 /* OK */
 }
 
-static const char *revk_setting_dump(void)
-{                               // Dump settings (in JSON)
-   const char *err = NULL;
-   jo_t j = NULL;
-   void send(void) {
-      if (!j)
-         return;
-      revk_mqtt_send(prefixsetting, 0, NULL, &j);
-   }
+static const char *revk_setting_dump(const char *after, uint32_t since, int packets)
+{                               // Dump settings (in JSON), starting after setting named after (NULL for all), only if changed after generation since (0 for all), returns setting to resume after if stopped once packets sent (0 for no limit) or bulk queue backed up
+#ifdef	CONFIG_REVK_MQTT
+   if (packets && after && revk_queue_bulk())
+      return after;             // Last slice not gone yet, try again later
+#endif
    int maxpacket = MQTT_MAX;
    maxpacket -= 50;             // for headers
 #ifdef	CONFIG_REVK_MESH
    maxpacket -= MESH_PAD;
 #endif
-   char buf[maxpacket];         // Allows for topic, header, etc
+   char *buf = malloc(maxpacket * 2);   // Packet being built, and entry being made
+   if (!buf)
+      return NULL;
+   char *entry = buf + maxpacket;
+   int len = 0;                 // Packet so far
+   int sent = 0;
+   uint8_t busy = 0;            // Bulk queue backed up, stop slice
+   void send(void) {
+      if (!len)
+         return;
+      buf[len++] = '}';
+      buf[len] = 0;
+      revk_mqtt_send_payload_clients(prefixsetting, 0, NULL, buf, 1);
+      len = 0;
+      sent++;
+#ifdef	CONFIG_REVK_MQTT
+      busy = revk_queue_bulk();
+#endif
+   }
+   int add(const char *e, int l) {      // Add "tag":value to packet, sending first if it would not fit
+      if (len && len + l + 3 > maxpacket)
+         send();
+      if (len + l + 3 > maxpacket)
+         return 0;
+      buf[len] = (len ? ',' : '{');
+      len++;
+      memcpy(buf + len, e, l);
+      len += l;
+      return 1;
+   }
    const char *hasdef(setting_t * s) {
-      const char *d = s->defval;
+      const char *d = s->dv;
       if (!d)
          return NULL;
-      if (s->flags & SETTING_BITFIELD)
-      {
-         while (*d && *d != ' ')
-            d++;
-         if (*d == ' ')
-            d++;
-      }
       if (!*d)
          return NULL;
-      if ((s->flags & SETTING_BOOLEAN) && !strchr("YytT1", *d))
+      if ((s->def->flags & SETTING_BOOLEAN) && !strchr("YytT1", *d))
          return NULL;
-      if (s->size && !strcmp(d, "0"))
+      if (s->def->size && !strcmp(d, "0"))
          return NULL;
       return d;
    }
    int isempty(setting_t * s, int n) {  // Check empty
-      if (s->flags & SETTING_BOOLEAN)
+      if (s->def->flags & SETTING_BOOLEAN)
       {                         // This is basically testing it is false
          uint64_t v = 0;
-         if (s->size == 1)
-            v = *(uint8_t *) s->data;
-         else if (s->size == 2)
-            v = *(uint16_t *) s->data;
-         else if (s->size == 4)
-            v = *(uint32_t *) s->data;
-         else if (s->size == 8)
-            v = *(uint64_t *) s->data;
+         if (s->def->size == 1)
+            v = *(uint8_t *) s->def->data;
+         else if (s->def->size == 2)
+            v = *(uint16_t *) s->def->data;
+         else if (s->def->size == 4)
+            v = *(uint32_t *) s->def->data;
+         else if (s->def->size == 8)
+            v = *(uint64_t *) s->def->data;
          if (v & (1ULL << n))
             return 0;
          return 1;              // Empty bool
       }
-      void *data = s->data + (s->size ? : sizeof(void *)) * n;
-      int q = s->size;
+      void *data = s->def->data + (s->def->size ? : sizeof(void *)) * n;
+      int q = s->def->size;
       if (!q)
       {
          char *p = *(char **) data;
@@ -2632,58 +4586,53 @@ static const char *revk_setting_dump(void)
          return 3;              // Empty value
       return 0;
    }
-   setting_t *s;
-   for (s = setting; s; s = s->next)
+   setting_t *s = setting;
+   if (after)
+   {                            // Resume
+      int index;
+      setting_t *a = setting_lookup(after, &index);
+      if (a)
+         s = a->next;
+   }
+   int changed(setting_t * s) {
+      if (s->gen > since)
+         return 1;
+      for (setting_t * q = s->kids; q; q = q->sibling)
+         if (q->gen > since)
+            return 1;
+      return 0;
+   }
+   for (; s; s = s->next)
    {
-      if ((!(s->flags & SETTING_SECRET) || s->parent) && !s->child)
+      if ((!(s->def->flags & SETTING_SECRET) || s->parent) && !s->child && (!since || changed(s)))
       {
          int max = 0;
-         if (s->array)
+         if (s->def->array)
          {                      // Work out m - for now, parent items in arrays have to be set for rest to be output - this is the rule...
-            max = s->array;
-            if (!(s->flags & SETTING_BOOLEAN))
+            max = s->def->array;
+            if (!(s->def->flags & SETTING_BOOLEAN))
                while (max && isempty(s, max - 1))
                   max--;
          }
          jo_t p = NULL;
-         void start(void) {
-            if (!p)
-            {
-               if (j)
-                  p = jo_copy(j);
-               else
-               {
-                  p = jo_create_mem(buf, maxpacket);
-                  jo_object(p, NULL);
-               }
-            }
-         }
-         const char *failed(void) {
-            err = NULL;
-            if (p && (err = jo_error(p, NULL)))
-               jo_free(&p);     // Did not fit
-            return err;
-         }
          void addvalue(setting_t * s, const char *tag, int n) { // Add a value
-            start();
-            void *data = s->data;
-            const char *defval = s->defval ? : "";
-            if (!(s->flags & SETTING_BOOLEAN))
-               data += (s->size ? : sizeof(void *)) * n;
-            if (s->flags & SETTING_BINDATA)
+            void *data = s->def->data;
+            if (!(s->def->flags & SETTING_BOOLEAN))
+               data += (s->def->size ? : sizeof(void *)) * n;
+            if (s->def->flags & SETTING_BINDATA)
             {                   // Binary data
-               int len = s->size;
+               int len = s->def->size;
                if (!len)
                {                // alloc'd with len at start
                   revk_bindata_t *d = *(void **) data;
                   len = d->len;
                   data = d->data;
                }
-               if (s->flags & SETTING_HEX)
+               if (s->def->flags & SETTING_HEX)
                   jo_base16(p, tag, data, len);
                else
                   jo_base64(p, tag, data, len);
-            } else if (!s->size)
+            } else if (!s->def->size)
             {
                char *v = *(char **) data;
                if (v)
@@ -2694,39 +4643,34 @@ static const char *revk_setting_dump(void)
             } else
             {
                uint64_t v = 0;
-               if (s->size == 1)
+               if (s->def->size == 1)
                   v = *(uint8_t *) data;
-               else if (s->size == 2)
+               else if (s->def->size == 2)
                   v = *(uint16_t *) data;
-               else if (s->size == 4)
+               else if (s->def->size == 4)
                   v = *(uint32_t *) data;
-               else if (s->size == 8)
+               else if (s->def->size == 8)
                   v = *(uint64_t *) data;
-               if (s->flags & SETTING_BOOLEAN)
+               if (s->def->flags & SETTING_BOOLEAN)
                {
                   jo_bool(p, tag, (v >> n) & 1);
                } else
                {                // numeric
                   char temp[100],
                   *t = temp;
-                  uint8_t bits = s->size * 8;
-                  if (s->flags & SETTING_SET)
+                  uint8_t bits = s->def->size * 8;
+                  if (s->def->flags & SETTING_SET)
                      bits--;
-                  if (!(s->flags & SETTING_SET) || ((v >> bits) & 1))
+                  if (!(s->def->flags & SETTING_SET) || ((v >> bits) & 1))
                   {
-                     if (s->flags & SETTING_BITFIELD)
-                     {
-                        while (*defval && *defval != ' ')
+                     if (s->def->flags & SETTING_BITFIELD)
+                        for (int i = 0; i < s->bitlen; i++)
                         {
                            bits--;
                            if ((v >> bits) & 1)
-                              *t++ = *defval;
-                           defval++;
+                              *t++ = s->def->defval[i];
                         }
-                        if (*defval == ' ')
-                           defval++;
-                     }
-                     if (s->flags & SETTING_SIGNED)
+                     if (s->def->flags & SETTING_SIGNED)
                      {
                         bits--;
                         if ((v >> bits) & 1)
@@ -2736,7 +4680,7 @@ static const char *revk_setting_dump(void)
                         }
                      }
                      v &= ((1ULL << bits) - 1);
-                     if (s->flags & SETTING_HEX)
+                     if (s->def->flags & SETTING_HEX)
                         t += sprintf(t, "%llX", v);
                      else if (bits)
                         t += sprintf(t, "%llu", v);
@@ -2750,114 +4694,114 @@ static const char *revk_setting_dump(void)
                   else
                      while (*t >= '0' && *t <= '9')
                         t++;
-                  if (t == temp || *t || (s->flags & SETTING_HEX))
+                  if (t == temp || *t || (s->def->flags & SETTING_HEX))
                      jo_string(p, tag, temp);
                   else
                      jo_lit(p, tag, temp);
                }
             }
          }
-         void addsub(setting_t * s, const char *tag, int n) {   // n is 0 based
+         int addsub(setting_t * s, const char *tag, int n) {    // n is 0 based, returns if added
             if (s->parent)
             {
                if (!tag || (!n && hasdef(s)) || !isempty(s, n))
                {
-                  start();
                   jo_object(p, tag);
-                  setting_t *q;
-                  for (q = setting; q; q = q->next)
-                     if (q->child && !strncmp(q->name, s->name, s->namelen))
-                        if ((!n && hasdef(q)) || !isempty(q, n))
-                           addvalue(q, q->name + s->namelen, n);
+                  for (setting_t * q = s->kids; q; q = q->sibling)
+                     if ((!n && hasdef(q)) || !isempty(q, n))
+                        addvalue(q, q->def->name + s->def->namelen, n);
+                     else if (since && q->gen > since && !s->def->array)
+                        jo_null(p, q->def->name + s->def->namelen);     // Changed to empty
                   jo_close(p);
+                  return 1;
                }
-            } else
-               addvalue(s, tag, n);
+               return 0;
+            }
+            addvalue(s, tag, n);
+            return 1;
          }
-         void addsetting(void) {        // Add a whole setting
+         void addsetting(void) {        // Add a whole setting, if changed since and now empty then null
             if (s->parent)
             {
-               if (s->array)
+               if (s->def->array)
                {                // Array above
                   if (max || hasdef(s))
                   {
-                     start();
-                     jo_array(p, s->name);
+                     jo_array(p, s->def->name);
                      for (int n = 0; n < max; n++)
                         addsub(s, NULL, n);
                      jo_close(p);
+                     return;
                   }
-               } else
-                  addsub(s, s->name, 0);
-            } else if (s->array)
+               } else if (addsub(s, s->def->name, 0))
+                  return;
+            } else if (s->def->array)
             {
                if (max || hasdef(s))
                {
-                  start();
-                  jo_array(p, s->name);
+                  jo_array(p, s->def->name);
                   for (int n = 0; n < max; n++)
                      addvalue(s, NULL, n);
                   jo_close(p);
+                  return;
                }
             } else if (hasdef(s) || !isempty(s, 0))
-               addvalue(s, s->name, 0);
-         }
-         addsetting();
-         if (failed() && j)
-         {
-            send();             // Failed, clear what we were sending and try again
-            addsetting();
-         }
-         if (failed() && s->array)
-         {                      // Failed, but is an array, so try each setting individually
-            for (int n = 0; n < max; n++)
             {
-               char *tag;
-               asprintf(&tag, "%s%d", s->name, n + 1);
-               if (tag)
-               {
-                  addsub(s, tag, n);
-                  if (failed() && j)
-                  {
-                     send();    // Failed, clear what we were sending and try again
-                     addsub(s, tag, n);
-                  }
-                  if (!failed())
-                  {             // Fitted, move forward
-                     jo_free(&j);
-                     j = p;
-                  } else
-                  {
-                     jo_t j = jo_make(NULL);
-                     jo_string(j, "description", "Setting did not fit");
-                     jo_string(j, "setting", tag);
-                     if (err)
-                        jo_string(j, "reason", err);
-                     revk_error(TAG, &j);
-                  }
-                  freez(tag);
-               }
+               addvalue(s, s->def->name, 0);
+               return;
             }
+            if (since)
+               jo_null(p, s->def->name);
          }
-         if (!failed())
-         {                      // Fitted, move forward
-            if (p)
-            {
-               jo_free(&j);
-               j = p;
-            }
-         } else
-         {
+         const char *err = NULL;
+         char tag[20];
+         int make(int n) {      // Make entry, whole setting if n<0, else array entry n as tag, and add to packet
+            p = jo_create_mem(entry, maxpacket);
+            jo_object(p, NULL);
+            if (n < 0)
+               addsetting();
+            else
+               addsub(s, tag, n);
+            err = jo_error(p, NULL);
+            char *e = jo_finish(&p);
+            if (!e)
+               return 0;
+            int l = strlen(e);
+            if (l <= 2)
+               return 1;        // Nothing to add
+            return add(e + 1, l - 2);
+         }
+         void fit(const char *tag) {
             jo_t j = jo_make(NULL);
             jo_string(j, "description", "Setting did not fit");
-            jo_string(j, "setting", s->name);
+            jo_string(j, "setting", tag);
             if (err)
                jo_string(j, "reason", err);
             revk_error(TAG, &j);
          }
+         if (!make(-1))
+         {
+            if (s->def->array)
+            {                   // Did not fit, but is an array, so try each setting individually
+               for (int n = 0; n < max; n++)
+               {
+                  snprintf(tag, sizeof(tag), "%s%d", s->def->name, n + 1);
+                  if (!make(n))
+                     fit(tag);
+               }
+            } else
+               fit(s->def->name);
+         }
+         if (packets && (sent >= packets || busy) && s->next)
+         {                      // Enough for now
+            send();
+            free(buf);
+            return s->def->name;
+         }
       }
    }
    send();
+   free(buf);
    return NULL;
 }
 
@@ -2867,36 +4811,10 @@ const char *revk_setting(jo_t j)
    if (jo_here(j) != JO_OBJECT)
       return "Not an object";
    int index = 0;
-   int match(setting_t * s, const char *tag) {
-      const char *a = s->name;
-      const char *b = tag;
-      while (*a && *a == *b)
-      {
-         a++;
-         b++;
-      }
-      if (*a)
-         return 1;              /* not matched whole name, no match */
-      if (!*b)
-      {
-         index = 0;
-         return 0;              /* Match, no index */
-      }
-      if (!s->array && *b)
-         return 2;              /* not array, and more characters, no match */
-      int v = 0;
-      while (isdigit((int) (*b)))
-         v = v * 10 + (*b++) - '0';
-      if (*b)
-         return 3;              /* More on end after any digits, no match */
-      if (!v || v > s->array)
-         return 4;              /* Invalid index, no match */
-      index = v - 1;
-      return 0;                 /* Match, index */
-   }
    const char *er = NULL;
+   setting_txn_t *txn = NULL;   // Changes, applied at end if no errors
    jo_type_t t = jo_next(j);    // Start object
-   while (t == JO_TAG)
+   while (t == JO_TAG && !er)
    {
 #ifdef SETTING_DEBUG
       ESP_LOGI(TAG, "Setting: %.10s", jo_debug(j));
@@ -2911,8 +4829,7 @@ const char *revk_setting(jo_t j)
       {
          l = jo_strncpy(j, (char *) tag, l + 1);
          t = jo_next(j);        // the value
-         setting_t *s;
-         for (s = setting; s && match(s, tag); s = s->next);
+         setting_t *s = setting_lookup(tag, &index);
          if (!s)
          {
             ESP_LOGI(TAG, "Unknown %s %.20s", tag, jo_debug(j));
@@ -2921,13 +4838,8 @@ const char *revk_setting(jo_t j)
          } else
          {
             void store(setting_t * s) {
-               if (s->dup)
-                  for (setting_t * q = setting; q; q = q->next)
-                     if (!q->dup && q->data == s->data)
-                     {
-                        s = q;
-                        break;
-                     }
+               if (s->alias)
+                  s = s->alias;
 #ifdef SETTING_DEBUG
                if (s->array)
                   ESP_LOGI(TAG, "Store %s[%d] (type %d): %.20s", s->name, index, t, jo_debug(j));
@@ -2938,9 +4850,9 @@ const char *revk_setting(jo_t j)
                char *val = NULL;
                if (t == JO_NUMBER || t == JO_STRING || t >= JO_TRUE)
                {
-                  if (t == JO_STRING && (s->flags & SETTING_BINDATA))
+                  if (t == JO_STRING && (s->def->flags & SETTING_BINDATA))
                   {
-                     if (s->flags & SETTING_HEX)
+                     if (s->def->flags & SETTING_HEX)
                      {
                         l = jo_strncpy16(j, NULL, 0);
                         if (l)
@@ -2957,9 +4869,9 @@ const char *revk_setting(jo_t j)
                      if (l >= 0)
                         jo_strncpy(j, val = malloc(l + 1), l + 1);
                   }
-                  er = revk_setting_internal(s, l, (const unsigned char *) (val ? : ""), index, 0);
+                  er = revk_setting_internal(s, l, (const unsigned char *) (val ? : ""), index, 0, &txn);
                } else if (t == JO_NULL)
-                  er = revk_setting_internal(s, 0, NULL, index, 0);     // Factory
+                  er = revk_setting_internal(s, 0, NULL, index, 0, &txn);       // Factory
                else
                   er = "Bad data type";
                freez(val);
@@ -2970,27 +4882,26 @@ const char *revk_setting(jo_t j)
 #ifdef SETTING_DEBUG
                ESP_LOGI(TAG, "Zap %s[%d]", s->name, index);
 #endif
-               er = revk_setting_internal(s, 0, NULL, index, 0);        // Factory default
+               er = revk_setting_internal(s, 0, NULL, index, 0, &txn);  // Factory default
             }
             void storesub(void) {
                setting_t *q;
-               for (q = setting; q; q = q->next)
-                  if (q->child && q->namelen > s->namelen && !strncmp(s->name, q->name, s->namelen))
-                     q->used = 0;
+               for (q = s->kids; q; q = q->sibling)
+                  q->used = 0;
                t = jo_next(j);  // In to object
                while (t && t != JO_CLOSE && !er)
                {
                   if (t == JO_TAG)
                   {
                      int l2 = jo_strlen(j);
-                     char *tag2 = malloc(s->namelen + l2 + 1);
+                     char *tag2 = malloc(s->def->namelen + l2 + 1);
                      if (tag2)
                      {
-                        strcpy(tag2, s->name);
-                        jo_strncpy(j, (char *) tag2 + s->namelen, l2 + 1);
+                        strcpy(tag2, s->def->name);
+                        jo_strncpy(j, (char *) tag2 + s->def->namelen, l2 + 1);
                         t = jo_next(j); // To value
-                        for (q = setting; q && (!q->child || strcmp(q->name, tag2)); q = q->next);
-                        if (!q)
+                        q = setting_find(tag2, s->def->namelen + l2);
+                        if (!q || !q->child)
                         {
                            ESP_LOGI(TAG, "Unknown %s %.20s", tag2, jo_debug(j));
                            er = "Unknown setting";
@@ -3004,8 +4915,8 @@ const char *revk_setting(jo_t j)
                   }
                   t = jo_skip(j);
                }
-               for (q = setting; q; q = q->next)
-                  if (!q->used && q->child && q->namelen > s->namelen && !strncmp(s->name, q->name, s->namelen))
+               for (q = s->kids; q; q = q->sibling)
+                  if (!q->used)
                      zap(q);
             }
             if (t == JO_OBJECT)
@@ -3016,12 +4927,12 @@ const char *revk_setting(jo_t j)
                   storesub();
             } else if (t == JO_ARRAY)
             {
-               if (!s->array)
+               if (!s->def->array)
                   er = "Not an array";
                else
                {
                   t = jo_next(j);       // In to array
-                  while (index < s->array && t != JO_CLOSE && !er)
+                  while (index < s->def->array && t != JO_CLOSE && !er)
                   {
                      if (t == JO_OBJECT)
                         storesub();
@@ -3032,13 +4943,11 @@ const char *revk_setting(jo_t j)
                      t = jo_next(j);
                      index++;
                   }
-                  while (index < s->array)
+                  while (index < s->def->array)
                   {
                      zap(s);
-                     if (s->parent)
-                        for (setting_t * q = setting; q; q = q->next)
-                           if (q->child && q->namelen > s->namelen && !strncmp(s->name, q->name, s->namelen))
-                              zap(q);
+                     for (setting_t * q = s->kids; q; q = q->sibling)
+                        zap(q);
                      index++;
                   }
                }
@@ -3049,6 +4958,19 @@ const char *revk_setting(jo_t j)
          freez(tag);
       }
    }
+   if (er)
+      setting_txn_free(&txn);   // All or nothing
+   else if (txn)
+   {
+      jo_t c = jo_object_alloc();
+      jo_array(c, "changed");
+      er = setting_txn_commit(&txn, c);
+      jo_close(c);
+      if (er)
+         jo_free(&c);
+      else
+         revk_info("setting", &c);
+   }
    return er ? : "";
 }
 
@@ -3096,62 +5018,164 @@ static const char *revk_upgrade(const char *target, jo_t j)
    return "";
 }
 
-const char *revk_command(const char *tag, jo_t j)
+// Command table, hashed by name
+#define	COMMAND_HASH	32
+typedef struct revk_cmd_s revk_cmd_t;
+struct revk_cmd_s
 {
-   if (!tag || !*tag)
-      return "No command";
-   ESP_LOGD(TAG, "MQTT command [%s]", tag);
-   const char *e = NULL;
-   /* My commands */
-   if (!e && !strcmp(tag, "upgrade"))
-      e = revk_upgrade(NULL, j);        // Called internally maybe
-   if (!e && !strcmp(tag, "status"))
+   revk_cmd_t *next;
+   const char *name;
+   revk_command_t *handler;
+   const char *schema;          // Hint for payload, listed by commands command
+   uint8_t flags;
+   uint32_t calls;              // Times called
+   uint32_t us;                 // Total time (us)
+   uint32_t max;                // Longest time (us)
+};
+static revk_cmd_t *command_hash[COMMAND_HASH] = { };
+
+static uint32_t command_hashn(const char *name)
+{                               // FNV-1a
+   uint32_t h = 2166136261;
+   while (*name)
+      h = (h ^ (uint8_t) * name++) * 16777619;
+   return h % COMMAND_HASH;
+}
+
+void revk_register_command(const char *name, revk_command_t * handler, uint8_t flags, const char *schema)
+{                               /* Register command (not expected to be thread safe, should be called from init) */
+   uint32_t h = command_hashn(name);
+   revk_cmd_t *c = command_hash[h];
+   while (c && strcmp(c->name, name))
+      c = c->next;
+   if (c)
+      ESP_LOGI(TAG, "Command %s replaced", name);       // Later registration of same name takes precedence
+   else
    {
-      up_next = 0;
-      e = "";
-   }
-   if (!e && watchdogtime && !strcmp(tag, "watchdog"))
-   {                            /* Test watchdog */
-      wdt_test = 1;
-      return "";
-   }
-   if (!e && !strcmp(tag, "restart"))
-      e = revk_restart("Restart command", 3);
-   if (!e && !strcmp(tag, "factory"))
-   {
-      char val[256];
-      if (jo_strncpy(j, val, sizeof(val)) < 0)
-         *val = 0;
-      if (strncmp(val, revk_id, strlen(revk_id)))
-         return "Bad ID";
-      if (strcmp(val + strlen(revk_id), appname))
-         return "Bad appname";
-      esp_err_t e = nvs_flash_erase();
-      if (!e)
-         e = nvs_flash_erase_partition(TAG);
-      if (!e)
-         revk_restart("Factory reset", 3);
-      return "";
-   }
-#ifdef	CONFIG_REVK_MESH
-   if (!e && !strcmp(tag, "mesh"))
-   {                            // Update mesh if we are root
-      // esp_mesh_switch_channel(const uint8_t *new_bssid, int csa_newchan, int csa_count)
+      if (!(c = malloc(sizeof(*c))))
+         return;
+      memset(c, 0, sizeof(*c));
+      c->name = name;
+      c->next = command_hash[h];
+      command_hash[h] = c;
    }
+   c->handler = handler;
+   c->flags = flags;
+   c->schema = schema;
+}
+
+static const char *command_status(const char *tag, jo_t j)
+{
+   up_next = 0;
+   return "";
+}
+
+static const char *command_watchdog(const char *tag, jo_t j)
+{                               /* Test watchdog */
+   if (!watchdogtime)
+      return NULL;
+   wdt_test = 1;
+   return "";
+}
+
+static const char *command_restart(const char *tag, jo_t j)
+{
+   return revk_restart("Restart command", 3);
+}
+
+static const char *command_factory(const char *tag, jo_t j)
+{
+   char val[256];
+   if (jo_strncpy(j, val, sizeof(val)) < 0)
+      *val = 0;
+   if (strncmp(val, revk_id, strlen(revk_id)))
+      return "Bad ID";
+   if (strcmp(val + strlen(revk_id), appname))
+      return "Bad appname";
+   esp_err_t e = nvs_flash_erase();
+   if (!e)
+      e = nvs_flash_erase_partition(TAG);
+   if (!e)
+      revk_restart("Factory reset", 3);
+   return "";
+}
+
+#ifdef	CONFIG_REVK_APCONFIG
+static const char *command_apconfig(const char *tag, jo_t j)
+{
+   if (ap_task_id)
+      return NULL;
+   ap_task_id = revk_task("AP", ap_task, NULL);
+   return "";
+}
 #endif
+
+static const char *command_commands(const char *tag, jo_t j)
+{                               // List commands
+   jo_t i = jo_object_alloc();
+   for (int h = 0; h < COMMAND_HASH; h++)
+      for (revk_cmd_t * c = command_hash[h]; c; c = c->next)
+         if (!(c->flags & REVK_COMMAND_HIDE))
+         {
+            jo_object(i, c->name);
+            if (c->schema)
+               jo_string(i, "schema", c->schema);
+            uint32_t calls = __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+            if (calls)
+            {
+               jo_int(i, "calls", calls);
+               jo_int(i, "us", __atomic_load_n(&c->us, __ATOMIC_RELAXED) / calls);
+               jo_int(i, "max", __atomic_load_n(&c->max, __ATOMIC_RELAXED));
+            }
+            jo_close(i);
+         }
+   revk_info("commands", &i);
+   return "";
+}
+
+static void revk_register_commands(void)
+{                               // Our commands
+   revk_register_command("status", command_status, 0, NULL);
+   revk_register_command("watchdog", command_watchdog, 0, NULL);
+   revk_register_command("restart", command_restart, 0, NULL);
+   revk_register_command("factory", command_factory, REVK_COMMAND_ARG, "\"IDappname\"");
 #ifdef	CONFIG_REVK_APCONFIG
-   if (!e && !strcmp(tag, "apconfig") && !ap_task_id)
-   {
-      ap_task_id = revk_task("AP", ap_task, NULL);
-      return "";
-   }
+   revk_register_command("apconfig", command_apconfig, 0, NULL);
 #endif
+   revk_register_command("commands", command_commands, 0, NULL);
+}
+
+const char *revk_command(const char *tag, jo_t j)
+{
+   if (!tag || !*tag)
+      return "No command";
+   ESP_LOGD(TAG, "MQTT command [%s]", tag);
+   revk_cmd_t *c;
+   for (c = command_hash[command_hashn(tag)]; c && strcmp(c->name, tag); c = c->next);
+   if (!c)
+      return NULL;              // Not ours, may be for app
+   if ((c->flags & REVK_COMMAND_ARG) && (!j || jo_here(j) == JO_END || jo_here(j) == JO_NULL))
+      return "Missing argument";
+   int64_t start = esp_timer_get_time();
+   const char *e = c->handler(tag, j);
+   uint32_t us = esp_timer_get_time() - start;
+   __atomic_add_fetch(&c->calls, 1, __ATOMIC_RELAXED);        // Workers may run commands at once
+   __atomic_add_fetch(&c->us, us, __ATOMIC_RELAXED);
+   uint32_t max = __atomic_load_n(&c->max, __ATOMIC_RELAXED);
+   while (us > max && !__atomic_compare_exchange_n(&c->max, &max, us, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
    return e;
 }
 
-void revk_register(const char *name, uint8_t array, uint16_t size, void *data, const char *defval, uint8_t flags)
-{                               /* Register setting (not expected to be thread safe, should be called from init) */
+static void setting_register(setting_t * s, const revk_setting_def_t * d)
+{                               // Register setting, s is zeroed
+   const char *name = d->name;
+   uint8_t array = d->array;
+   uint16_t size = d->size;
+   void *data = d->data;
+   const char *defval = d->defval;
+   uint8_t flags = d->flags;
    ESP_LOGD(TAG, "Register %s", name);
+   s->dv = defval;
    if (flags & SETTING_BITFIELD)
    {
       if (!defval)
@@ -3159,49 +5183,59 @@ void revk_register(const char *name, uint8_t array, uint16_t size, void *data, c
       else if (!size)
          ESP_LOGE(TAG, "%s missing size on bitfield", name);
       else
-      {
+      {                         // Work out bitfield once, flag characters are defval[0..bitlen-1], top bit first
          const char *p = defval;
          while (*p && *p != ' ')
             p++;
          if ((p - defval) > 8 * size - ((flags & SETTING_SET) ? 1 : 0))
             ESP_LOGE(TAG, "%s too small for bitfield", name);
+         s->bitlen = p - defval;
+         if (*p == ' ')
+            p++;
+         s->dv = p;
       }
    }
-   setting_t *s;
-   for (s = setting; s && strcmp(s->name, name); s = s->next);
-   if (s)
+   int namelen = d->namelen;
+   if (setting_find(name, namelen))
       ESP_LOGE(TAG, "%s duplicate", name);
-   s = malloc(sizeof(*s));
-   memset(s, 0, sizeof(*s));
+   s->def = d;
    s->nvs = nvs;
-   s->name = name;
-   s->namelen = strlen(name);
-   s->array = array;
-   s->size = size;
-   s->data = data;
-   s->flags = flags;
-   s->defval = defval;
    s->next = setting;
    {                            // Check if sub setting - parent must be set first, and be secret and same array size
-      setting_t *q;
-      for (q = setting; q && (q->namelen >= s->namelen || strncmp(q->name, name, q->namelen) || !(q->flags & SETTING_SECRET) || q->array != array); q = q->next);
+      setting_t *q = NULL;
+      for (int l = namelen - 1; l > 0 && !q; l--)
+         if ((q = setting_find(name, l)) && (!(q->def->flags & SETTING_SECRET) || q->def->array != array))
+            q = NULL;
       if (q)
       {
          s->child = 1;
          q->parent = 1;
-         if (s->data == q->data)
+         s->sibling = q->kids;
+         q->kids = s;
+         if (s->def->data == q->def->data)
+         {
             q->dup = 1;
+            q->alias = s;
+            if (!size)
+               for (int i = 0; i < (array ? : 1); i++)
+                  freez(((void **) data)[i]);   // Parent set it, we are loading it again
+         }
       }
    }
    setting = s;
+   {
+      uint32_t h = setting_hashn(name, namelen);
+      s->hnext = setting_hash[h];
+      setting_hash[h] = s;
+   }
    memset(data, 0, (size ? : sizeof(void *)) * (!(flags & SETTING_BOOLEAN) && array ? array : 1));      /* Initialise memory */
    /* Get value */
    int get_val(const char *tag, int index) {
-      void *data = s->data;
-      if (s->array && !(flags & SETTING_BOOLEAN))
-         data += (s->size ? : sizeof(void *)) * index;
+      void *data = s->def->data;
+      if (s->def->array && !(flags & SETTING_BOOLEAN))
+         data += (s->def->size ? : sizeof(void *)) * index;
       int l = -1;
-      if (!s->size)
+      if (!s->def->size)
       {                         /* Dynamic */
          void *d = NULL;
          l = nvs_get(s, tag, NULL, 0);
@@ -3213,7 +5247,7 @@ void revk_register(const char *name, uint8_t array, uint16_t size, void *data, c
          } else
             l = -1;             /* default */
       } else
-         l = nvs_get(s, tag, data, s->size);    /* Stored static */
+         l = nvs_get(s, tag, data, s->def->size);    /* Stored static */
       return l;
    }
    const char *e;
@@ -3223,25 +5257,68 @@ void revk_register(const char *name, uint8_t array, uint16_t size, void *data, c
       for (i = 0; i < array; i++)
       {
          char tag[16];          /* NVS tag size */
-         if (snprintf(tag, sizeof(tag), "%s%u", s->name, i + 1) < sizeof(tag) && get_val(tag, i) < 0)
+         if (snprintf(tag, sizeof(tag), "%s%u", s->def->name, i + 1) < sizeof(tag) && get_val(tag, i) < 0)
          {
-            e = revk_setting_internal(s, 0, NULL, i, SETTING_LIVE);     /* Defaulting logic */
+            e = revk_setting_internal(s, 0, NULL, i, SETTING_LIVE, NULL);       /* Defaulting logic */
             if (e && *e)
                ESP_LOGE(TAG, "Setting %s failed %s", tag, e);
             else
                ESP_LOGD(TAG, "Setting %s created", tag);
          }
       }
-   } else if (get_val(s->name, 0) < 0)
+   } else if (get_val(s->def->name, 0) < 0)
    {                            /* Simple setting, not array */
-      e = revk_setting_internal(s, 0, NULL, 0, SETTING_LIVE);   /* Defaulting logic */
+      e = revk_setting_internal(s, 0, NULL, 0, SETTING_LIVE, NULL);     /* Defaulting logic */
       if (e && *e)
-         ESP_LOGE(TAG, "Setting %s failed %s", s->name, e);
+         ESP_LOGE(TAG, "Setting %s failed %s", s->def->name, e);
       else
-         ESP_LOGD(TAG, "Setting %s created", s->name);
+         ESP_LOGD(TAG, "Setting %s created", s->def->name);
    }
 }
 
+void revk_register(const char *name, uint8_t array, uint16_t size, void *data, const char *defval, uint8_t flags)
+{                               /* Register setting (not expected to be thread safe, should be called from init) */
+   struct
+   {
+      setting_t s;
+      revk_setting_def_t d;
+   } *r = malloc(sizeof(*r));   // One allocation, descriptor not const
+   if (!r)
+      return;
+   memset(r, 0, sizeof(*r));
+   r->d.name = name;
+   r->d.defval = defval;
+   r->d.data = data;
+   r->d.size = size;
+   r->d.array = array;
+   r->d.flags = flags;
+   r->d.namelen = strlen(name);
+   setting_register(&r->s, &r->d);
+}
+
+void revk_register_table(const revk_setting_def_t * d, int count)
+{                               // Register table of settings (not expected to be thread safe, should be called from init)
+   setting_t *s = malloc(sizeof(*s) * count);   // One allocation for all
+   if (!s)
+      return;
+   memset(s, 0, sizeof(*s) * count);
+   for (int i = 0; i < count; i++)
+      setting_register(s + i, d + i);
+}
+
+const char *revk_setting_watch(const char *name, revk_setting_changed_t * handler)
+{                               // Set change handler (not expected to be thread safe, should be called from init)
+   setting_t *s = setting_find(name, strlen(name));
+   if (!s)
+      return "Unknown setting";
+   if (!(s->def->flags & SETTING_LIVE) && !s->parent)
+      ESP_LOGW(TAG, "%s not live, changes restart", name);
+   s->changed = handler;
+   for (setting_t * q = s->kids; q; q = q->sibling)
+      q->changed = handler;     // Parent watches all children
+   return NULL;
+}
+
 #if CONFIG_LOG_DEFAULT_LEVEL > 2
 esp_err_t revk_err_check(esp_err_t e, const char *file, int line, const char *func, const char *cmd)
 {
@@ -0,0 +1,129 @@
+// Settings epoch stress test: readers check a dynamic setting while a writer replaces it and old values are reclaimed
+// Built with AddressSanitizer, so a value freed while a reader has it is reported as a use after free
+#include "revk.c"
+#include <pthread.h>
+
+#define	RUN	6               // Seconds
+#define	READERS	4
+#define	VLEN	31              // Value is VLEN copies of one letter
+
+static char *value = NULL;
+static setting_t *vs = NULL;
+static volatile int stop = 0;
+static volatile uint32_t reads = 0,
+    writes = 0,
+    bad = 0;
+
+static void check(const char *v)
+{
+   for (int i = 0; i < VLEN; i++)
+      if (v[i] != v[0])
+      {
+         __atomic_add_fetch(&bad, 1, __ATOMIC_RELAXED);
+         return;
+      }
+   if (v[VLEN])
+      __atomic_add_fetch(&bad, 1, __ATOMIC_RELAXED);
+}
+
+static void *reader(void *arg)
+{                               // Fast readers
+   while (!stop)
+   {
+      int e = revk_setting_read_begin();
+      const char *v = __atomic_load_n(&value, __ATOMIC_ACQUIRE);
+      check(v);
+      usleep(random() % 100);
+      check(v);
+      revk_setting_read_end(e);
+      __atomic_add_fetch(&reads, 1, __ATOMIC_RELAXED);
+   }
+   return NULL;
+}
+
+static void *slow(void *arg)
+{                               // Holds a value for longer than SETTING_GRACE, so only the epoch keeps it
+   while (!stop)
+   {
+      int e = revk_setting_read_begin();
+      const char *v = __atomic_load_n(&value, __ATOMIC_ACQUIRE);
+      check(v);
+      sleep(SETTING_GRACE + 1);
+      check(v);
+      revk_setting_read_end(e);
+      __atomic_add_fetch(&reads, 1, __ATOMIC_RELAXED);
+   }
+   return NULL;
+}
+
+static void *writer(void *arg)
+{
+   while (!stop)
+   {
+      char *n = malloc(VLEN + 1);
+      memset(n, 'a' + writes % 26, VLEN);
+      n[VLEN] = 0;
+      setting_live(vs, vs->def->data, (unsigned char *) n, VLEN + 1, 0, NULL);
+      __atomic_add_fetch(&writes, 1, __ATOMIC_RELAXED);
+      usleep(200);
+   }
+   return NULL;
+}
+
+static void *reclaimer(void *arg)
+{                               // As revk_task does every second, but more often
+   while (!stop)
+   {
+      setting_reclaim();
+      usleep(10000);
+   }
+   return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+   setvbuf(stdout, NULL, _IOLBF, 0);    // Sanitizer reports exit without flushing
+   host_nvs_reset();
+   revk_boot(NULL);
+   revk_register("stress", 0, 0, &value, "start", 0);
+   vs = setting_find("stress", 6);
+   if (!vs || !value)
+   {
+      printf("Setting not registered\n");
+      return 1;
+   }
+   char *n = malloc(VLEN + 1);
+   memset(n, 'z', VLEN);
+   n[VLEN] = 0;
+   setting_live(vs, vs->def->data, (unsigned char *) n, VLEN + 1, 0, NULL);
+   pthread_t t[READERS + 3];
+   int c = 0;
+   for (int i = 0; i < READERS; i++)
+      pthread_create(&t[c++], NULL, reader, NULL);
+   pthread_create(&t[c++], NULL, slow, NULL);
+   pthread_create(&t[c++], NULL, writer, NULL);
+   pthread_create(&t[c++], NULL, reclaimer, NULL);
+   sleep(RUN);
+   stop = 1;
+   for (int i = 0; i < c; i++)
+      pthread_join(t[i], NULL);
+   int held = 0;
+   for (setting_old_t * o = setting_old; o; o = o->next)
+      held++;
+   printf("%u reads, %u writes, %d old values held at end, %u bad reads\n", reads, writes, held, bad);
+   for (int i = 0; i < SETTING_GRACE + 2 && setting_old; i++)
+   {                            // No readers now, so everything goes after two epochs and the grace time
+      setting_reclaim();
+      sleep(1);
+      setting_reclaim();
+   }
+   if (setting_old)
+   {
+      printf("Old values not reclaimed\n");
+      return 1;
+   }
+   if (bad || !writes || !reads)
+      return 1;
+   printf("OK\n");
+   return 0;
+}
@@ -0,0 +1,86 @@
+// Settings index benchmark: registering and looking up n settings, and applying a 50 key message, should scale linearly with n
+#include "revk.c"
+#include <sys/wait.h>
+
+#define	KEYS	50              // Keys in the applied message
+
+static int64_t t0;
+
+static void start(void)
+{
+   host_nvs_zero();
+   t0 = esp_timer_get_time();
+}
+
+static void report(int n, const char *what, int ops)
+{
+   int64_t us = esp_timer_get_time() - t0;
+   host_nvs_stats_t *s = host_nvs();
+   printf("%4d %-10s %8lldus %7.3fus/op  nvs get %5u set %5u commit %2u\n", n, what, (long long) us, (double) us / ops, s->get, s->set, s->commit);
+}
+
+static void run(int n)
+{                               // n app settings, a quarter of them 8 element arrays
+   host_nvs_reset();
+   revk_boot(NULL);
+   char **name = malloc(n * sizeof(*name));
+   uint8_t *data = malloc(n * 8);
+   start();
+   for (int i = 0; i < n; i++)
+   {
+      asprintf(&name[i], "app%d", i);
+      revk_register(name[i], (i & 3) ? 0 : 8, 1, data + i * 8, "1", 0);
+   }
+   report(n, "register", n);
+   snap_done();
+   int hits = 0;
+   start();
+   for (int r = 0; r < 100; r++)
+      for (int i = 0; i < n; i++)
+      {
+         char tag[16];
+         int index = 0;
+         snprintf(tag, sizeof(tag), (i & 3) ? "%s" : "%s8", name[i]);
+         if (setting_lookup(tag, &index))
+            hits++;
+      }
+   report(n, "lookup", 100 * n);
+   if (hits != 100 * n)
+      printf("  lookup found %d of %d\n", hits, 100 * n);
+   char *json = NULL;
+   size_t len = 0;
+   FILE *f = open_memstream(&json, &len);
+   for (int k = 0; k < KEYS; k++)
+      fprintf(f, "%c\"%s\":%s", k ? ',' : '{', name[(k * n) / KEYS], ((k * n) / KEYS & 3) ? "2" : "[2,2,2,2,2,2,2,2]");
+   fprintf(f, "}");
+   fclose(f);
+   jo_t j = jo_parse_str(json);
+   start();
+   const char *er = revk_setting(j);
+   report(n, "apply", KEYS);
+   if (er && *er)
+      printf("  apply error: %s\n", er);
+   jo_free(&j);
+   free(json);
+}
+
+int main(int argc, char *argv[])
+{
+   int sizes[] = { 50, 150, 450 };
+   for (int s = 0; s < sizeof(sizes) / sizeof(*sizes); s++)
+   {
+      fflush(stdout);
+      pid_t p = fork();
+      if (!p)
+      {
+         run(sizes[s]);
+         fflush(stdout);
+         _exit(0);
+      }
+      int status;
+      waitpid(p, &status, 0);
+      if (!WIFEXITED(status) || WEXITSTATUS(status))
+         return 1;
+   }
+   return 0;
+}
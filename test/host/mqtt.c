@@ -0,0 +1,209 @@
+// Host stand-in for lwmqtt, a broker that counts and optionally captures what is published
+#include "host.h"
+#include "lwmqtt.h"
+
+struct lwmqtt_s
+{
+   host_mqtt_stats_t stats;
+   int refuse;                  // Refuse sends, as if the connection is stalled
+   int noack;                   // Hold QoS 1 sends unacknowledged
+   int pending;                 // Unacknowledged
+   struct
+   {
+      lwmqtt_done_t *done;
+      void *arg;
+   } inflight[16];
+};
+
+struct lwmqtt_msg_s
+{
+   int refs;
+   int tlen;
+   int plen;
+   char retain;
+   unsigned char data[];        // Topic then payload
+};
+
+host_mqtt_hook_t *host_mqtt_hook = NULL;
+
+uint32_t uptime(void)
+{
+   static int64_t start = 0;
+   int64_t now = esp_timer_get_time();
+   if (!start)
+      start = now;
+   return (now - start) / 1000000 + 1;
+}
+
+lwmqtt_t host_mqtt_new(void)
+{
+   return calloc(1, sizeof(struct lwmqtt_s));
+}
+
+host_mqtt_stats_t *host_mqtt_stats(lwmqtt_t h)
+{
+   return &h->stats;
+}
+
+void host_mqtt_refuse(lwmqtt_t h, int refuse)
+{
+   h->refuse = refuse;
+}
+
+void host_mqtt_noack(lwmqtt_t h, int noack)
+{
+   h->noack = noack;
+}
+
+void host_mqtt_close(lwmqtt_t h)
+{                               // As lwmqtt handle_free, oldest first
+   for (int i = 0; i < h->pending; i++)
+      if (h->inflight[i].done)
+         h->inflight[i].done(h->inflight[i].arg, "Closed");
+   h->pending = 0;
+}
+
+lwmqtt_t lwmqtt_client(lwmqtt_client_config_t * c)
+{
+   return host_mqtt_new();
+}
+
+void lwmqtt_end(lwmqtt_t * h)
+{
+   free(*h);
+   *h = NULL;
+}
+
+const char *lwmqtt_subscribeub(lwmqtt_t h, const char *topic, char unsubscribe)
+{
+   return h ? NULL : "No handle";
+}
+
+const char *lwmqtt_subscribeub_multi(lwmqtt_t h, int count, const char *const *topics, char unsubscribe)
+{
+   return h ? NULL : "No handle";
+}
+
+static const char *publish(lwmqtt_t h, int tlen, const char *topic, int plen, const unsigned char *payload)
+{
+   if (!h)
+      return "No handle";
+   if (h->refuse)
+   {
+      h->stats.refused++;
+      return "Refused";
+   }
+   h->stats.sent++;
+   h->stats.bytes += tlen + plen;
+   if (host_mqtt_hook)
+      host_mqtt_hook(h, tlen, topic, plen, payload);
+   return NULL;
+}
+
+const char *lwmqtt_send_full(lwmqtt_t h, int tlen, const char *topic, int plen, const unsigned char *payload, char retain)
+{
+   if (tlen < 0)
+      tlen = strlen(topic);
+   if (plen < 0)
+      plen = strlen((char *) payload);
+   return publish(h, tlen, topic, plen, payload);
+}
+
+const char *lwmqtt_send_qos1(lwmqtt_t h, int tlen, const char *topic, int plen, const unsigned char *payload, char retain, lwmqtt_done_t * done, void *arg)
+{
+   if (h && h->noack && h->pending >= sizeof(h->inflight) / sizeof(*h->inflight))
+      return "In flight window full";
+   const char *er = lwmqtt_send_full(h, tlen, topic, plen, payload, retain);
+   if (er)
+      return er;
+   if (h->noack)
+   {
+      h->inflight[h->pending].done = done;
+      h->inflight[h->pending].arg = arg;
+      h->pending++;
+   } else if (done)
+      done(arg, NULL);          // PUBACK at once
+   return NULL;
+}
+
+lwmqtt_msg_t *lwmqtt_msg(int tlen, const char *topic, int plen, const unsigned char *payload, char retain)
+{
+   if (tlen < 0)
+      tlen = strlen(topic);
+   if (plen < 0)
+      plen = strlen((char *) payload);
+   lwmqtt_msg_t *m = malloc(sizeof(*m) + tlen + plen);
+   if (!m)
+      return NULL;
+   m->refs = 1;
+   m->tlen = tlen;
+   m->plen = plen;
+   m->retain = retain;
+   memcpy(m->data, topic, tlen);
+   memcpy(m->data + tlen, payload, plen);
+   return m;
+}
+
+lwmqtt_msg_t *lwmqtt_msg_hold(lwmqtt_msg_t * m)
+{
+   __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+   return m;
+}
+
+void lwmqtt_msg_release(lwmqtt_msg_t ** mp)
+{
+   lwmqtt_msg_t *m = *mp;
+   *mp = NULL;
+   if (m && !__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL))
+      free(m);
+}
+
+int lwmqtt_msg_topic(lwmqtt_msg_t * m, const char **topic)
+{
+   *topic = (char *) m->data;
+   return m->tlen;
+}
+
+int lwmqtt_msg_payload(lwmqtt_msg_t * m, const unsigned char **payload)
+{
+   *payload = m->data + m->tlen;
+   return m->plen;
+}
+
+const char *lwmqtt_send_msg(lwmqtt_t h, lwmqtt_msg_t * m, char retain, char qos)
+{
+   return publish(h, m->tlen, (char *) m->data, m->plen, m->data + m->tlen);
+}
+
+const char *lwmqtt_send_msg_qos1(lwmqtt_t h, lwmqtt_msg_t * m, char retain, lwmqtt_done_t * done, void *arg)
+{
+   return lwmqtt_send_qos1(h, m->tlen, (char *) m->data, m->plen, m->data + m->tlen, retain, done, arg);
+}
+
+const char *lwmqtt_send_str(lwmqtt_t h, const char *msg)
+{
+   const char *p = msg;
+   while (*p && *p != ' ')
+      p++;
+   int tlen = p - msg;
+   if (*p)
+      p++;
+   return publish(h, tlen, msg, strlen(p), (const unsigned char *) p);
+}
+
+uint32_t lwmqtt_handshake(lwmqtt_t h, uint8_t * resumed)
+{
+   if (resumed)
+      *resumed = 0;
+   return 0;
+}
+
+const char *lwmqtt_stats(lwmqtt_t h, lwmqtt_stats_t * s)
+{
+   if (!h)
+      return "No handle";
+   memset(s, 0, sizeof(*s));
+   s->tx_msgs = h->stats.sent;
+   s->tx_bytes = h->stats.bytes;
+   return NULL;
+}
@@ -0,0 +1,184 @@
+// Settings benchmark: boot time registration, bulk apply and dump, with NVS operation counts
+// Each boot is a forked child so static state starts clean while NVS (shared memory) persists, changes apply (and so dump) after the next boot
+#include "revk.c"
+#include <sys/wait.h>
+
+#define	ARRAY	8
+#define	app_settings	\
+	u8(ua,1)	u8(ub,2)	u8(uc,3)	u8(ud,4)	u8(ue,5)	\
+	u8(uf,6)	u8(ug,7)	u8(uh,8)	u8(ui,9)	u8(uj,10)	\
+	u16(wa,100)	u16(wb,200)	u16(wc,300)	u16(wd,400)	u16(we,500)	\
+	u32(la,1000)	u32(lb,2000)	u32(lc,3000)	u32(ld,4000)	u32(le,5000)	\
+	b(ba,0)		b(bb,1)		b(bc,0)		b(bd,1)		b(be,0)		\
+	s(sa,"alpha")	s(sb,"bravo")	s(sc,"charlie")	s(sd,"delta")	s(se,"echo")	\
+	u8a(xa,ARRAY,0)	u8a(xb,ARRAY,1)	u8a(xc,ARRAY,2)	u8a(xd,ARRAY,3)	u8a(xe,ARRAY,4)	\
+	sa(ta,ARRAY,"")	sa(tb,ARRAY,"")	sa(tc,ARRAY,"")	sa(td,ARRAY,"")	sa(te,ARRAY,"")	\
+
+#define	u8(n,d)		uint8_t n;
+#define	u16(n,d)	uint16_t n;
+#define	u32(n,d)	uint32_t n;
+#define	b(n,d)		uint8_t n;
+#define	s(n,d)		char *n;
+#define	u8a(n,a,d)	uint8_t n[a];
+#define	sa(n,a,d)	char *n[a];
+app_settings
+#undef u8
+#undef u16
+#undef u32
+#undef b
+#undef s
+#undef u8a
+#undef sa
+#define str(x) #x
+#define	u8(n,d)		REVK_SETTING(#n,0,1,&n,str(d),0),
+#define	u16(n,d)	REVK_SETTING(#n,0,2,&n,str(d),0),
+#define	u32(n,d)	REVK_SETTING(#n,0,4,&n,str(d),0),
+#define	b(n,d)		REVK_SETTING(#n,0,1,&n,str(d),SETTING_BOOLEAN),
+#define	s(n,d)		REVK_SETTING(#n,0,0,&n,d,0),
+#define	u8a(n,a,d)	REVK_SETTING(#n,a,1,&n,str(d),0),
+#define	sa(n,a,d)	REVK_SETTING(#n,a,0,&n,d,0),
+static const revk_setting_def_t app_table[] = { app_settings };
+#undef u8
+#undef u16
+#undef u32
+#undef b
+#undef s
+#undef u8a
+#undef sa
+#undef str
+
+static int64_t t0;
+
+static void start(void)
+{
+   host_nvs_zero();
+   t0 = esp_timer_get_time();
+}
+
+static void report(const char *what)
+{
+   int64_t us = esp_timer_get_time() - t0;
+   host_nvs_stats_t *n = host_nvs();
+   printf("%-24s %8lldus  nvs get %5u set %5u erase %4u commit %3u\n", what, (long long) us, n->get, n->set, n->erase, n->commit);
+}
+
+static void boot(const char *what)
+{                               // As an app does at start up
+   start();
+   revk_boot(NULL);
+   revk_register_table(app_table, sizeof(app_table) / sizeof(*app_table));
+   snap_done();                 // The settings part of revk_start
+   if (what)
+      report(what);
+}
+
+static void apply(const char *what, int v)
+{                               // One setting message changing every app setting
+   char *json = NULL;
+   size_t len = 0;
+   FILE *f = open_memstream(&json, &len);
+   char c = '{';
+   for (int i = 0; i < sizeof(app_table) / sizeof(*app_table); i++)
+   {
+      const revk_setting_def_t *d = &app_table[i];
+      fprintf(f, "%c\"%s\":", c, d->name);
+      c = ',';
+      const char *sep = "";
+      if (d->array)
+         fprintf(f, "[");
+      for (int a = 0; a < (d->array ? : 1); a++)
+      {
+         if (d->flags & SETTING_BOOLEAN)
+            fprintf(f, "%s%s", sep, v & 1 ? "true" : "false");
+         else if (!d->size)
+            fprintf(f, "%s\"%s%d\"", sep, d->name, v + a);
+         else
+            fprintf(f, "%s%d", sep, (v + a) & 0x7F);
+         sep = ",";
+      }
+      if (d->array)
+         fprintf(f, "]");
+   }
+   fprintf(f, "}");
+   fclose(f);
+   jo_t j = jo_parse_str(json);
+   start();
+   const char *er = revk_setting(j);
+   report(what);
+   if (er && *er)
+      printf("  error: %s\n", er);
+   jo_free(&j);
+   free(json);
+}
+
+static void dump(const char *what)
+{                               // Full settings dump to one connected client
+   mqtt_client[0] = host_mqtt_new();
+   mqtt_clients = 1;
+   link_down = 0;
+   xEventGroupSetBits(revk_group, GROUP_MQTT);
+   host_mqtt_stats_t *m = host_mqtt_stats(mqtt_client[0]);
+   start();
+   revk_setting_dump(NULL, 0, 0);
+   report(what);
+   printf("  published %u messages, %u bytes, %u queued for the rate limit\n", m->sent, m->bytes, queue_count);
+}
+
+static void child(void (*fn)(void))
+{
+   fflush(stdout);
+   pid_t p = fork();
+   if (!p)
+   {
+      fn();
+      fflush(stdout);
+      _exit(0);
+   }
+   int status;
+   waitpid(p, &status, 0);
+   if (!WIFEXITED(status) || WEXITSTATUS(status))
+   {
+      printf("Child failed\n");
+      exit(1);
+   }
+}
+
+static void first(void)
+{
+   boot("boot, empty NVS");
+}
+
+static void second(void)
+{
+   boot("boot, snapshot");
+}
+
+static void changes(void)
+{
+   boot(NULL);
+   apply("apply, all changed", 1);
+   apply("apply, none changed", 1);
+}
+
+static void third(void)
+{
+   boot("boot, after changes");
+   dump("dump");
+}
+
+static void fourth(void)
+{
+   boot("boot, after snapshot");
+}
+
+int main(int argc, char *argv[])
+{
+   host_nvs_reset();
+   printf("%d app settings, %d NVS keys\n", (int) (sizeof(app_table) / sizeof(*app_table)), (int) (10 + 5 + 5 + 5 + 5 + 10 * ARRAY));
+   child(first);
+   child(second);
+   child(changes);
+   child(third);
+   child(fourth);
+   return 0;
+}
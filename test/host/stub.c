@@ -0,0 +1,728 @@
+// Host stand-ins for ESP-IDF and FreeRTOS, see stub/host.h
+// NVS is held in shared memory so it survives a fork, which is how the tests do a reboot
+#include "host.h"
+#include <pthread.h>
+#include <sys/mman.h>
+
+int host_log = 0;
+esp_event_base_t WIFI_EVENT = "WIFI_EVENT",
+    IP_EVENT = "IP_EVENT";
+
+const char *esp_err_to_name(esp_err_t e)
+{
+   static char temp[12];
+   snprintf(temp, sizeof(temp), "0x%X", e);
+   return temp;
+}
+
+// System
+
+int64_t esp_timer_get_time(void)
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (int64_t) t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+   return 100000;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+   return 100000;
+}
+
+uint32_t esp_random(void)
+{
+   return random();
+}
+
+void esp_fill_random(void *buf, size_t len)
+{
+   uint8_t *p = buf;
+   while (len--)
+      *p++ = random();
+}
+
+void esp_restart(void)
+{
+   fprintf(stderr, "esp_restart\n");
+   exit(1);
+}
+
+esp_reset_reason_t esp_reset_reason(void)
+{
+   return ESP_RST_POWERON;
+}
+
+esp_err_t esp_efuse_mac_get_default(uint8_t * mac)
+{
+   const uint8_t m[6] = { 0x02, 0x00, 0x00, 0x12, 0x34, 0x56 };
+   memcpy(mac, m, sizeof(m));
+   return ESP_OK;
+}
+
+const esp_app_desc_t *esp_ota_get_app_description(void)
+{
+   static const esp_app_desc_t app = {.version = "host",.project_name = "test",.time = "00:00:00",.date = "Jan  1 2000",.idf_ver = "host" };
+   return &app;
+}
+
+const esp_app_desc_t *esp_app_get_description(void)
+{
+   return esp_ota_get_app_description();
+}
+
+size_t spi_flash_get_chip_size(void)
+{
+   return 4 * 1024 * 1024;
+}
+
+// Nothing to do on the host
+
+#define	NOP(f,...)	esp_err_t f(__VA_ARGS__){return ESP_OK;}
+NOP(esp_task_wdt_init, uint32_t t, bool p)
+    NOP(esp_task_wdt_add, void *t)
+    NOP(esp_task_wdt_delete, void *t)
+    NOP(esp_task_wdt_reset, void)
+    NOP(esp_event_loop_create_default, void)
+    NOP(esp_event_handler_register, esp_event_base_t b, int32_t i, esp_event_handler_t h, void *a)
+    NOP(esp_netif_init, void)
+    NOP(esp_netif_set_hostname, esp_netif_t * n, const char *h)
+    NOP(esp_netif_create_ip6_linklocal, esp_netif_t * n)
+    NOP(esp_netif_set_ip_info, esp_netif_t * n, const esp_netif_ip_info_t * i)
+    NOP(esp_netif_set_dns_info, esp_netif_t * n, esp_netif_dns_type_t t, esp_netif_dns_info_t * d)
+    NOP(esp_netif_dhcpc_start, esp_netif_t * n)
+    NOP(esp_netif_dhcpc_stop, esp_netif_t * n)
+    NOP(esp_netif_dhcps_start, esp_netif_t * n)
+    NOP(esp_netif_dhcps_stop, esp_netif_t * n)
+    NOP(esp_wifi_init, const wifi_init_config_t * c)
+    NOP(esp_wifi_deinit, void)
+    NOP(esp_wifi_start, void)
+    NOP(esp_wifi_stop, void)
+    NOP(esp_wifi_connect, void)
+    NOP(esp_wifi_set_storage, int s)
+    NOP(esp_wifi_set_ps, int p)
+    NOP(esp_wifi_set_protocol, wifi_interface_t i, uint8_t p)
+    NOP(esp_wifi_set_mode, wifi_mode_t m)
+    NOP(esp_wifi_set_config, wifi_interface_t i, wifi_config_t * c)
+    NOP(esp_crt_bundle_attach, void *c)
+    NOP(esp_tls_set_global_ca_store, const unsigned char *c, unsigned int l)
+    NOP(esp_ota_write, esp_ota_handle_t h, const void *d, size_t l)
+    NOP(esp_ota_end, esp_ota_handle_t h)
+    NOP(esp_ota_set_boot_partition, const esp_partition_t * p)
+    NOP(esp_http_client_open, esp_http_client_handle_t c, int l)
+    NOP(esp_http_client_cleanup, esp_http_client_handle_t c)
+#undef NOP
+void esp_log_level_set(const char *t, esp_log_level_t l)
+{
+}
+
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t * ap)
+{
+   return ESP_FAIL;
+}
+
+esp_netif_t *esp_netif_create_default_wifi_sta(void)
+{
+   return NULL;
+}
+
+esp_netif_t *esp_netif_create_default_wifi_ap(void)
+{
+   return NULL;
+}
+
+esp_err_t esp_netif_str_to_ip4(const char *s, esp_ip4_addr_t * ip)
+{
+   struct in_addr a;
+   if (inet_pton(AF_INET, s, &a) != 1)
+      return ESP_FAIL;
+   ip->addr = a.s_addr;
+   return ESP_OK;
+}
+
+esp_err_t esp_netif_str_to_ip6(const char *s, esp_ip6_addr_t * ip)
+{
+   if (inet_pton(AF_INET6, s, ip->addr) != 1)
+      return ESP_FAIL;
+   return ESP_OK;
+}
+
+void esp_netif_set_ip4_addr(esp_ip4_addr_t * ip, uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+   ip->addr = a | (b << 8) | (c << 16) | ((uint32_t) d << 24);
+}
+
+void sntp_setoperatingmode(int m)
+{
+}
+
+void sntp_setservername(int i, const char *s)
+{
+}
+
+void sntp_init(void)
+{
+}
+
+void sntp_stop(void)
+{
+}
+
+int gpio_set_level(int g, uint32_t l)
+{
+   return 0;
+}
+
+int gpio_reset_pin(int g)
+{
+   return 0;
+}
+
+int gpio_set_direction(int g, int d)
+{
+   return 0;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void)
+{
+   return NULL;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t * p)
+{
+   return NULL;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t * p, size_t l, esp_ota_handle_t * h)
+{
+   return ESP_FAIL;
+}
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t * c)
+{
+   return NULL;
+}
+
+int esp_http_client_fetch_headers(esp_http_client_handle_t c)
+{
+   return -1;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t c)
+{
+   return 404;
+}
+
+int esp_http_client_read(esp_http_client_handle_t c, char *b, int l)
+{
+   return -1;
+}
+
+int esp_http_client_read_response(esp_http_client_handle_t c, char *b, int l)
+{
+   return -1;
+}
+
+// NVS, one record per key, rewritten values appended as the real NVS does
+
+#define	NVS_SPACES	8
+#define	NVS_RECS	4096
+#define	NVS_DATA	(4*1024*1024)
+typedef struct
+{
+   uint8_t ns;                  // Namespace handle
+   uint8_t type;                // 0 is erased
+   char key[16];
+   uint32_t len;
+   uint32_t pos;                // In data
+} nvs_rec_t;
+typedef struct
+{
+   host_nvs_stats_t stats;
+   int fail_commit;
+   char space[NVS_SPACES][16];  // Namespace names, handle is index+1
+   uint32_t recs;
+   uint32_t used;
+   nvs_rec_t rec[NVS_RECS];
+   uint8_t data[NVS_DATA];
+} nvs_mem_t;
+static nvs_mem_t *nvs_mem = NULL;
+static pthread_mutex_t nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+enum
+{ NVS_NONE, NVS_U8, NVS_I8, NVS_U16, NVS_I16, NVS_U32, NVS_I32, NVS_U64, NVS_I64, NVS_STR, NVS_BLOB };
+
+static void nvs_mem_init(void)
+{
+   if (nvs_mem)
+      return;
+   nvs_mem = mmap(NULL, sizeof(*nvs_mem), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (nvs_mem == MAP_FAILED)
+   {
+      perror("mmap");
+      exit(1);
+   }
+}
+
+host_nvs_stats_t *host_nvs(void)
+{
+   nvs_mem_init();
+   return &nvs_mem->stats;
+}
+
+void host_nvs_reset(void)
+{
+   nvs_mem_init();
+   memset(nvs_mem, 0, offsetof(nvs_mem_t, data));
+}
+
+void host_nvs_zero(void)
+{
+   nvs_mem_init();
+   memset(&nvs_mem->stats, 0, sizeof(nvs_mem->stats));
+}
+
+void host_nvs_fail_commit(int fail)
+{
+   nvs_mem_init();
+   nvs_mem->fail_commit = fail;
+}
+
+static nvs_rec_t *nvs_find(nvs_handle h, const char *key)
+{
+   for (int i = 0; i < nvs_mem->recs; i++)
+      if (nvs_mem->rec[i].ns == h && nvs_mem->rec[i].type && !strcmp(nvs_mem->rec[i].key, key))
+         return &nvs_mem->rec[i];
+   return NULL;
+}
+
+static esp_err_t nvs_put(nvs_handle h, const char *key, uint8_t type, const void *data, size_t len)
+{
+   if (!h || h > NVS_SPACES || !key || strlen(key) > 15)
+      return ESP_ERR_INVALID_ARG;
+   pthread_mutex_lock(&nvs_lock);
+   nvs_mem->stats.set++;
+   nvs_rec_t *r = nvs_find(h, key);
+   if (!r)
+   {
+      if (nvs_mem->recs == NVS_RECS)
+      {
+         pthread_mutex_unlock(&nvs_lock);
+         return ESP_ERR_NVS_NO_FREE_PAGES;
+      }
+      r = &nvs_mem->rec[nvs_mem->recs++];
+      r->ns = h;
+      strcpy(r->key, key);
+   }
+   if (nvs_mem->used + len > NVS_DATA)
+   {
+      pthread_mutex_unlock(&nvs_lock);
+      return ESP_ERR_NVS_NO_FREE_PAGES;
+   }
+   r->type = type;
+   r->len = len;
+   r->pos = nvs_mem->used;
+   memcpy(nvs_mem->data + r->pos, data, len);
+   nvs_mem->used += len;
+   pthread_mutex_unlock(&nvs_lock);
+   return ESP_OK;
+}
+
+static esp_err_t nvs_take(nvs_handle h, const char *key, uint8_t type, void *data, size_t * len)
+{                               // len NULL for fixed size
+   if (!h || h > NVS_SPACES || !key)
+      return ESP_ERR_INVALID_ARG;
+   pthread_mutex_lock(&nvs_lock);
+   nvs_mem->stats.get++;
+   nvs_rec_t *r = nvs_find(h, key);
+   esp_err_t e = ESP_OK;
+   if (!r || r->type != type)
+      e = ESP_ERR_NVS_NOT_FOUND;
+   else if (!len)
+      memcpy(data, nvs_mem->data + r->pos, r->len);
+   else if (!data)
+      *len = r->len;
+   else if (*len < r->len)
+      e = ESP_ERR_NVS_INVALID_LENGTH;
+   else
+   {
+      memcpy(data, nvs_mem->data + r->pos, r->len);
+      *len = r->len;
+   }
+   pthread_mutex_unlock(&nvs_lock);
+   return e;
+}
+
+esp_err_t nvs_flash_init(void)
+{
+   nvs_mem_init();
+   return ESP_OK;
+}
+
+esp_err_t nvs_flash_init_partition(const char *p)
+{
+   nvs_mem_init();
+   return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+   host_nvs_reset();
+   return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase_partition(const char *p)
+{
+   host_nvs_reset();
+   return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode mode, nvs_handle * h)
+{
+   nvs_mem_init();
+   pthread_mutex_lock(&nvs_lock);
+   int i;
+   for (i = 0; i < NVS_SPACES && *nvs_mem->space[i] && strcmp(nvs_mem->space[i], name); i++);
+   if (i < NVS_SPACES && !*nvs_mem->space[i])
+      strncpy(nvs_mem->space[i], name, sizeof(nvs_mem->space[i]) - 1);
+   pthread_mutex_unlock(&nvs_lock);
+   if (i == NVS_SPACES)
+      return ESP_ERR_NVS_NO_FREE_PAGES;
+   *h = i + 1;
+   return ESP_OK;
+}
+
+esp_err_t nvs_open_from_partition(const char *part, const char *name, nvs_open_mode mode, nvs_handle * h)
+{
+   return nvs_open(name, mode, h);
+}
+
+void nvs_close(nvs_handle h)
+{
+}
+
+esp_err_t nvs_commit(nvs_handle h)
+{
+   nvs_mem_init();
+   __atomic_add_fetch(&nvs_mem->stats.commit, 1, __ATOMIC_RELAXED);
+   return nvs_mem->fail_commit ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle h, const char *key)
+{
+   pthread_mutex_lock(&nvs_lock);
+   nvs_mem->stats.erase++;
+   nvs_rec_t *r = nvs_find(h, key);
+   if (r)
+      r->type = NVS_NONE;
+   pthread_mutex_unlock(&nvs_lock);
+   return r ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_erase_all(nvs_handle h)
+{
+   pthread_mutex_lock(&nvs_lock);
+   nvs_mem->stats.erase++;
+   for (int i = 0; i < nvs_mem->recs; i++)
+      if (nvs_mem->rec[i].ns == h)
+         nvs_mem->rec[i].type = NVS_NONE;
+   pthread_mutex_unlock(&nvs_lock);
+   return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle h, const char *key, void *data, size_t * len)
+{
+   return nvs_take(h, key, NVS_BLOB, data, len);
+}
+
+esp_err_t nvs_set_blob(nvs_handle h, const char *key, const void *data, size_t len)
+{
+   return nvs_put(h, key, NVS_BLOB, data, len);
+}
+
+esp_err_t nvs_get_str(nvs_handle h, const char *key, char *data, size_t * len)
+{
+   return nvs_take(h, key, NVS_STR, data, len);
+}
+
+esp_err_t nvs_set_str(nvs_handle h, const char *key, const char *data)
+{
+   return nvs_put(h, key, NVS_STR, data, strlen(data) + 1);
+}
+
+#define	NVS_INT(t,n,T)	esp_err_t nvs_get_##n(nvs_handle h,const char*key,t*v){return nvs_take(h,key,T,v,NULL);} \
+			esp_err_t nvs_set_##n(nvs_handle h,const char*key,t v){return nvs_put(h,key,T,&v,sizeof(v));}
+NVS_INT(int8_t, i8, NVS_I8) NVS_INT(uint8_t, u8, NVS_U8) NVS_INT(int16_t, i16, NVS_I16) NVS_INT(uint16_t, u16, NVS_U16) NVS_INT(int32_t, i32, NVS_I32) NVS_INT(uint32_t, u32, NVS_U32) NVS_INT(int64_t, i64, NVS_I64) NVS_INT(uint64_t, u64, NVS_U64)
+#undef NVS_INT
+// FreeRTOS on pthreads, a tick is 1ms
+static struct timespec deadline(TickType_t ticks)
+{
+   struct timespec t;
+   clock_gettime(CLOCK_REALTIME, &t);
+   t.tv_sec += ticks / 1000;
+   t.tv_nsec += (ticks % 1000) * 1000000L;
+   if (t.tv_nsec >= 1000000000L)
+   {
+      t.tv_sec++;
+      t.tv_nsec -= 1000000000L;
+   }
+   return t;
+}
+
+static int wait(pthread_cond_t * c, pthread_mutex_t * m, TickType_t ticks, struct timespec *t)
+{                               // Wait on c, non zero if timed out
+   if (ticks == portMAX_DELAY)
+      return pthread_cond_wait(c, m);
+   return pthread_cond_timedwait(c, m, t);
+}
+
+typedef struct
+{
+   TaskFunction_t fn;
+   void *arg;
+} task_t;
+
+static void *task_run(void *arg)
+{
+   task_t t = *(task_t *) arg;
+   free(arg);
+   t.fn(t.arg);
+   return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t pri, TaskHandle_t * h)
+{
+   task_t *t = malloc(sizeof(*t));
+   if (!t)
+      return pdFAIL;
+   t->fn = fn;
+   t->arg = arg;
+   pthread_t p;
+   if (pthread_create(&p, NULL, task_run, t))
+   {
+      free(t);
+      return pdFAIL;
+   }
+   pthread_detach(p);
+   if (h)
+      *h = (TaskHandle_t) p;
+   return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t pri, TaskHandle_t * h, int core)
+{
+   return xTaskCreate(fn, name, stack, arg, pri, h);
+}
+
+void vTaskDelete(TaskHandle_t h)
+{
+   if (!h || (pthread_t) h == pthread_self())
+      pthread_exit(NULL);
+   pthread_cancel((pthread_t) h);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+   usleep(ticks * 1000);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+   return esp_timer_get_time() / 1000;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+   return (TaskHandle_t) pthread_self();
+}
+
+struct host_sem_s
+{
+   pthread_mutex_t m;
+   pthread_cond_t c;
+   int count;
+};
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+   SemaphoreHandle_t s = calloc(1, sizeof(*s));
+   if (!s)
+      return NULL;
+   pthread_mutex_init(&s->m, NULL);
+   pthread_cond_init(&s->c, NULL);
+   return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+   SemaphoreHandle_t s = xSemaphoreCreateBinary();
+   if (s)
+      s->count = 1;
+   return s;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t ticks)
+{
+   struct timespec t = deadline(ticks);
+   pthread_mutex_lock(&s->m);
+   while (!s->count)
+      if (!ticks || wait(&s->c, &s->m, ticks, &t))
+      {
+         pthread_mutex_unlock(&s->m);
+         return pdFALSE;
+      }
+   s->count = 0;
+   pthread_mutex_unlock(&s->m);
+   return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s)
+{
+   pthread_mutex_lock(&s->m);
+   int was = s->count;
+   s->count = 1;
+   pthread_cond_signal(&s->c);
+   pthread_mutex_unlock(&s->m);
+   return was ? pdFALSE : pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t s)
+{
+   pthread_mutex_destroy(&s->m);
+   pthread_cond_destroy(&s->c);
+   free(s);
+}
+
+struct host_queue_s
+{
+   pthread_mutex_t m;
+   pthread_cond_t c;
+   UBaseType_t len,
+    size,
+    count,
+    head;
+   uint8_t data[];
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t size)
+{
+   QueueHandle_t q = calloc(1, sizeof(*q) + len * size);
+   if (!q)
+      return NULL;
+   pthread_mutex_init(&q->m, NULL);
+   pthread_cond_init(&q->c, NULL);
+   q->len = len;
+   q->size = size;
+   return q;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks)
+{
+   struct timespec t = deadline(ticks);
+   pthread_mutex_lock(&q->m);
+   while (q->count == q->len)
+      if (!ticks || wait(&q->c, &q->m, ticks, &t))
+      {
+         pthread_mutex_unlock(&q->m);
+         return pdFALSE;
+      }
+   memcpy(q->data + ((q->head + q->count) % q->len) * q->size, item, q->size);
+   q->count++;
+   pthread_cond_broadcast(&q->c);
+   pthread_mutex_unlock(&q->m);
+   return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks)
+{
+   struct timespec t = deadline(ticks);
+   pthread_mutex_lock(&q->m);
+   while (!q->count)
+      if (!ticks || wait(&q->c, &q->m, ticks, &t))
+      {
+         pthread_mutex_unlock(&q->m);
+         return pdFALSE;
+      }
+   memcpy(item, q->data + q->head * q->size, q->size);
+   q->head = (q->head + 1) % q->len;
+   q->count--;
+   pthread_cond_broadcast(&q->c);
+   pthread_mutex_unlock(&q->m);
+   return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+   pthread_mutex_lock(&q->m);
+   UBaseType_t n = q->count;
+   pthread_mutex_unlock(&q->m);
+   return n;
+}
+
+void vQueueDelete(QueueHandle_t q)
+{
+   pthread_mutex_destroy(&q->m);
+   pthread_cond_destroy(&q->c);
+   free(q);
+}
+
+struct host_group_s
+{
+   pthread_mutex_t m;
+   pthread_cond_t c;
+   EventBits_t bits;
+};
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+   EventGroupHandle_t g = calloc(1, sizeof(*g));
+   if (!g)
+      return NULL;
+   pthread_mutex_init(&g->m, NULL);
+   pthread_cond_init(&g->c, NULL);
+   return g;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t g, EventBits_t bits)
+{
+   pthread_mutex_lock(&g->m);
+   g->bits |= bits;
+   bits = g->bits;
+   pthread_cond_broadcast(&g->c);
+   pthread_mutex_unlock(&g->m);
+   return bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t g, EventBits_t bits)
+{
+   pthread_mutex_lock(&g->m);
+   EventBits_t was = g->bits;
+   g->bits &= ~bits;
+   pthread_mutex_unlock(&g->m);
+   return was;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t g)
+{
+   pthread_mutex_lock(&g->m);
+   EventBits_t bits = g->bits;
+   pthread_mutex_unlock(&g->m);
+   return bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t g, EventBits_t bits, BaseType_t clear, BaseType_t all, TickType_t ticks)
+{
+   struct timespec t = deadline(ticks);
+   pthread_mutex_lock(&g->m);
+   while (!(all ? (g->bits & bits) == bits : (g->bits & bits)))
+      if (!ticks || wait(&g->c, &g->m, ticks, &t))
+         break;
+   EventBits_t was = g->bits;
+   if (clear && (all ? (was & bits) == bits : (was & bits)))
+      g->bits &= ~bits;
+   pthread_mutex_unlock(&g->m);
+   return was;
+}
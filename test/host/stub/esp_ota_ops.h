@@ -0,0 +1 @@
+#include "host.h"
@@ -0,0 +1,386 @@
+// Host build stand-ins for the ESP-IDF and FreeRTOS APIs used by the component, enough to build and run the settings and queue code on Linux
+#ifndef	HOST_H
+#define	HOST_H
+#include "sdkconfig.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <ctype.h>
+
+// Errors
+typedef int esp_err_t;
+#define	ESP_OK			0
+#define	ESP_FAIL		-1
+#define	ERR_OK			0
+#define	ESP_ERR_NO_MEM		0x101
+#define	ESP_ERR_INVALID_ARG	0x102
+#define	ESP_ERR_INVALID_STATE	0x103
+#define	ESP_ERR_INVALID_SIZE	0x104
+#define	ESP_ERR_NOT_FOUND	0x105
+#define	ESP_ERR_TIMEOUT		0x107
+#define	ESP_ERR_NVS_BASE	0x1100
+#define	ESP_ERR_NVS_NOT_INITIALIZED	0x1101
+#define	ESP_ERR_NVS_NOT_FOUND	0x1102
+#define	ESP_ERR_NVS_TYPE_MISMATCH	0x1103
+#define	ESP_ERR_NVS_INVALID_LENGTH	0x110c
+#define	ESP_ERR_NVS_NO_FREE_PAGES	0x110d
+#define	ESP_ERR_NVS_NEW_VERSION_FOUND	0x1110
+const char *esp_err_to_name(esp_err_t);
+#define	ESP_ERROR_CHECK(x)	do{esp_err_t __e=(x);if(__e){fprintf(stderr,"%s:%d %s failed %d\n",__FILE__,__LINE__,#x,__e);abort();}}while(0)
+
+// Logging
+extern int host_log;            // Set to show ESP_LOGx output
+#define	ESP_LOG(l,t,f,...)	do{if(host_log>=l)fprintf(stderr,"%s: " f "\n",t,##__VA_ARGS__);}while(0)
+#define	ESP_LOGE(t,f,...)	ESP_LOG(1,t,f,##__VA_ARGS__)
+#define	ESP_LOGW(t,f,...)	ESP_LOG(2,t,f,##__VA_ARGS__)
+#define	ESP_LOGI(t,f,...)	ESP_LOG(3,t,f,##__VA_ARGS__)
+#define	ESP_LOGD(t,f,...)	ESP_LOG(4,t,f,##__VA_ARGS__)
+#define	ESP_LOGV(t,f,...)	ESP_LOG(5,t,f,##__VA_ARGS__)
+typedef enum
+{ ESP_LOG_NONE, ESP_LOG_ERROR, ESP_LOG_WARN, ESP_LOG_INFO, ESP_LOG_DEBUG, ESP_LOG_VERBOSE } esp_log_level_t;
+void esp_log_level_set(const char *, esp_log_level_t);
+
+// System
+int64_t esp_timer_get_time(void);
+uint32_t esp_get_free_heap_size(void);
+uint32_t esp_get_minimum_free_heap_size(void);
+uint32_t esp_random(void);
+void esp_fill_random(void *, size_t);
+void esp_restart(void);
+typedef enum
+{ ESP_RST_UNKNOWN, ESP_RST_POWERON, ESP_RST_EXT, ESP_RST_SW, ESP_RST_PANIC, ESP_RST_INT_WDT, ESP_RST_TASK_WDT, ESP_RST_WDT, ESP_RST_DEEPSLEEP, ESP_RST_BROWNOUT, ESP_RST_SDIO } esp_reset_reason_t;
+esp_reset_reason_t esp_reset_reason(void);
+esp_err_t esp_efuse_mac_get_default(uint8_t *);
+esp_err_t esp_task_wdt_init(uint32_t, bool);
+esp_err_t esp_task_wdt_add(void *);
+esp_err_t esp_task_wdt_delete(void *);
+esp_err_t esp_task_wdt_reset(void);
+void sntp_setoperatingmode(int);
+void sntp_setservername(int, const char *);
+void sntp_init(void);
+void sntp_stop(void);
+#define	SNTP_OPMODE_POLL	0
+int gpio_set_level(int, uint32_t);
+int gpio_get_level(int);
+int gpio_reset_pin(int);
+int gpio_set_direction(int, int);
+int gpio_pullup_en(int);
+int gpio_pulldown_en(int);
+int gpio_pullup_dis(int);
+int gpio_pulldown_dis(int);
+int gpio_hold_dis(int);
+int gpio_set_drive_capability(int, int);
+int rtc_gpio_deinit(int);
+int GPIO_IS_VALID_GPIO(int);
+int GPIO_IS_VALID_OUTPUT_GPIO(int);
+typedef enum
+{ GPIO_MODE_DISABLE, GPIO_MODE_INPUT, GPIO_MODE_OUTPUT, GPIO_MODE_OUTPUT_OD, GPIO_MODE_INPUT_OUTPUT } gpio_mode_t;
+typedef int gpio_num_t;
+
+// NVS, in memory, with operation counts
+typedef uint32_t nvs_handle;
+typedef uint32_t nvs_handle_t;
+typedef enum
+{ NVS_READONLY, NVS_READWRITE } nvs_open_mode;
+typedef nvs_open_mode nvs_open_mode_t;
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_init_partition(const char *);
+esp_err_t nvs_flash_erase(void);
+esp_err_t nvs_flash_erase_partition(const char *);
+esp_err_t nvs_open(const char *, nvs_open_mode, nvs_handle *);
+esp_err_t nvs_open_from_partition(const char *, const char *, nvs_open_mode, nvs_handle *);
+void nvs_close(nvs_handle);
+esp_err_t nvs_commit(nvs_handle);
+esp_err_t nvs_erase_key(nvs_handle, const char *);
+esp_err_t nvs_erase_all(nvs_handle);
+esp_err_t nvs_get_blob(nvs_handle, const char *, void *, size_t *);
+esp_err_t nvs_set_blob(nvs_handle, const char *, const void *, size_t);
+esp_err_t nvs_get_str(nvs_handle, const char *, char *, size_t *);
+esp_err_t nvs_set_str(nvs_handle, const char *, const char *);
+#define	NVS_INT(t,n)	esp_err_t nvs_get_##n(nvs_handle,const char*,t*); esp_err_t nvs_set_##n(nvs_handle,const char*,t);
+NVS_INT(int8_t, i8) NVS_INT(uint8_t, u8) NVS_INT(int16_t, i16) NVS_INT(uint16_t, u16) NVS_INT(int32_t, i32) NVS_INT(uint32_t, u32) NVS_INT(int64_t, i64) NVS_INT(uint64_t, u64)
+#undef NVS_INT
+typedef struct
+{
+   uint32_t get;                // Reads
+   uint32_t set;                // Writes
+   uint32_t erase;              // Key erases
+   uint32_t commit;             // Commits
+} host_nvs_stats_t;
+host_nvs_stats_t *host_nvs(void);       // Counts, shared with forked children
+void host_nvs_zero(void);       // Zero counts
+void host_nvs_reset(void);      // Empty NVS and zero counts
+void host_nvs_fail_commit(int); // Non zero to make commits fail
+
+// FreeRTOS, on pthreads
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef struct host_sem_s *SemaphoreHandle_t;
+typedef struct host_queue_s *QueueHandle_t;
+typedef struct host_group_s *EventGroupHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t EventBits_t;
+#define	pdTRUE			1
+#define	pdFALSE			0
+#define	pdPASS			1
+#define	pdFAIL			0
+#define	portMAX_DELAY		0xFFFFFFFF
+#define	portTICK_PERIOD_MS	1
+#define	pdMS_TO_TICKS(x)	(x)
+#define	configMAX_PRIORITIES	25
+#define	BIT0	0x01
+#define	BIT1	0x02
+#define	BIT2	0x04
+#define	BIT3	0x08
+#define	BIT4	0x10
+#define	BIT5	0x20
+#define	BIT6	0x40
+#define	BIT7	0x80
+#define	BIT8	0x100
+#define	BIT9	0x200
+#define	BIT10	0x400
+#define	BIT11	0x800
+#define	BIT12	0x1000
+#define	BIT13	0x2000
+#define	BIT14	0x4000
+#define	BIT15	0x8000
+BaseType_t xTaskCreate(TaskFunction_t, const char *, uint32_t, void *, UBaseType_t, TaskHandle_t *);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t, const char *, uint32_t, void *, UBaseType_t, TaskHandle_t *, int);
+void vTaskDelete(TaskHandle_t);
+void vTaskDelay(TickType_t);
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t);
+void vSemaphoreDelete(SemaphoreHandle_t);
+QueueHandle_t xQueueCreate(UBaseType_t, UBaseType_t);
+BaseType_t xQueueSend(QueueHandle_t, const void *, TickType_t);
+BaseType_t xQueueReceive(QueueHandle_t, void *, TickType_t);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t);
+void vQueueDelete(QueueHandle_t);
+EventGroupHandle_t xEventGroupCreate(void);
+EventBits_t xEventGroupSetBits(EventGroupHandle_t, EventBits_t);
+EventBits_t xEventGroupClearBits(EventGroupHandle_t, EventBits_t);
+EventBits_t xEventGroupGetBits(EventGroupHandle_t);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t, EventBits_t, BaseType_t, BaseType_t, TickType_t);
+
+// Events and network, nothing happens on the host
+typedef const char *esp_event_base_t;
+typedef void *esp_event_handler_instance_t;
+typedef void (*esp_event_handler_t)(void *, esp_event_base_t, int32_t, void *);
+extern esp_event_base_t WIFI_EVENT,
+ IP_EVENT;
+#define	ESP_EVENT_ANY_ID	-1
+esp_err_t esp_event_loop_create_default(void);
+esp_err_t esp_event_handler_register(esp_event_base_t, int32_t, esp_event_handler_t, void *);
+enum
+{ WIFI_EVENT_WIFI_READY, WIFI_EVENT_SCAN_DONE, WIFI_EVENT_STA_START, WIFI_EVENT_STA_STOP, WIFI_EVENT_STA_CONNECTED, WIFI_EVENT_STA_DISCONNECTED, WIFI_EVENT_STA_AUTHMODE_CHANGE, WIFI_EVENT_STA_WPS_ER_SUCCESS, WIFI_EVENT_STA_WPS_ER_FAILED, WIFI_EVENT_STA_WPS_ER_TIMEOUT, WIFI_EVENT_STA_WPS_ER_PIN, WIFI_EVENT_STA_WPS_ER_PBC_OVERLAP, WIFI_EVENT_AP_START, WIFI_EVENT_AP_STOP, WIFI_EVENT_AP_STACONNECTED, WIFI_EVENT_AP_STADISCONNECTED, WIFI_EVENT_AP_PROBEREQRECVED };
+enum
+{ IP_EVENT_STA_GOT_IP, IP_EVENT_STA_LOST_IP, IP_EVENT_AP_STAIPASSIGNED, IP_EVENT_GOT_IP6 };
+typedef struct esp_netif_obj esp_netif_t;
+typedef struct
+{
+   uint32_t addr;
+} esp_ip4_addr_t;
+typedef struct
+{
+   uint32_t addr[4];
+} esp_ip6_addr_t;
+typedef struct
+{
+   esp_ip4_addr_t ip,
+    netmask,
+    gw;
+} esp_netif_ip_info_t;
+typedef struct
+{
+   struct
+   {
+      union
+      {
+         esp_ip4_addr_t ip4;
+         esp_ip6_addr_t ip6;
+      } u_addr;
+      uint8_t type;
+   } ip;
+} esp_netif_dns_info_t;
+typedef enum
+{ ESP_NETIF_DNS_MAIN, ESP_NETIF_DNS_BACKUP, ESP_NETIF_DNS_FALLBACK } esp_netif_dns_type_t;
+typedef struct
+{
+   esp_netif_ip_info_t ip_info;
+} ip_event_got_ip_t;
+#define	IPSTR	"%d.%d.%d.%d"
+#define	IP2STR(a)	(int)((a)->addr&0xFF),(int)(((a)->addr>>8)&0xFF),(int)(((a)->addr>>16)&0xFF),(int)(((a)->addr>>24)&0xFF)
+esp_err_t esp_netif_init(void);
+esp_netif_t *esp_netif_create_default_wifi_sta(void);
+esp_netif_t *esp_netif_create_default_wifi_ap(void);
+esp_err_t esp_netif_set_hostname(esp_netif_t *, const char *);
+esp_err_t esp_netif_create_ip6_linklocal(esp_netif_t *);
+esp_err_t esp_netif_set_ip_info(esp_netif_t *, const esp_netif_ip_info_t *);
+esp_err_t esp_netif_set_dns_info(esp_netif_t *, esp_netif_dns_type_t, esp_netif_dns_info_t *);
+esp_err_t esp_netif_str_to_ip4(const char *, esp_ip4_addr_t *);
+esp_err_t esp_netif_str_to_ip6(const char *, esp_ip6_addr_t *);
+void esp_netif_set_ip4_addr(esp_ip4_addr_t *, uint8_t, uint8_t, uint8_t, uint8_t);
+esp_err_t esp_netif_dhcpc_start(esp_netif_t *);
+esp_err_t esp_netif_dhcpc_stop(esp_netif_t *);
+esp_err_t esp_netif_dhcps_start(esp_netif_t *);
+esp_err_t esp_netif_dhcps_stop(esp_netif_t *);
+typedef union
+{
+   struct
+   {
+      uint8_t ssid[32];
+      uint8_t password[64];
+      int scan_method;
+      bool bssid_set;
+      uint8_t bssid[6];
+      uint8_t channel;
+   } sta;
+   struct
+   {
+      uint8_t ssid[32];
+      uint8_t password[64];
+      uint8_t ssid_len;
+      uint8_t channel;
+      int authmode;
+      uint8_t ssid_hidden;
+      uint8_t max_connection;
+   } ap;
+} wifi_config_t;
+typedef struct
+{
+   uint8_t bssid[6];
+   uint8_t ssid[33];
+   uint8_t primary;
+   int8_t rssi;
+   uint32_t phy_lr:1;
+} wifi_ap_record_t;
+typedef struct
+{
+   int dummy;
+} wifi_init_config_t;
+#define	WIFI_INIT_CONFIG_DEFAULT()	{0}
+typedef enum
+{ WIFI_MODE_NULL, WIFI_MODE_STA, WIFI_MODE_AP, WIFI_MODE_APSTA } wifi_mode_t;
+typedef enum
+{ ESP_IF_WIFI_STA, ESP_IF_WIFI_AP } wifi_interface_t;
+enum
+{ WIFI_STORAGE_FLASH, WIFI_STORAGE_RAM };
+enum
+{ WIFI_PS_NONE, WIFI_PS_MIN_MODEM };
+enum
+{ WIFI_FAST_SCAN, WIFI_ALL_CHANNEL_SCAN };
+enum
+{ WIFI_AUTH_OPEN, WIFI_AUTH_WEP, WIFI_AUTH_WPA_PSK, WIFI_AUTH_WPA2_PSK, WIFI_AUTH_WPA_WPA2_PSK };
+#define	WIFI_PROTOCOL_11B	1
+#define	WIFI_PROTOCOL_11G	2
+#define	WIFI_PROTOCOL_11N	4
+#define	WIFI_PROTOCOL_LR	8
+esp_err_t esp_wifi_init(const wifi_init_config_t *);
+esp_err_t esp_wifi_deinit(void);
+esp_err_t esp_wifi_start(void);
+esp_err_t esp_wifi_stop(void);
+esp_err_t esp_wifi_connect(void);
+esp_err_t esp_wifi_set_storage(int);
+esp_err_t esp_wifi_set_ps(int);
+esp_err_t esp_wifi_set_protocol(wifi_interface_t, uint8_t);
+esp_err_t esp_wifi_set_mode(wifi_mode_t);
+esp_err_t esp_wifi_set_config(wifi_interface_t, wifi_config_t *);
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *);
+size_t spi_flash_get_chip_size(void);
+
+// TLS and OTA, present for types only
+typedef struct esp_tls esp_tls_t;
+typedef struct esp_tls_client_session esp_tls_client_session_t;
+typedef struct
+{
+   const void *cacert_buf;
+   unsigned cacert_bytes;
+   const char *common_name;
+   const void *clientcert_buf;
+   unsigned clientcert_bytes;
+   const void *clientkey_buf;
+   unsigned clientkey_bytes;
+   esp_err_t (*crt_bundle_attach)(void *);
+   int timeout_ms;
+} esp_tls_cfg_t;
+esp_err_t esp_crt_bundle_attach(void *);
+esp_err_t esp_tls_set_global_ca_store(const unsigned char *, unsigned int);
+typedef struct
+{
+   char version[32];
+   char project_name[32];
+   char time[16];
+   char date[16];
+   char idf_ver[32];
+} esp_app_desc_t;
+const esp_app_desc_t *esp_ota_get_app_description(void);
+const esp_app_desc_t *esp_app_get_description(void);
+typedef struct
+{
+   char label[17];
+   uint32_t size;
+   uint32_t address;
+   int type;
+   int subtype;
+} esp_partition_t;
+typedef uint32_t esp_ota_handle_t;
+const esp_partition_t *esp_ota_get_running_partition(void);
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *);
+esp_err_t esp_ota_begin(const esp_partition_t *, size_t, esp_ota_handle_t *);
+esp_err_t esp_ota_write(esp_ota_handle_t, const void *, size_t);
+esp_err_t esp_ota_end(esp_ota_handle_t);
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *);
+typedef struct esp_http_client *esp_http_client_handle_t;
+typedef struct
+{
+   const char *url;
+   const char *cert_pem;
+   esp_err_t (*crt_bundle_attach)(void *);
+   int timeout_ms;
+} esp_http_client_config_t;
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *);
+esp_err_t esp_http_client_open(esp_http_client_handle_t, int);
+int esp_http_client_fetch_headers(esp_http_client_handle_t);
+int esp_http_client_get_status_code(esp_http_client_handle_t);
+int esp_http_client_read(esp_http_client_handle_t, char *, int);
+int esp_http_client_read_response(esp_http_client_handle_t, char *, int);
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t);
+#define	SPI_FLASH_SEC_SIZE	4096
+
+// MQTT, test/host/mqtt.c stands in for lwmqtt as a broker that counts what is published
+typedef struct
+{
+   uint32_t sent;               // Messages published
+   uint32_t bytes;              // Topic and payload bytes published
+   uint32_t refused;            // Sends refused
+} host_mqtt_stats_t;
+struct lwmqtt_s;
+typedef void host_mqtt_hook_t(struct lwmqtt_s *, int tlen, const char *topic, int plen, const unsigned char *payload);
+extern host_mqtt_hook_t *host_mqtt_hook;        // Called for each message published
+struct lwmqtt_s *host_mqtt_new(void);   // A connected client
+host_mqtt_stats_t *host_mqtt_stats(struct lwmqtt_s *);
+void host_mqtt_refuse(struct lwmqtt_s *, int);  // Non zero to refuse sends
+void host_mqtt_noack(struct lwmqtt_s *, int);   // Non zero to hold QoS 1 sends unacknowledged
+void host_mqtt_close(struct lwmqtt_s *);        // Drop unacknowledged QoS 1 sends, as on closing the connection
+
+#endif
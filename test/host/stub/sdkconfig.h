@@ -0,0 +1,42 @@
+// Host build configuration, as sdkconfig.h from menuconfig, WiFi and MQTT (no mesh, AP config or MQTT server)
+#define	CONFIG_LOG_DEFAULT_LEVEL	3
+#define	CONFIG_FREERTOS_HZ	1000
+#define	CONFIG_TASK_WDT_PANIC	1
+#define	CONFIG_PARTITION_TABLE_OFFSET	0x8000
+#define	CONFIG_REVK_APPNAME	"Test"
+#define	CONFIG_REVK_OTAHOST	"ota.revk.uk"
+#define	CONFIG_REVK_OTACERT	""
+#define	CONFIG_REVK_NTPHOST	"pool.ntp.org"
+#define	CONFIG_REVK_TZ	"GMT0BST,M3.5.0,M10.5.0/2"
+#define	CONFIG_REVK_WIFI	1
+#define	CONFIG_REVK_WIFIRESET	0
+#define	CONFIG_REVK_WIFISSID	"test"
+#define	CONFIG_REVK_WIFIIP	""
+#define	CONFIG_REVK_WIFIGW	""
+#define	CONFIG_REVK_WIFIDNS	""
+#define	CONFIG_REVK_WIFIBSSID	""
+#define	CONFIG_REVK_WIFICHAN	0
+#define	CONFIG_REVK_WIFIPASS	"testtest"
+#define	CONFIG_REVK_APSSID	""
+#define	CONFIG_REVK_APPASS	""
+#define	CONFIG_REVK_APIP	"10.0.0.1/24"
+#define	CONFIG_REVK_APMAX	4
+#define	CONFIG_REVK_APLR	0
+#define	CONFIG_REVK_APHIDE	0
+#define	CONFIG_REVK_APPORT	0
+#define	CONFIG_REVK_APWAIT	0
+#define	CONFIG_REVK_APTIME	0
+#define	CONFIG_REVK_MQTT	1
+#define	CONFIG_REVK_MQTTHOST	"mqtt.revk.uk"
+#define	CONFIG_REVK_MQTTUSER	""
+#define	CONFIG_REVK_MQTTPASS	""
+#define	CONFIG_REVK_MQTTCERT	""
+#define	CONFIG_REVK_MQTTPORT	0
+#define	CONFIG_REVK_MQTT_CLIENTS	2
+#define	CONFIG_REVK_MQTT_QUEUE	8192
+#define	CONFIG_REVK_MQTT_RATE	20
+#define	CONFIG_REVK_MQTT_BURST	20
+#define	CONFIG_REVK_MQTT_TXQ	0
+#define	CONFIG_REVK_MQTT_WORKERS	1
+#define	CONFIG_REVK_MQTT_WORKQ	8
+#define	CONFIG_REVK_ERRORS	8
@@ -0,0 +1,158 @@
+// Outbound rate limit test: token bucket pacing, priority classes, and deferred and dropped counts, against the broker stand-in
+#include "revk.c"
+
+#define	LOG	256
+static char sent[LOG][16];      // Topic prefix of each message published, in order
+static int sends = 0;
+static int fails = 0;
+
+static void hook(struct lwmqtt_s *h, int tlen, const char *topic, int plen, const unsigned char *payload)
+{
+   int l = 0;
+   while (l < tlen && l < sizeof(*sent) - 1 && topic[l] != '/')
+      l++;
+   if (sends < LOG)
+   {
+      memcpy(sent[sends], topic, l);
+      sent[sends][l] = 0;
+   }
+   sends++;
+}
+
+static void expect(const char *what, int ok)
+{
+   printf("%-50s %s\n", what, ok ? "OK" : "FAIL");
+   if (!ok)
+      fails++;
+}
+
+static void publish(char *prefix, const char *payload)
+{
+   revk_mqtt_send_payload_clients(prefix, 0, "test", payload, 1);
+}
+
+static int drain(int ms)
+{                               // Drain as revk_task does every 100ms, for up to ms, returns ms taken to empty
+   int64_t start = esp_timer_get_time();
+   while (1)
+   {
+      revk_queue_drain();
+      int t = (esp_timer_get_time() - start) / 1000;
+      if (!queue || t >= ms)
+         return t;
+      usleep(100000);
+   }
+}
+
+int main(int argc, char *argv[])
+{
+   setvbuf(stdout, NULL, _IOLBF, 0);
+   host_nvs_reset();
+   revk_boot(NULL);
+   mqtt_client[0] = host_mqtt_new();
+   mqtt_clients = 1;
+   link_down = 0;
+   xEventGroupSetBits(revk_group, GROUP_MQTT);
+   host_mqtt_hook = hook;
+   // Burst
+   for (int i = 0; i < 50; i++)
+      publish(prefixinfo, "{\"n\":1}");
+   printf("50 sent at once: %d published, %u queued, %u deferred\n", sends, queue_count, queue_deferred);
+   expect("Burst published at once", sends == CONFIG_REVK_MQTT_BURST);
+   expect("Rest queued and counted deferred", queue_count == 50 - CONFIG_REVK_MQTT_BURST && queue_deferred == queue_count);
+   // Rate
+   int ms = drain(5000);
+   printf("Queue of %d drained in %dms at %d/s\n", 50 - CONFIG_REVK_MQTT_BURST, ms, CONFIG_REVK_MQTT_RATE);
+   expect("Drained at the rate", sends == 50 && ms >= (50 - CONFIG_REVK_MQTT_BURST - 2) * 1000 / CONFIG_REVK_MQTT_RATE && ms <= (50 - CONFIG_REVK_MQTT_BURST + 5) * 1000 / CONFIG_REVK_MQTT_RATE);
+   // Priority
+   queue_tokens[0] = 0;         // Bucket empty, so all of these queue
+   queue_token_time = esp_timer_get_time();
+   sends = 0;
+   publish(prefixsetting, "{\"bulk\":1}");
+   publish(prefixinfo, "{\"info\":1}");
+   publish(prefixevent, "{\"event\":1}");
+   publish(prefixstate, "{\"state\":1}");
+   publish(prefixerror, "{\"error\":1}");
+   expect("All queued with an empty bucket", sends == 0 && queue_count == 5);
+   drain(2000);
+   printf("Sent in order: %s %s %s %s %s\n", sent[0], sent[1], sent[2], sent[3], sent[4]);
+   expect("Highest class first", sends == 5 && !strcmp(sent[0], prefixerror) && !strcmp(sent[1], prefixstate) && !strcmp(sent[2], prefixevent) && !strcmp(sent[3], prefixinfo) && !strcmp(sent[4], prefixsetting));
+   // Offline
+   xEventGroupClearBits(revk_group, GROUP_MQTT);
+   sends = 0;
+   publish(prefixinfo, "{\"info\":2}");
+   publish(prefixevent, "{\"event\":2}");
+   expect("Offline, event held and info not", sends == 0 && queue_count == 1 && queue->pri == QUEUE_EVENT);
+   xEventGroupSetBits(revk_group, GROUP_MQTT);
+   drain(1000);
+   expect("Event sent on reconnect", sends == 1 && !strcmp(sent[0], prefixevent));
+   // Drop
+   queue_tokens[0] = 0;
+   queue_token_time = esp_timer_get_time();
+   char big[501];
+   memset(big, 'x', sizeof(big) - 1);
+   big[sizeof(big) - 1] = 0;
+   char payload[520];
+   snprintf(payload, sizeof(payload), "\"%s\"", big);
+   for (int i = 0; i < 2 * CONFIG_REVK_MQTT_QUEUE / 500; i++)
+      publish(prefixsetting, payload);
+   uint32_t dropped = queue_dropped;
+   printf("%d bulk messages of 500 bytes: %u queued (%u bytes), %u dropped\n", 2 * CONFIG_REVK_MQTT_QUEUE / 500, queue_count, queue_bytes, dropped);
+   expect("Queue stays in its limit and counts drops", queue_bytes <= CONFIG_REVK_MQTT_QUEUE && dropped > 0);
+   publish(prefixerror, payload);
+   int errors = 0;
+   for (revk_queue_t * q = queue; q; q = q->next)
+      if (q->pri == QUEUE_ERROR)
+         errors++;
+   expect("Error pushes out bulk when full", errors == 1 && queue_dropped == dropped + 1);
+   // Unacknowledged state
+   while (queue)
+      drain(100);
+   queue_tokens[0] = CONFIG_REVK_MQTT_BURST * 1000;
+   host_mqtt_noack(mqtt_client[0], 1);
+   sends = 0;
+   revk_mqtt_send_payload_clients(prefixstate, 1, "a", "{\"a\":1}", 1);
+   revk_mqtt_send_payload_clients(prefixstate, 1, "b", "{\"b\":1}", 1);
+   expect("State sent, nothing queued waiting PUBACK", sends == 2 && !queue);
+   queue_tokens[0] = 0;
+   queue_token_time = esp_timer_get_time();
+   revk_mqtt_send_payload_clients(prefixstate, 1, "b", "{\"b\":2}", 1);
+   host_mqtt_close(mqtt_client[0]);
+   int held = 0,
+       b2 = 0;
+   for (revk_queue_t * q = queue; q; q = q->next)
+   {
+      held++;
+      if (q->plen == 7 && !memcmp(q->data + q->tlen, "{\"b\":2}", 7))
+         b2++;
+   }
+   printf("Connection closed with 2 unacknowledged and a later state queued: %d queued\n", held);
+   expect("Unacknowledged back in queue, later state kept", held == 2 && b2 == 1);
+   host_mqtt_noack(mqtt_client[0], 0);
+   // Lost errors
+   while (queue)
+      drain(100);
+   queue_tokens[0] = CONFIG_REVK_MQTT_BURST * 1000;
+   for (int i = 0; i < CONFIG_REVK_ERRORS + 2; i++)
+   {
+      jo_t j = jo_object_alloc();
+      jo_int(j, "n", i);
+      revk_error_clients("lost", &j, 1);
+   }
+   expect("Ring full, oldest counted lost", error_lost == 2);
+   host_mqtt_refuse(mqtt_client[0], 1);
+   revk_error_flush();
+   host_mqtt_refuse(mqtt_client[0], 0);
+   expect("Lost count kept when send fails", error_lost == 2);
+   jo_t j = jo_object_alloc();
+   jo_int(j, "n", -1);
+   revk_error_clients("lost", &j, 1);
+   sleep(ERROR_FLUSH);
+   sends = 0;
+   revk_error_flush();
+   expect("Lost count cleared once sent", sends == 1 && !error_lost);
+   if (fails)
+      return 1;
+   printf("OK\n");
+   return 0;
+}